@@ -34,27 +34,734 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/time.h>
-#ifdef HAVE_SETXATTR
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <stddef.h>
+#include <sys/random.h>
 #include <sys/xattr.h>
+
+/* aes-ctr keeps each file's nonce in an extended attribute, so caesarfs needs
+   xattrs anyway, and must pass them through itself to keep the nonce out of
+   reach of setxattr() and removexattr() on the mount. */
+#ifndef HAVE_SETXATTR
+#define HAVE_SETXATTR 1
 #endif
 
+static int   storage_fd = -1;
 static char* storage_dir        = NULL;
-static char  storage_path[256];
-static int   key               = 0;
 
-char* prepend_storage_dir (char* pre_path, const char* path) {
-  strcpy(pre_path, storage_dir);
-  strcat(pre_path, path);
+/* Mount options understood by caesarfs itself (the rest go to libfuse). */
+struct caesar_config {
+  char*    cipher;
+  int      threads;
+  unsigned parallel_min;
+  int      bench;
+};
+
+static struct caesar_config config = {
+  .threads      = -1,
+  .parallel_min = 128 * 1024,
+};
+
+#define CAESAR_OPT(t, p, v) { t, offsetof(struct caesar_config, p), v }
+
+static struct fuse_opt caesar_opts[] = {
+  CAESAR_OPT("cipher=%s",       cipher,       0),
+  CAESAR_OPT("threads=%d",      threads,      0),
+  CAESAR_OPT("parallel_min=%u", parallel_min, 0),
+  CAESAR_OPT("bench",           bench,        1),
+  FUSE_OPT_END
+};
+
+/* The paths that FUSE hands us are absolute within the mount point.  Strip the
+   leading slash so that they can be resolved relative to storage_fd, which
+   saves the kernel from walking the storage directory's own path again. */
+static const char* relative_path (const char* path) {
+  while (*path == '/') {
+    path += 1;
+  }
+  return *path == '\0' ? "." : path;
+}
+
+#ifdef HAVE_SETXATTR
+/* There are no *at() variants of the xattr calls, so those still need a full
+   path into the storage directory. */
+static char* prepend_storage_dir (char* pre_path, const char* path) {
+  snprintf(pre_path, PATH_MAX, "%s%s", storage_dir, path);
   return pre_path;
 }
+#endif
+
+/* The Caesar cipher's kernel: add delta (mod 256) to each of n bytes of src,
+   storing the result in dst.  Encoding adds the key and decoding adds its
+   negation.  The vector variants are compiled for their instruction sets
+   individually and chosen at startup by select_shift_kernel(), so the binary
+   still runs on CPUs without them. */
+typedef void (*shift_kernel_t) (uint8_t* dst, const uint8_t* src, size_t n,
+                                uint8_t delta);
+
+static void shift_scalar (uint8_t* dst, const uint8_t* src, size_t n,
+                          uint8_t delta) {
+  for (size_t i = 0; i < n; i += 1) {
+    dst[i] = src[i] + delta;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void shift_sse2 (uint8_t* dst, const uint8_t* src, size_t n,
+                        uint8_t delta) {
+  const __m128i d = _mm_set1_epi8((char) delta);
+  size_t        i = (16 - ((uintptr_t) dst & 15)) & 15;
+
+  // Up to dst's first 16-byte boundary a byte at a time, so that every
+  // vector store after it is aligned.
+  if (i > n) {
+    i = n;
+  }
+  shift_scalar(dst, src, i, delta);
+
+  for (; i + 64 <= n; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (src + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (src + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*) (src + i + 32));
+    __m128i e = _mm_loadu_si128((const __m128i*) (src + i + 48));
+    _mm_store_si128((__m128i*) (dst + i),      _mm_add_epi8(a, d));
+    _mm_store_si128((__m128i*) (dst + i + 16), _mm_add_epi8(b, d));
+    _mm_store_si128((__m128i*) (dst + i + 32), _mm_add_epi8(c, d));
+    _mm_store_si128((__m128i*) (dst + i + 48), _mm_add_epi8(e, d));
+  }
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (src + i));
+    _mm_store_si128((__m128i*) (dst + i), _mm_add_epi8(a, d));
+  }
+  shift_scalar(dst + i, src + i, n - i, delta);
+}
+
+__attribute__((target("avx2")))
+static void shift_avx2 (uint8_t* dst, const uint8_t* src, size_t n,
+                        uint8_t delta) {
+  const __m256i d = _mm256_set1_epi8((char) delta);
+  size_t        i = (32 - ((uintptr_t) dst & 31)) & 31;
+
+  // As in shift_avx512, keep the vector stores within cache lines.
+  if (i > n) {
+    i = n;
+  }
+  shift_scalar(dst, src, i, delta);
+
+  for (; i + 128 <= n; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (src + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*) (src + i + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i*) (src + i + 96));
+    _mm256_storeu_si256((__m256i*) (dst + i),      _mm256_add_epi8(a, d));
+    _mm256_storeu_si256((__m256i*) (dst + i + 32), _mm256_add_epi8(b, d));
+    _mm256_storeu_si256((__m256i*) (dst + i + 64), _mm256_add_epi8(c, d));
+    _mm256_storeu_si256((__m256i*) (dst + i + 96), _mm256_add_epi8(e, d));
+  }
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (src + i));
+    _mm256_storeu_si256((__m256i*) (dst + i), _mm256_add_epi8(a, d));
+  }
+  shift_scalar(dst + i, src + i, n - i, delta);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void shift_avx512 (uint8_t* dst, const uint8_t* src, size_t n,
+                          uint8_t delta) {
+  const __m512i d = _mm512_set1_epi8((char) delta);
+  size_t        i = (64 - ((uintptr_t) dst & 63)) & 63;
+
+  // Stores that straddle cache lines cost more than the arithmetic, so do
+  // the bytes up to dst's first 64-byte boundary with a masked operation.
+  if (i > n) {
+    i = n;
+  }
+  if (i > 0) {
+    __mmask64 m = (__mmask64) ((1ULL << i) - 1);
+    __m512i   a = _mm512_maskz_loadu_epi8(m, src);
+    _mm512_mask_storeu_epi8(dst, m, _mm512_add_epi8(a, d));
+  }
+
+  for (; i + 256 <= n; i += 256) {
+    __m512i a = _mm512_loadu_si512(src + i);
+    __m512i b = _mm512_loadu_si512(src + i + 64);
+    __m512i c = _mm512_loadu_si512(src + i + 128);
+    __m512i e = _mm512_loadu_si512(src + i + 192);
+    _mm512_storeu_si512(dst + i,       _mm512_add_epi8(a, d));
+    _mm512_storeu_si512(dst + i + 64,  _mm512_add_epi8(b, d));
+    _mm512_storeu_si512(dst + i + 128, _mm512_add_epi8(c, d));
+    _mm512_storeu_si512(dst + i + 192, _mm512_add_epi8(e, d));
+  }
+  for (; i + 64 <= n; i += 64) {
+    __m512i a = _mm512_loadu_si512(src + i);
+    _mm512_storeu_si512(dst + i, _mm512_add_epi8(a, d));
+  }
+  if (i < n) {
+    // A masked load/store handles the last partial vector in one go.
+    __mmask64 m = (__mmask64) ((1ULL << (n - i)) - 1);
+    __m512i   a = _mm512_maskz_loadu_epi8(m, src + i);
+    _mm512_mask_storeu_epi8(dst + i, m, _mm512_add_epi8(a, d));
+  }
+}
+#endif
+
+static shift_kernel_t shift_bytes      = shift_scalar;
+static const char*    shift_bytes_name = "scalar";
+
+/* Writes are encoded a chunk at a time into a buffer that each FUSE worker
+   thread allocates once, rather than into a stack copy of the whole request.
+   A chunk is as large as any request the kernel sends, so that the encoding of
+   a whole request can be spread over the worker pool at once. */
+#define ENCODE_CHUNK (1024 * 1024)
+
+static pthread_key_t encode_buf_key;
+
+static uint8_t* get_encode_buf (void) {
+  void* buf = pthread_getspecific(encode_buf_key);
+
+  if (buf == NULL) {
+    if (posix_memalign(&buf, 64, ENCODE_CHUNK) != 0) {
+      return NULL;
+    }
+    pthread_setspecific(encode_buf_key, buf);
+  }
+  return buf;
+}
+
+static void select_shift_kernel (void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    shift_bytes      = shift_avx512;
+    shift_bytes_name = "avx512";
+    return;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    shift_bytes      = shift_avx2;
+    shift_bytes_name = "avx2";
+    return;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    shift_bytes      = shift_sse2;
+    shift_bytes_name = "sse2";
+    return;
+  }
+#endif
+  shift_bytes      = shift_scalar;
+  shift_bytes_name = "scalar";
+}
+
+/* AES-128 in counter mode.  Byte i of a file is XORed with byte (i % 16) of
+   the encryption of the counter block for i / 16, so any range of a file can
+   be encoded or decoded on its own and pread()/pwrite() at arbitrary offsets
+   never touch neighbouring data.  The counter block holds a per-file nonce in
+   its first eight bytes and the block number, big-endian, in the last eight;
+   the nonce lives in an extended attribute of the backing file (see
+   get_file_nonce()). */
+#define AES_BLOCK  16
+#define AES_ROUNDS 10
+
+static uint8_t aes_round_keys[(AES_ROUNDS + 1) * AES_BLOCK];
+
+static const uint8_t aes_sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t aes_xtime (uint8_t x) {
+  return (uint8_t) ((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+static void aes_expand_key (const uint8_t key[AES_BLOCK]) {
+  uint8_t* rk   = aes_round_keys;
+  uint8_t  rcon = 1;
+
+  memcpy(rk, key, AES_BLOCK);
+  for (int i = AES_BLOCK; i < (AES_ROUNDS + 1) * AES_BLOCK; i += 4) {
+    uint8_t t[4] = { rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1] };
+
+    if (i % AES_BLOCK == 0) {
+      uint8_t t0 = t[0];
+      t[0] = aes_sbox[t[1]] ^ rcon;
+      t[1] = aes_sbox[t[2]];
+      t[2] = aes_sbox[t[3]];
+      t[3] = aes_sbox[t0];
+      rcon = aes_xtime(rcon);
+    }
+    for (int j = 0; j < 4; j += 1) {
+      rk[i + j] = rk[i - AES_BLOCK + j] ^ t[j];
+    }
+  }
+}
+
+/* Encrypt one block in place, one byte at a time.  Only used when the CPU has
+   no AES instructions. */
+static void aes_encrypt_block (uint8_t s[AES_BLOCK]) {
+  const uint8_t* rk = aes_round_keys;
+
+  for (int i = 0; i < AES_BLOCK; i += 1) {
+    s[i] ^= rk[i];
+  }
+  for (int round = 1; round <= AES_ROUNDS; round += 1) {
+    uint8_t t[AES_BLOCK];
+
+    // SubBytes and ShiftRows: row r of the column-major state rotates
+    // left by r columns.
+    for (int c = 0; c < 4; c += 1) {
+      for (int r = 0; r < 4; r += 1) {
+        t[4 * c + r] = aes_sbox[s[4 * ((c + r) % 4) + r]];
+      }
+    }
+    // MixColumns, skipped in the last round.
+    for (int c = 0; c < 4; c += 1) {
+      uint8_t* a = t + 4 * c;
+      if (round < AES_ROUNDS) {
+        uint8_t all = a[0] ^ a[1] ^ a[2] ^ a[3];
+        uint8_t a0  = a[0];
+        s[4 * c + 0] = a[0] ^ all ^ aes_xtime(a[0] ^ a[1]);
+        s[4 * c + 1] = a[1] ^ all ^ aes_xtime(a[1] ^ a[2]);
+        s[4 * c + 2] = a[2] ^ all ^ aes_xtime(a[2] ^ a[3]);
+        s[4 * c + 3] = a[3] ^ all ^ aes_xtime(a[3] ^ a0);
+      } else {
+        memcpy(s + 4 * c, a, 4);
+      }
+    }
+    for (int i = 0; i < AES_BLOCK; i += 1) {
+      s[i] ^= rk[round * AES_BLOCK + i];
+    }
+  }
+}
+
+/* XOR nblocks whole blocks of src with the keystream starting at counter block
+   number block, storing the result in dst (which may equal src). */
+typedef void (*ctr_kernel_t) (uint8_t* dst, const uint8_t* src, size_t nblocks,
+                              uint64_t nonce, uint64_t block);
+
+static void aes_ctr_soft (uint8_t* dst, const uint8_t* src, size_t nblocks,
+                          uint64_t nonce, uint64_t block) {
+  for (size_t b = 0; b < nblocks; b += 1) {
+    uint8_t  ks[AES_BLOCK];
+    uint64_t counter = block + b;
+
+    for (int i = 0; i < 8; i += 1) {
+      ks[i]     = (uint8_t) (nonce >> (8 * i));
+      ks[8 + i] = (uint8_t) (counter >> (8 * (7 - i)));
+    }
+    aes_encrypt_block(ks);
+    for (int i = 0; i < AES_BLOCK; i += 1) {
+      dst[b * AES_BLOCK + i] = src[b * AES_BLOCK + i] ^ ks[i];
+    }
+  }
+}
+
+#if defined(__x86_64__)
+/* With AES-NI, eight independent counter blocks are kept in flight so that
+   the latency of each aesenc is hidden behind the others. */
+__attribute__((target("aes,sse2")))
+static void aes_ctr_aesni (uint8_t* dst, const uint8_t* src, size_t nblocks,
+                           uint64_t nonce, uint64_t block) {
+  __m128i rk[AES_ROUNDS + 1];
+  size_t  b = 0;
+
+  for (int r = 0; r <= AES_ROUNDS; r += 1) {
+    rk[r] = _mm_loadu_si128((const __m128i*) (aes_round_keys + r * AES_BLOCK));
+  }
+
+  for (; b + 8 <= nblocks; b += 8) {
+    __m128i x[8];
+
+    #pragma GCC unroll 8
+    for (int j = 0; j < 8; j += 1) {
+      x[j] = _mm_set_epi64x((long long) __builtin_bswap64(block + b + j),
+                            (long long) nonce);
+      x[j] = _mm_xor_si128(x[j], rk[0]);
+    }
+    for (int r = 1; r < AES_ROUNDS; r += 1) {
+      #pragma GCC unroll 8
+    for (int j = 0; j < 8; j += 1) {
+        x[j] = _mm_aesenc_si128(x[j], rk[r]);
+      }
+    }
+    #pragma GCC unroll 8
+    for (int j = 0; j < 8; j += 1) {
+      const __m128i* in  = (const __m128i*) (src + (b + j) * AES_BLOCK);
+      __m128i*       out = (__m128i*) (dst + (b + j) * AES_BLOCK);
+      x[j] = _mm_aesenclast_si128(x[j], rk[AES_ROUNDS]);
+      _mm_storeu_si128(out, _mm_xor_si128(x[j], _mm_loadu_si128(in)));
+    }
+  }
+  for (; b < nblocks; b += 1) {
+    const __m128i* in  = (const __m128i*) (src + b * AES_BLOCK);
+    __m128i*       out = (__m128i*) (dst + b * AES_BLOCK);
+    __m128i        x;
+
+    x = _mm_set_epi64x((long long) __builtin_bswap64(block + b),
+                       (long long) nonce);
+    x = _mm_xor_si128(x, rk[0]);
+    for (int r = 1; r < AES_ROUNDS; r += 1) {
+      x = _mm_aesenc_si128(x, rk[r]);
+    }
+    x = _mm_aesenclast_si128(x, rk[AES_ROUNDS]);
+    _mm_storeu_si128(out, _mm_xor_si128(x, _mm_loadu_si128(in)));
+  }
+}
+#endif
+
+static ctr_kernel_t aes_ctr_blocks = aes_ctr_soft;
+
+/* Apply the keystream to n bytes that start at byte offset of the file.  The
+   same operation both encodes and decodes. */
+static void aes_ctr_apply (uint8_t* dst, const uint8_t* src, size_t n,
+                           off_t offset, uint64_t nonce) {
+  uint64_t block = (uint64_t) offset / AES_BLOCK;
+  size_t   skip  = (uint64_t) offset % AES_BLOCK;
+
+  while (n > 0) {
+    if (skip == 0 && n >= AES_BLOCK) {
+      size_t nblocks = n / AES_BLOCK;
+      aes_ctr_blocks(dst, src, nblocks, nonce, block);
+      block += nblocks;
+      dst   += nblocks * AES_BLOCK;
+      src   += nblocks * AES_BLOCK;
+      n     -= nblocks * AES_BLOCK;
+    } else {
+      // A partial block at either end goes through a scratch block.
+      uint8_t tmp[AES_BLOCK] = { 0 };
+      size_t  m = AES_BLOCK - skip < n ? AES_BLOCK - skip : n;
+
+      memcpy(tmp + skip, src, m);
+      aes_ctr_blocks(tmp, tmp, 1, nonce, block);
+      memcpy(dst, tmp + skip, m);
+      block += 1;
+      skip   = 0;
+      dst   += m;
+      src   += m;
+      n     -= m;
+    }
+  }
+}
+
+static int aes_set_key (const char* text) {
+  uint8_t key[AES_BLOCK];
+
+  if (strlen(text) != 2 * AES_BLOCK) {
+    return -1;
+  }
+  for (int i = 0; i < AES_BLOCK; i += 1) {
+    unsigned byte;
+    if (sscanf(text + 2 * i, "%2x", &byte) != 1) {
+      return -1;
+    }
+    key[i] = (uint8_t) byte;
+  }
+  aes_expand_key(key);
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes")) {
+    aes_ctr_blocks = aes_ctr_aesni;
+  }
+#endif
+  return 0;
+}
+
+static const char* aes_describe (void) {
+#if defined(__x86_64__)
+  if (aes_ctr_blocks == aes_ctr_aesni) {
+    return "aes-ni";
+  }
+#endif
+  return "software AES";
+}
+
+/* The Caesar shift, as a transform.  The file's offset and nonce are of no
+   interest to it. */
+static uint8_t caesar_shift = 0;
+
+static int caesar_set_key (const char* text) {
+  char* end;
+  long  shift = strtol(text, &end, 10);
+
+  if (*text == '\0' || *end != '\0') {
+    return -1;
+  }
+  caesar_shift = (uint8_t) shift;
+  return 0;
+}
+
+static void caesar_encode (uint8_t* dst, const uint8_t* src, size_t n,
+                           off_t offset, uint64_t nonce) {
+  (void) offset;
+  (void) nonce;
+  shift_bytes(dst, src, n, caesar_shift);
+}
+
+static void caesar_decode (uint8_t* dst, const uint8_t* src, size_t n,
+                           off_t offset, uint64_t nonce) {
+  (void) offset;
+  (void) nonce;
+  shift_bytes(dst, src, n, (uint8_t) -caesar_shift);
+}
+
+static const char* caesar_describe (void) {
+  return shift_bytes_name;
+}
+
+/* A transform encodes data on its way into the storage directory and decodes
+   it on the way back out.  Both directions are told the file offset of the
+   first byte, so a seekable cipher can work on any range of a file in
+   isolation, and the file's nonce if the transform asked for one. */
+struct transform {
+  const char* name;
+  int         uses_nonce;
+  int         (*set_key)  (const char* text);
+  void        (*encode)   (uint8_t* dst, const uint8_t* src, size_t n,
+                           off_t offset, uint64_t nonce);
+  void        (*decode)   (uint8_t* dst, const uint8_t* src, size_t n,
+                           off_t offset, uint64_t nonce);
+  const char* (*describe) (void);
+};
+
+static const struct transform transforms[] = {
+  { "caesar",  0, caesar_set_key, caesar_encode, caesar_decode, caesar_describe },
+  { "aes-ctr", 1, aes_set_key,    aes_ctr_apply, aes_ctr_apply, aes_describe    },
+};
+
+static const struct transform* transform = &transforms[0];
+
+/* Large buffers are split into slices that a fixed pool of worker threads
+   transforms in parallel with the FUSE thread that asked for the work.  Slices
+   are whole cache lines, so that no two threads store into the same line, and
+   requests smaller than parallel_min are not worth waking anyone up for. */
+#define SLICE_ALIGN 64
+#define SLICE_MIN   (16 * 1024)
+#define SLICE_QUEUE 256
+
+typedef void (*transform_fn_t) (uint8_t* dst, const uint8_t* src, size_t n,
+                                off_t offset, uint64_t nonce);
+
+struct transform_slice {
+  transform_fn_t fn;
+  uint8_t*       dst;
+  const uint8_t* src;
+  size_t         n;
+  off_t          offset;
+  uint64_t       nonce;
+  int*           remaining;   // slices of the same request still in flight
+};
+
+static pthread_mutex_t        pool_lock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         pool_work       = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t         pool_done       = PTHREAD_COND_INITIALIZER;
+static struct transform_slice pool_queue[SLICE_QUEUE];
+static unsigned               pool_head       = 0;
+static unsigned               pool_count      = 0;
+static unsigned               pool_workers    = 0;
+
+// Take the oldest queued slice.  Call with pool_lock held.
+static struct transform_slice pool_pop (void) {
+  struct transform_slice slice = pool_queue[pool_head];
+
+  pool_head   = (pool_head + 1) % SLICE_QUEUE;
+  pool_count -= 1;
+  return slice;
+}
+
+// Transform one slice and report it finished.  Call with pool_lock held; it
+// is dropped while the slice is worked on.
+static void pool_run (struct transform_slice slice) {
+  pthread_mutex_unlock(&pool_lock);
+  slice.fn(slice.dst, slice.src, slice.n, slice.offset, slice.nonce);
+  pthread_mutex_lock(&pool_lock);
+  *slice.remaining -= 1;
+  if (*slice.remaining == 0) {
+    pthread_cond_broadcast(&pool_done);
+  }
+}
+
+static void* pool_worker (void* arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (pool_count == 0) {
+      pthread_cond_wait(&pool_work, &pool_lock);
+    }
+    pool_run(pool_pop());
+  }
+  return NULL;
+}
+
+/* Start the workers.  Returns the number actually started. */
+static unsigned pool_start (unsigned workers) {
+  for (unsigned i = 0; i < workers; i += 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    pool_workers += 1;
+  }
+  return pool_workers;
+}
+
+/* Apply fn to n bytes that start at byte offset of the file, in parallel when
+   the request is large enough.  Returns once every byte has been done. */
+static void run_transform (transform_fn_t fn, uint8_t* dst, const uint8_t* src,
+                           size_t n, off_t offset, uint64_t nonce,
+                           size_t parallel_min) {
+  // One slice per worker plus one for this thread, but none so small that
+  // handing it over costs more than doing it.
+  size_t nslices = n / SLICE_MIN < pool_workers + 1 ? n / SLICE_MIN : pool_workers + 1;
+
+  if (nslices < 2 || n < parallel_min) {
+    fn(dst, src, n, offset, nonce);
+    return;
+  }
+
+  size_t slice   = (n / nslices + SLICE_ALIGN - 1) & ~(size_t) (SLICE_ALIGN - 1);
+  int    remaining = 0;
+  size_t queued    = slice;
+
+  // This thread keeps the first slice, plus whatever does not fit in the
+  // queue.
+  pthread_mutex_lock(&pool_lock);
+  for (; queued < n && pool_count < SLICE_QUEUE; queued += slice) {
+    struct transform_slice* s = &pool_queue[(pool_head + pool_count) % SLICE_QUEUE];
+    s->fn        = fn;
+    s->dst       = dst + queued;
+    s->src       = src + queued;
+    s->n         = n - queued < slice ? n - queued : slice;
+    s->offset    = offset + queued;
+    s->nonce     = nonce;
+    s->remaining = &remaining;
+    pool_count  += 1;
+    remaining   += 1;
+  }
+  pthread_cond_broadcast(&pool_work);
+  pthread_mutex_unlock(&pool_lock);
+
+  fn(dst, src, slice < n ? slice : n, offset, nonce);
+  if (queued < n) {
+    fn(dst + queued, src + queued, n - queued, offset + queued, nonce);
+  }
+
+  // Rather than sleep while slices are still queued, help with them; they
+  // may belong to some other request, but finishing them is never wasted.
+  pthread_mutex_lock(&pool_lock);
+  while (remaining > 0) {
+    if (pool_count > 0) {
+      pool_run(pool_pop());
+    } else {
+      pthread_cond_wait(&pool_done, &pool_lock);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* The extended attribute of each backing file that holds its nonce. */
+#define NONCE_XATTR "user.caesarfs.nonce"
+
+/* Find the nonce of the open backing file fd.  If it has none yet and create
+   is set, give it a fresh random one; otherwise that is -ENODATA.  Only
+   operations that write to the file create a nonce, so reading a file does not
+   need write access to it.  Returns 0 or a negative errno. */
+static int get_file_nonce (int fd, uint64_t* nonce, int create) {
+  if (!transform->uses_nonce) {
+    *nonce = 0;
+    return 0;
+  }
+
+  while (1) {
+    ssize_t res = fgetxattr(fd, NONCE_XATTR, nonce, sizeof(*nonce));
+    if (res == sizeof(*nonce)) {
+      return 0;
+    }
+    if (res >= 0) {
+      return -EIO;
+    }
+    if (errno != ENODATA || !create) {
+      return -errno;
+    }
+
+    // XATTR_CREATE makes a racing writer lose cleanly and re-read the
+    // winner's nonce.
+    if (getrandom(nonce, sizeof(*nonce), 0) != sizeof(*nonce)) {
+      return -EIO;
+    }
+    if (fsetxattr(fd, NONCE_XATTR, nonce, sizeof(*nonce), XATTR_CREATE) == 0) {
+      return 0;
+    }
+    if (errno != EEXIST) {
+      return -errno;
+    }
+  }
+}
+
+/* A backing file that grows without being written to, by truncate(),
+   fallocate() or a write past its end, reads back zeros there, and zeros
+   decode to noise: the keystream for aes-ctr, the negated shift for caesar.
+   So the encoding of zeros is written there instead.  Working out how far
+   the file reaches and filling up to there has to happen in one go, or a
+   write racing into the gap could be overwritten; growing is serialised on a
+   lock picked by the file's inode number. */
+#define GROW_LOCKS 64
+
+static pthread_mutex_t grow_locks[GROW_LOCKS] = {
+  [0 ... GROW_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t* grow_lock (const struct stat* st) {
+  return &grow_locks[st->st_ino % GROW_LOCKS];
+}
+
+// Write the encoding of zeros into [from, to) of the backing file fd.
+static int fill_zeros (int fd, off_t from, off_t to, uint64_t nonce) {
+  uint8_t* buf = get_encode_buf();
+
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  while (from < to) {
+    size_t n = to - from < ENCODE_CHUNK ? (size_t) (to - from) : ENCODE_CHUNK;
+    memset(buf, 0, n);
+    run_transform(transform->encode, buf, buf, n, from, nonce, config.parallel_min);
+    ssize_t written = pwrite(fd, buf, n, from);
+    if (written == -1) {
+      return -errno;
+    }
+    from += written;
+  }
+  return 0;
+}
 
 static int caesar_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
 	
-	path = prepend_storage_dir(storage_path, path);
-	res = lstat(path, stbuf);
+	res = fstatat(storage_fd, relative_path(path), stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -65,8 +772,7 @@ static int caesar_access(const char *path, int mask)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = access(path, mask);
+	res = faccessat(storage_fd, relative_path(path), mask, 0);
 	if (res == -1)
 		return -errno;
 
@@ -77,8 +783,7 @@ static int caesar_readlink(const char *path, char *buf, size_t size)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = readlink(path, buf, size - 1);
+	res = readlinkat(storage_fd, relative_path(path), buf, size - 1);
 	if (res == -1)
 		return -errno;
 
@@ -92,15 +797,22 @@ static int caesar_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
 	DIR *dp;
 	struct dirent *de;
+	int fd;
 
 	(void) offset;
 	(void) fi;
 
-	path = prepend_storage_dir(storage_path, path);
-	dp = opendir(path);
-	if (dp == NULL)
+	fd = openat(storage_fd, relative_path(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
 		return -errno;
 
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
 		memset(&st, 0, sizeof(st));
@@ -118,17 +830,25 @@ static int caesar_mknod(const char *path, mode_t mode, dev_t rdev)
 {
 	int res;
 
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	path = prepend_storage_dir(storage_path, path);
+	/* On Linux this could just be 'mknodat(fd, path, mode, rdev)' but
+	   this is more portable */
+	path = relative_path(path);
 	if (S_ISREG(mode)) {
-		res = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
-		if (res >= 0)
-			res = close(res);
+		uint64_t nonce;
+		int fd = openat(storage_fd, path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (fd == -1)
+			return -errno;
+		res = get_file_nonce(fd, &nonce, 1);
+		close(fd);
+		if (res < 0) {
+			unlinkat(storage_fd, path, 0);
+			return res;
+		}
+		return 0;
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
+		res = mkfifoat(storage_fd, path, mode);
 	else
-		res = mknod(path, mode, rdev);
+		res = mknodat(storage_fd, path, mode, rdev);
 	if (res == -1)
 		return -errno;
 
@@ -139,8 +859,7 @@ static int caesar_mkdir(const char *path, mode_t mode)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = mkdir(path, mode);
+	res = mkdirat(storage_fd, relative_path(path), mode);
 	if (res == -1)
 		return -errno;
 
@@ -151,8 +870,7 @@ static int caesar_unlink(const char *path)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = unlink(path);
+	res = unlinkat(storage_fd, relative_path(path), 0);
 	if (res == -1)
 		return -errno;
 
@@ -163,8 +881,7 @@ static int caesar_rmdir(const char *path)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = rmdir(path);
+	res = unlinkat(storage_fd, relative_path(path), AT_REMOVEDIR);
 	if (res == -1)
 		return -errno;
 
@@ -174,12 +891,10 @@ static int caesar_rmdir(const char *path)
 static int caesar_symlink(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = symlink(storage_from, storage_to);
+	/* The link's contents are stored as given, so that relative links
+	   keep pointing inside the mount. */
+	res = symlinkat(from, storage_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -189,12 +904,9 @@ static int caesar_symlink(const char *from, const char *to)
 static int caesar_rename(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = rename(storage_from, storage_to);
+	res = renameat(storage_fd, relative_path(from),
+		       storage_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -204,12 +916,9 @@ static int caesar_rename(const char *from, const char *to)
 static int caesar_link(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = link(storage_from, storage_to);
+	res = linkat(storage_fd, relative_path(from),
+		     storage_fd, relative_path(to), 0);
 	if (res == -1)
 		return -errno;
 
@@ -220,8 +929,7 @@ static int caesar_chmod(const char *path, mode_t mode)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = chmod(path, mode);
+	res = fchmodat(storage_fd, relative_path(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
@@ -232,8 +940,8 @@ static int caesar_chown(const char *path, uid_t uid, gid_t gid)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = lchown(path, uid, gid);
+	res = fchownat(storage_fd, relative_path(path), uid, gid,
+		       AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -242,13 +950,35 @@ static int caesar_chown(const char *path, uid_t uid, gid_t gid)
 
 static int caesar_truncate(const char *path, off_t size)
 {
+	int fd;
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = truncate(path, size);
-	if (res == -1)
+	fd = openat(storage_fd, relative_path(path), O_WRONLY);
+	if (fd == -1)
 		return -errno;
 
+	// Growing the file adds bytes that will be decoded, so it needs a nonce
+	// like a write does, and they are filled with encoded zeros.
+	uint64_t nonce;
+	struct stat st;
+	res = get_file_nonce(fd, &nonce, 1);
+	if (res == 0 && fstat(fd, &st) == -1)
+		res = -errno;
+	if (res == 0) {
+		pthread_mutex_lock(grow_lock(&st));
+		if (fstat(fd, &st) == -1)
+			res = -errno;
+		else if (size > st.st_size)
+			res = fill_zeros(fd, st.st_size, size, nonce);
+		else if (ftruncate(fd, size) == -1)
+			res = -errno;
+		pthread_mutex_unlock(grow_lock(&st));
+	}
+
+	close(fd);
+	if (res < 0)
+		return res;
+
 	return 0;
 }
 
@@ -258,8 +988,7 @@ static int caesar_utimens(const char *path, const struct timespec ts[2])
 	int res;
 
 	/* don't use utime/utimes since they follow symlinks */
-	path = prepend_storage_dir(storage_path, path);
-	res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
+	res = utimensat(storage_fd, relative_path(path), ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -271,8 +1000,7 @@ static int caesar_open(const char *path, struct fuse_file_info *fi)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = open(path, fi->flags);
+	res = openat(storage_fd, relative_path(path), fi->flags);
 	if (res == -1)
 		return -errno;
 
@@ -286,24 +1014,36 @@ static int caesar_read(const char *path, char *buf, size_t size, off_t offset,
 {
 	int fd;
 	int res;
-	int i;
-	char temp_buf[size];
+	uint64_t nonce;
 
 	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_RDONLY);
+	fd = openat(storage_fd, relative_path(path), O_RDONLY);
 	if (fd == -1)
 		return -errno;
 
-	res = pread(fd, temp_buf, size, offset);
+	// A file without a nonce was never written through caesarfs, so there
+	// is nothing in it that can be decoded.
+	res = get_file_nonce(fd, &nonce, 0);
+	if (res == -ENODATA) {
+		struct stat st;
+		res = fstat(fd, &st) == -1 ? -errno : st.st_size > 0 ? -EIO : 0;
+		close(fd);
+		return res;
+	}
+	if (res < 0) {
+		close(fd);
+		return res;
+	}
+
+	res = pread(fd, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	// Copy the read data from a temporary buffer with each character
-	// (un)shifted.
-	for (i = 0; i < size; i += 1) {
-	  buf[i] = (temp_buf[i] - key) % 256;
-	}
+	// Decode in place in the buffer FUSE gave us.
+	if (res > 0)
+		run_transform(transform->decode, (uint8_t *) buf,
+			      (uint8_t *) buf, res, offset, nonce,
+			      config.parallel_min);
 
 	close(fd);
 	return res;
@@ -313,36 +1053,78 @@ static int caesar_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
 	int fd;
-	int res;
-	int i;
-	char temp_buf[size];
+	int res = 0;
+	size_t done = 0;
+	uint64_t nonce;
+	uint8_t *temp_buf;
+	struct stat st;
+	int growing;
 
 	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
+	temp_buf = get_encode_buf();
+	if (temp_buf == NULL)
+		return -ENOMEM;
+
+	fd = openat(storage_fd, relative_path(path), O_WRONLY);
 	if (fd == -1)
 		return -errno;
 
-	// Copy the provided data into a temporary buffer with each character
-	// shifted.
-	for (i = 0; i < size; i += 1) {
-	  temp_buf[i] = (buf[i] + key) % 256;
+	res = get_file_nonce(fd, &nonce, 1);
+	if (res == 0 && fstat(fd, &st) == -1)
+		res = -errno;
+	if (res < 0) {
+		close(fd);
+		return res;
 	}
 
-	res = pwrite(fd, temp_buf, size, offset);
-	if (res == -1)
-		res = -errno;
+	// A write that starts past the end leaves a gap to be filled first.
+	growing = offset + (off_t) size > st.st_size;
+	if (growing) {
+		pthread_mutex_lock(grow_lock(&st));
+		if (fstat(fd, &st) == -1)
+			res = -errno;
+		else if (offset > st.st_size)
+			res = fill_zeros(fd, st.st_size, offset, nonce);
+		if (res < 0) {
+			pthread_mutex_unlock(grow_lock(&st));
+			close(fd);
+			return res;
+		}
+	}
 
+	// The caller's buffer is read-only, so encode the data into the
+	// per-thread buffer one chunk at a time and write each chunk out.
+	while (done < size) {
+		size_t n = size - done < ENCODE_CHUNK ? size - done : ENCODE_CHUNK;
+		ssize_t written;
+
+		run_transform(transform->encode, temp_buf,
+			      (const uint8_t *) buf + done, n, offset + done,
+			      nonce, config.parallel_min);
+		written = pwrite(fd, temp_buf, n, offset + done);
+		if (written == -1) {
+			res = -errno;
+			break;
+		}
+		done += written;
+		if ((size_t) written < n)
+			break;
+	}
+
+	if (growing)
+		pthread_mutex_unlock(grow_lock(&st));
 	close(fd);
-	return res;
+
+	// A partial write is still reported as such.
+	return done > 0 ? (int) done : res;
 }
 
 static int caesar_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = statvfs(path, stbuf);
+	(void) path;
+	res = fstatvfs(storage_fd, stbuf);
 	if (res == -1)
 		return -errno;
 
@@ -383,12 +1165,26 @@ static int caesar_fallocate(const char *path, int mode,
 	if (mode)
 		return -EOPNOTSUPP;
 
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
+	fd = openat(storage_fd, relative_path(path), O_WRONLY);
 	if (fd == -1)
 		return -errno;
 
-	res = -posix_fallocate(fd, offset, length);
+	// What it adds past the end is filled with encoded zeros.
+	uint64_t nonce;
+	struct stat st;
+	res = get_file_nonce(fd, &nonce, 1);
+	if (res == 0 && fstat(fd, &st) == -1)
+		res = -errno;
+	if (res == 0) {
+		pthread_mutex_lock(grow_lock(&st));
+		if (fstat(fd, &st) == -1)
+			res = -errno;
+		else
+			res = -posix_fallocate(fd, offset, length);
+		if (res == 0 && offset + length > st.st_size)
+			res = fill_zeros(fd, st.st_size, offset + length, nonce);
+		pthread_mutex_unlock(grow_lock(&st));
+	}
 
 	close(fd);
 	return res;
@@ -400,6 +1196,11 @@ static int caesar_fallocate(const char *path, int mode,
 static int caesar_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
+	// Losing a file's nonce would make its contents unreadable.
+	if (strcmp(name, NONCE_XATTR) == 0)
+		return -EPERM;
+
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lsetxattr(path, name, value, size, flags);
 	if (res == -1)
@@ -410,6 +1211,7 @@ static int caesar_setxattr(const char *path, const char *name, const char *value
 static int caesar_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lgetxattr(path, name, value, size);
 	if (res == -1)
@@ -419,6 +1221,7 @@ static int caesar_getxattr(const char *path, const char *name, char *value,
 
 static int caesar_listxattr(const char *path, char *list, size_t size)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = llistxattr(path, list, size);
 	if (res == -1)
@@ -428,6 +1231,10 @@ static int caesar_listxattr(const char *path, char *list, size_t size)
 
 static int caesar_removexattr(const char *path, const char *name)
 {
+	if (strcmp(name, NONCE_XATTR) == 0)
+		return -EPERM;
+
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lremovexattr(path, name);
 	if (res == -1)
@@ -436,7 +1243,102 @@ static int caesar_removexattr(const char *path, const char *name)
 }
 #endif /* HAVE_SETXATTR */
 
+static void *caesar_init(struct fuse_conn_info *conn)
+{
+	unsigned started;
+
+	(void) conn;
+
+	// The workers are started here rather than in main(), since fuse_main()
+	// forks when it puts itself in the background and threads do not
+	// survive that.  Without them, every request is ciphered by the
+	// thread that serves it.
+	if (config.threads > 0) {
+		started = pool_start(config.threads);
+		if (started < (unsigned) config.threads)
+			fprintf(stderr, "ERROR: Only %u of %d cipher workers started\n",
+				started, config.threads);
+	}
+	return NULL;
+}
+
+/* With -o bench, caesarfs times each engine this CPU has at a few request
+   sizes instead of mounting, and prints how many MB/s each one encodes.  The
+   work is spread over the worker pool just as a mount's would be, so threads=
+   and parallel_min= apply. */
+#define BENCH_SECONDS 0.5
+#define BENCH_BATCH   (4 * 1024 * 1024)   // bytes encoded between clock reads
+
+static double bench_now (void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_engine (const char* name, transform_fn_t fn, uint8_t* buf) {
+  static const size_t sizes[] = { 4 * 1024, 128 * 1024, 1024 * 1024 };
+
+  printf("%-20s", name);
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s += 1) {
+    size_t n     = sizes[s];
+    size_t batch = BENCH_BATCH / n;
+    double start = bench_now();
+    double secs;
+    off_t  offset = 0;
+
+    do {
+      for (size_t i = 0; i < batch; i += 1) {
+        run_transform(fn, buf, buf, n, offset, 1, config.parallel_min);
+        offset += n;
+      }
+      secs = bench_now() - start;
+    } while (secs < BENCH_SECONDS);
+    printf(" %10.0f", offset / secs / 1e6);
+  }
+  printf("\n");
+}
+
+// The engines are timed with keys of their own; the one given is not used.
+static int run_bench (void) {
+  uint8_t* buf;
+  char     name[64];
+
+  if (posix_memalign((void**) &buf, 64, 1024 * 1024) != 0) {
+    fprintf(stderr, "ERROR: Out of memory\n");
+    return 1;
+  }
+  memset(buf, 0x5a, 1024 * 1024);
+  if (config.threads > 0) {
+    pool_start(config.threads);
+  }
+  snprintf(name, sizeof(name), "MB/s, %u workers", pool_workers);
+  printf("%-20s %10s %10s %10s\n", name, "4 KiB", "128 KiB", "1 MiB");
+
+  caesar_set_key("3");
+  snprintf(name, sizeof(name), "caesar (%s)", shift_bytes_name);
+  bench_engine(name, caesar_encode, buf);
+  if (shift_bytes != shift_scalar) {
+    shift_bytes      = shift_scalar;
+    shift_bytes_name = "scalar";
+    bench_engine("caesar (scalar)", caesar_encode, buf);
+    select_shift_kernel();
+  }
+
+  aes_set_key("000102030405060708090a0b0c0d0e0f");
+  snprintf(name, sizeof(name), "aes-ctr (%s)", aes_describe());
+  bench_engine(name, aes_ctr_apply, buf);
+  if (aes_ctr_blocks != aes_ctr_soft) {
+    aes_ctr_blocks = aes_ctr_soft;
+    bench_engine("aes-ctr (software)", aes_ctr_apply, buf);
+  }
+
+  free(buf);
+  return 0;
+}
+
 static struct fuse_operations caesar_oper = {
+	.init		= caesar_init,
 	.getattr	= caesar_getattr,
 	.access		= caesar_access,
 	.readlink	= caesar_readlink,
@@ -476,22 +1378,22 @@ int main(int argc, char *argv[])
 	umask(0);
 	if (argc < 4) {
 	  fprintf(stderr,
-		  "USAGE: %s <storage directory> <mount point> <caesar shift> [ -d | -f | -s ]\n",
+		  "USAGE: %s <storage directory> <mount point> <key> [ -d | -f | -s ] [ -o cipher=caesar|aes-ctr ] [ -o bench ]\n",
 		  argv[0]);
 	  return 1;
 	}
 	storage_dir = argv[1];
 	char* mount_dir = argv[2];
-	key = atoi(argv[3]);
+	char* key = argv[3];
 	if (storage_dir[0] != '/' || mount_dir[0] != '/') {
 	  fprintf(stderr, "ERROR: Directories must be absolute paths\n");
 	  return 1;
 	}
-	fprintf(stderr,
-		"DEBUG: Mounting %s at %s using key %d\n",
-		storage_dir,
-		mount_dir,
-		key);
+	storage_fd = open(storage_dir, O_RDONLY | O_DIRECTORY);
+	if (storage_fd == -1) {
+	  perror(storage_dir);
+	  return 1;
+	}
 	int short_argc = argc - 2;
 	char* short_argv[short_argc];
 	short_argv[0] = argv[0];
@@ -499,5 +1401,44 @@ int main(int argc, char *argv[])
 	for (int i = 4; i < argc; i += 1) {
 	  short_argv[i - 2] = argv[i];
 	}
-	return fuse_main(short_argc, short_argv, &caesar_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(short_argc, short_argv);
+	if (fuse_opt_parse(&args, &config, caesar_opts, NULL) == -1) {
+	  return 1;
+	}
+	if (config.cipher != NULL) {
+	  transform = NULL;
+	  for (size_t i = 0; i < sizeof(transforms) / sizeof(transforms[0]); i += 1) {
+	    if (strcmp(config.cipher, transforms[i].name) == 0) {
+	      transform = &transforms[i];
+	    }
+	  }
+	  if (transform == NULL) {
+	    fprintf(stderr, "ERROR: Unknown cipher %s\n", config.cipher);
+	    return 1;
+	  }
+	}
+	if (config.threads < 0) {
+	  // By default, one worker per core besides the FUSE thread's own.
+	  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	  config.threads = cpus > 1 ? cpus - 1 : 0;
+	}
+	select_shift_kernel();
+	if (transform->set_key(key) == -1) {
+	  fprintf(stderr, "ERROR: Bad key for cipher %s\n", transform->name);
+	  return 1;
+	}
+	if (config.bench) {
+	  fuse_opt_free_args(&args);
+	  return run_bench();
+	}
+	fprintf(stderr,
+		"DEBUG: Mounting %s at %s using %s (%s)\n",
+		storage_dir,
+		mount_dir,
+		transform->name,
+		transform->describe());
+	pthread_key_create(&encode_buf_key, free);
+	int res = fuse_main(args.argc, args.argv, &caesar_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
@@ -26,34 +26,88 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
+static int   storage_fd = -1;
 static char* storage_dir = NULL;
-static char  storage_path[256];
 
+/* How the kernel page cache is treated when a file is opened. */
+enum cache_mode {
+  CACHE_NORMAL,  /* libfuse default: drop the cached pages on every open */
+  CACHE_NEVER,   /* bypass the page cache entirely (direct I/O) */
+  CACHE_AUTO,    /* keep the cached pages while the backing mtime is unchanged */
+  CACHE_ALWAYS,  /* always keep the cached pages */
+};
+
+/* Mount options understood by mirrorfs itself (the rest go to libfuse). */
+struct mirror_config {
+  int      splice;
+  double   timeout;
+  char*    cache;
+  enum cache_mode cache_mode;
+  unsigned max_write;
+  unsigned max_readahead;
+  int      writeback;
+};
+
+static struct mirror_config config = {
+  .splice  = 1,
+  .timeout = -1,
+};
+
+#define MIRROR_OPT(t, p, v) { t, offsetof(struct mirror_config, p), v }
+
+static struct fuse_opt mirror_opts[] = {
+  MIRROR_OPT("splice",     splice,  1),
+  MIRROR_OPT("nosplice",   splice,  0),
+  MIRROR_OPT("timeout=%lf", timeout, 0),
+  MIRROR_OPT("cache=%s",   cache,   0),
+  MIRROR_OPT("max_write=%u",     max_write,     0),
+  MIRROR_OPT("max_readahead=%u", max_readahead, 0),
+  MIRROR_OPT("writeback",   writeback, 1),
+  MIRROR_OPT("nowriteback", writeback, 0),
+  FUSE_OPT_END
+};
+
+
+/* The paths that FUSE hands us are absolute within the mount point.  Strip the
+   leading slash so that they can be resolved relative to storage_fd, which
+   saves the kernel from walking the storage directory's own path again. */
+static const char* relative_path (const char* path) {
+  while (*path == '/') {
+    path += 1;
+  }
+  return *path == '\0' ? "." : path;
+}
 
-char* prepend_storage_dir (char* pre_path, const char* path) {
-  strcpy(pre_path, storage_dir);
-  strcat(pre_path, path);
+#ifdef HAVE_SETXATTR
+/* There are no *at() variants of the xattr calls, so those still need a full
+   path into the storage directory. */
+static char* prepend_storage_dir (char* pre_path, const char* path) {
+  snprintf(pre_path, PATH_MAX, "%s%s", storage_dir, path);
   return pre_path;
 }
+#endif
 
 
 static int mirror_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
 	
-	path = prepend_storage_dir(storage_path, path);
-	res = lstat(path, stbuf);
+	res = fstatat(storage_fd, relative_path(path), stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -64,8 +118,7 @@ static int mirror_access(const char *path, int mask)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = access(path, mask);
+	res = faccessat(storage_fd, relative_path(path), mask, 0);
 	if (res == -1)
 		return -errno;
 
@@ -76,8 +129,7 @@ static int mirror_readlink(const char *path, char *buf, size_t size)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = readlink(path, buf, size - 1);
+	res = readlinkat(storage_fd, relative_path(path), buf, size - 1);
 	if (res == -1)
 		return -errno;
 
@@ -86,30 +138,104 @@ static int mirror_readlink(const char *path, char *buf, size_t size)
 }
 
 
+/* An open directory stream, kept in fi->fh from opendir to releasedir so that a
+   large directory can be listed a buffer at a time. */
+struct mirror_dirp {
+  DIR*           dp;
+  struct dirent* entry;
+  off_t          offset;
+};
+
+static struct mirror_dirp* get_dirp (struct fuse_file_info *fi) {
+  return (struct mirror_dirp*) (uintptr_t) fi->fh;
+}
+
+static int mirror_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct mirror_dirp *d;
+	int fd;
+	int res;
+
+	d = malloc(sizeof(struct mirror_dirp));
+	if (d == NULL)
+		return -ENOMEM;
+
+	fd = openat(storage_fd, relative_path(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		res = -errno;
+		free(d);
+		return res;
+	}
+
+	d->dp = fdopendir(fd);
+	if (d->dp == NULL) {
+		res = -errno;
+		close(fd);
+		free(d);
+		return res;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+
+	fi->fh = (uintptr_t) d;
+	return 0;
+}
+
 static int mirror_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
-	DIR *dp;
-	struct dirent *de;
+	struct mirror_dirp *d = get_dirp(fi);
 
-	(void) offset;
-	(void) fi;
+	(void) path;
 
-	path = prepend_storage_dir(storage_path, path);
-	dp = opendir(path);
-	if (dp == NULL)
-		return -errno;
+	// Pick up where the previous call left off, unless the kernel has
+	// asked for some other position.
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-	while ((de = readdir(dp)) != NULL) {
+	while (1) {
 		struct stat st;
+		off_t nextoff;
+
+		if (d->entry == NULL) {
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				break;
+		}
+
 		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		// Some file systems do not report the type in the directory
+		// itself; stat the entry relative to the open directory.
+		if (st.st_mode == 0)
+			fstatat(dirfd(d->dp), d->entry->d_name, &st,
+				AT_SYMLINK_NOFOLLOW);
+
+		// Passing the next offset lets libfuse stop when its buffer is
+		// full and call us again, instead of holding the whole listing.
+		nextoff = telldir(d->dp);
+		if (filler(buf, d->entry->d_name, &st, nextoff))
 			break;
+
+		d->entry = NULL;
+		d->offset = nextoff;
 	}
 
-	closedir(dp);
+	return 0;
+}
+
+static int mirror_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct mirror_dirp *d = get_dirp(fi);
+
+	(void) path;
+
+	closedir(d->dp);
+	free(d);
 	return 0;
 }
 
@@ -117,17 +243,17 @@ static int mirror_mknod(const char *path, mode_t mode, dev_t rdev)
 {
 	int res;
 
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	path = prepend_storage_dir(storage_path, path);
+	/* On Linux this could just be 'mknodat(fd, path, mode, rdev)' but
+	   this is more portable */
+	path = relative_path(path);
 	if (S_ISREG(mode)) {
-		res = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = openat(storage_fd, path, O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
+		res = mkfifoat(storage_fd, path, mode);
 	else
-		res = mknod(path, mode, rdev);
+		res = mknodat(storage_fd, path, mode, rdev);
 	if (res == -1)
 		return -errno;
 
@@ -138,8 +264,7 @@ static int mirror_mkdir(const char *path, mode_t mode)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = mkdir(path, mode);
+	res = mkdirat(storage_fd, relative_path(path), mode);
 	if (res == -1)
 		return -errno;
 
@@ -150,8 +275,7 @@ static int mirror_unlink(const char *path)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = unlink(path);
+	res = unlinkat(storage_fd, relative_path(path), 0);
 	if (res == -1)
 		return -errno;
 
@@ -162,8 +286,7 @@ static int mirror_rmdir(const char *path)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = rmdir(path);
+	res = unlinkat(storage_fd, relative_path(path), AT_REMOVEDIR);
 	if (res == -1)
 		return -errno;
 
@@ -173,12 +296,10 @@ static int mirror_rmdir(const char *path)
 static int mirror_symlink(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = symlink(storage_from, storage_to);
+	/* The link's contents are stored as given, so that relative links
+	   keep pointing inside the mount. */
+	res = symlinkat(from, storage_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -188,12 +309,9 @@ static int mirror_symlink(const char *from, const char *to)
 static int mirror_rename(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = rename(storage_from, storage_to);
+	res = renameat(storage_fd, relative_path(from),
+		       storage_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -203,12 +321,9 @@ static int mirror_rename(const char *from, const char *to)
 static int mirror_link(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = link(storage_from, storage_to);
+	res = linkat(storage_fd, relative_path(from),
+		     storage_fd, relative_path(to), 0);
 	if (res == -1)
 		return -errno;
 
@@ -219,8 +334,7 @@ static int mirror_chmod(const char *path, mode_t mode)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = chmod(path, mode);
+	res = fchmodat(storage_fd, relative_path(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
@@ -231,8 +345,8 @@ static int mirror_chown(const char *path, uid_t uid, gid_t gid)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = lchown(path, uid, gid);
+	res = fchownat(storage_fd, relative_path(path), uid, gid,
+		       AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -241,10 +355,31 @@ static int mirror_chown(const char *path, uid_t uid, gid_t gid)
 
 static int mirror_truncate(const char *path, off_t size)
 {
+	int fd;
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = truncate(path, size);
+	fd = openat(storage_fd, relative_path(path), O_WRONLY);
+	if (fd == -1)
+		return -errno;
+
+	res = ftruncate(fd, size);
+	if (res == -1)
+		res = -errno;
+
+	close(fd);
+	if (res < 0)
+		return res;
+
+	return 0;
+}
+
+static int mirror_ftruncate(const char *path, off_t size,
+			    struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+	res = ftruncate(fi->fh, size);
 	if (res == -1)
 		return -errno;
 
@@ -257,8 +392,7 @@ static int mirror_utimens(const char *path, const struct timespec ts[2])
 	int res;
 
 	/* don't use utime/utimes since they follow symlinks */
-	path = prepend_storage_dir(storage_path, path);
-	res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
+	res = utimensat(storage_fd, relative_path(path), ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -266,16 +400,64 @@ static int mirror_utimens(const char *path, const struct timespec ts[2])
 }
 #endif
 
+/* Tell the kernel what to do with its cached pages for a newly opened file. */
+static void set_cache_flags (struct fuse_file_info *fi) {
+  switch (config.cache_mode) {
+  case CACHE_NEVER:
+    fi->direct_io = 1;
+    break;
+  case CACHE_ALWAYS:
+    fi->keep_cache = 1;
+    break;
+  case CACHE_AUTO:
+    // libfuse's auto_cache compares the mtime and size at open for us.
+  case CACHE_NORMAL:
+    break;
+  }
+}
+
+/* With write-back caching the kernel may need to read a page of a file that
+   was opened write-only before writing part of it back, and it keeps track of
+   the end of the file for O_APPEND itself. */
+static int backing_flags (struct fuse_file_info *fi) {
+  int flags = fi->flags;
+
+  if (config.writeback) {
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+      flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    flags &= ~O_APPEND;
+  }
+  return flags;
+}
+
 static int mirror_open(const char *path, struct fuse_file_info *fi)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = open(path, fi->flags);
+	res = openat(storage_fd, relative_path(path), backing_flags(fi));
 	if (res == -1)
 		return -errno;
 
-	close(res);
+	// Keep the backing file open for the lifetime of the handle so that
+	// read/write do not have to look the path up again.
+	fi->fh = res;
+	set_cache_flags(fi);
+
+	return 0;
+}
+
+static int mirror_create(const char *path, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+	int res;
+
+	res = openat(storage_fd, relative_path(path), backing_flags(fi), mode);
+	if (res == -1)
+		return -errno;
+
+	fi->fh = res;
+	set_cache_flags(fi);
 
 	return 0;
 }
@@ -283,66 +465,75 @@ static int mirror_open(const char *path, struct fuse_file_info *fi)
 static int mirror_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi)
 {
-	int fd;
 	int res;
-	int i;
-	char temp_buf[size];
 
 	fprintf(stderr, "DEBUG: Reading from %s\n", path);
 	
-	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_RDONLY);
-	if (fd == -1)
-		return -errno;
-
-	res = pread(fd, temp_buf, size, offset);
+	res = pread(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	// Move data from temporary buffer into provided one.
-	for (i = 0; i < size; i += 1) {
-	  buf[i] = temp_buf[i];
-	}
-
-	close(fd);
 	return res;
 }
 
 static int mirror_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	int fd;
 	int res;
-	int i;
-	char temp_buf[size];
 
 	fprintf(stderr, "DEBUG: Writing to %s\n", path);
 
-	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
-
-	for (i = 0; i < size; i += 1) {
-	  temp_buf[i] = buf[i];
-	}
-
-	res = pwrite(fd, temp_buf, size, offset);
+	res = pwrite(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	close(fd);
 	return res;
 }
 
+static int mirror_read_buf(const char *path, struct fuse_bufvec **bufp,
+			   size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+
+	(void) path;
+
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	// Hand libfuse the backing fd rather than the data itself, so that it
+	// can splice the pages straight into /dev/fuse.
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+
+	return 0;
+}
+
+static int mirror_write_buf(const char *path, struct fuse_bufvec *buf,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	(void) path;
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	return fuse_buf_copy(&dst, buf, config.splice ? FUSE_BUF_SPLICE_NONBLOCK
+						      : FUSE_BUF_NO_SPLICE);
+}
+
 static int mirror_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = statvfs(path, stbuf);
+	(void) path;
+	res = fstatvfs(storage_fd, stbuf);
 	if (res == -1)
 		return -errno;
 
@@ -351,23 +542,28 @@ static int mirror_statfs(const char *path, struct statvfs *stbuf)
 
 static int mirror_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
-
 	(void) path;
-	(void) fi;
+	close(fi->fh);
 	return 0;
 }
 
 static int mirror_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
 
 	(void) path;
+#ifndef HAVE_FDATASYNC
 	(void) isdatasync;
-	(void) fi;
+#else
+	if (isdatasync)
+		res = fdatasync(fi->fh);
+	else
+#endif
+		res = fsync(fi->fh);
+	if (res == -1)
+		return -errno;
+
 	return 0;
 }
 
@@ -375,23 +571,12 @@ static int mirror_fsync(const char *path, int isdatasync,
 static int mirror_fallocate(const char *path, int mode,
 			off_t offset, off_t length, struct fuse_file_info *fi)
 {
-	int fd;
-	int res;
-
-	(void) fi;
+	(void) path;
 
 	if (mode)
 		return -EOPNOTSUPP;
 
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
-
-	res = -posix_fallocate(fd, offset, length);
-
-	close(fd);
-	return res;
+	return -posix_fallocate(fi->fh, offset, length);
 }
 #endif
 
@@ -400,6 +585,7 @@ static int mirror_fallocate(const char *path, int mode,
 static int mirror_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lsetxattr(path, name, value, size, flags);
 	if (res == -1)
@@ -410,6 +596,7 @@ static int mirror_setxattr(const char *path, const char *name, const char *value
 static int mirror_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lgetxattr(path, name, value, size);
 	if (res == -1)
@@ -419,6 +606,7 @@ static int mirror_getxattr(const char *path, const char *name, char *value,
 
 static int mirror_listxattr(const char *path, char *list, size_t size)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = llistxattr(path, list, size);
 	if (res == -1)
@@ -428,6 +616,7 @@ static int mirror_listxattr(const char *path, char *list, size_t size)
 
 static int mirror_removexattr(const char *path, const char *name)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lremovexattr(path, name);
 	if (res == -1)
@@ -436,11 +625,40 @@ static int mirror_removexattr(const char *path, const char *name)
 }
 #endif /* HAVE_SETXATTR */
 
+static void *mirror_init(struct fuse_conn_info *conn)
+{
+	unsigned splice_caps = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE;
+
+	if (config.splice)
+		conn->want |= conn->capable & splice_caps;
+	else
+		conn->want &= ~splice_caps;
+
+	// Let the kernel send writes larger than a page and issue reads
+	// ahead of the application.
+	conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ);
+	if (config.max_write && config.max_write < conn->max_write)
+		conn->max_write = config.max_write;
+	if (config.max_readahead && config.max_readahead < conn->max_readahead)
+		conn->max_readahead = config.max_readahead;
+
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	if (config.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	else
+		config.writeback = 0;
+#endif
+
+	return NULL;
+}
+
 static struct fuse_operations mirror_oper = {
 	.getattr	= mirror_getattr,
 	.access		= mirror_access,
 	.readlink	= mirror_readlink,
+	.opendir	= mirror_opendir,
 	.readdir	= mirror_readdir,
+	.releasedir	= mirror_releasedir,
 	.mknod		= mirror_mknod,
 	.mkdir		= mirror_mkdir,
 	.symlink	= mirror_symlink,
@@ -451,12 +669,16 @@ static struct fuse_operations mirror_oper = {
 	.chmod		= mirror_chmod,
 	.chown		= mirror_chown,
 	.truncate	= mirror_truncate,
+	.ftruncate	= mirror_ftruncate,
 #ifdef HAVE_UTIMENSAT
 	.utimens	= mirror_utimens,
 #endif
 	.open		= mirror_open,
+	.create		= mirror_create,
 	.read		= mirror_read,
 	.write		= mirror_write,
+	.read_buf	= mirror_read_buf,
+	.write_buf	= mirror_write_buf,
 	.statfs		= mirror_statfs,
 	.release	= mirror_release,
 	.fsync		= mirror_fsync,
@@ -469,13 +691,19 @@ static struct fuse_operations mirror_oper = {
 	.listxattr	= mirror_listxattr,
 	.removexattr	= mirror_removexattr,
 #endif
+	.init		= mirror_init,
 };
 
 int main(int argc, char *argv[])
 {
 	umask(0);
 	if (argc < 3) {
-	  fprintf(stderr, "USAGE: %s <storage directory> <mount point> [ -d | -f | -s ]\n", argv[0]);
+	  fprintf(stderr,
+		  "USAGE: %s <storage directory> <mount point> [ -d | -f | -s ]\n"
+		  "    [ -o splice | -o nosplice ] [ -o timeout=<seconds> ]\n"
+		  "    [ -o cache=never|auto|always ]\n"
+		  "    [ -o max_write=<bytes> ] [ -o max_readahead=<bytes> ] [ -o writeback ]\n",
+		  argv[0]);
 	  return 1;
 	}
 	storage_dir = argv[1];
@@ -484,6 +712,11 @@ int main(int argc, char *argv[])
 	  fprintf(stderr, "ERROR: Directories must be absolute paths\n");
 	  return 1;
 	}
+	storage_fd = open(storage_dir, O_RDONLY | O_DIRECTORY);
+	if (storage_fd == -1) {
+	  perror(storage_dir);
+	  return 1;
+	}
 	fprintf(stderr, "DEBUG: Mounting %s at %s\n", storage_dir, argv[2]);
 	int short_argc = argc - 1;
 	char* short_argv[short_argc];
@@ -491,5 +724,39 @@ int main(int argc, char *argv[])
 	for (int i = 2; i < argc; i += 1) {
 	  short_argv[i - 1] = argv[i];
 	}
-	return fuse_main(short_argc, short_argv, &mirror_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(short_argc, short_argv);
+	if (fuse_opt_parse(&args, &config, mirror_opts, NULL) == -1) {
+	  return 1;
+	}
+	if (config.cache != NULL) {
+	  if (strcmp(config.cache, "never") == 0) {
+	    config.cache_mode = CACHE_NEVER;
+	  } else if (strcmp(config.cache, "auto") == 0) {
+	    config.cache_mode = CACHE_AUTO;
+	    fuse_opt_add_arg(&args, "-oauto_cache");
+	  } else if (strcmp(config.cache, "always") == 0) {
+	    config.cache_mode = CACHE_ALWAYS;
+	  } else {
+	    fprintf(stderr, "ERROR: Unknown cache mode %s\n", config.cache);
+	    return 1;
+	  }
+	}
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+	if (config.writeback) {
+	  fprintf(stderr, "ERROR: This libfuse cannot enable write-back caching\n");
+	  return 1;
+	}
+#endif
+	if (config.timeout >= 0) {
+	  // Goes in front of the user's own options, so that an explicit
+	  // entry_timeout/attr_timeout/negative_timeout still wins.
+	  char timeouts[128];
+	  snprintf(timeouts, sizeof(timeouts),
+		   "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+		   config.timeout, config.timeout, config.timeout);
+	  fuse_opt_insert_arg(&args, 1, timeouts);
+	}
+	int res = fuse_main(args.argc, args.argv, &mirror_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
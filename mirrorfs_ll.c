@@ -0,0 +1,857 @@
+/**
+ * \file mirrorfs_ll.c
+ * \date October 2026
+ *
+ * A variant of mirrorfs written against the FUSE low-level API.  Rather than
+ * receiving a full path with every request, it is handed node ids, which it
+ * maps through an inode table onto O_PATH file descriptors within the storage
+ * directory.  Every lookup is therefore a single openat() relative to the
+ * parent's descriptor, and nothing ever walks a whole path again.
+ *
+ * FUSE: Filesystem in Userspace
+ * Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* For O_PATH, AT_EMPTY_PATH and pread()/pwrite() */
+#define _GNU_SOURCE
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+/* Mount options understood by mirrorfs_ll itself (the rest go to libfuse).
+   -o timeout= sets how long the kernel may cache entries, attributes and
+   failed lookups, in seconds, as it does for mirrorfs.  Without it, entries
+   and attributes are cached for the high-level library's default of a second
+   and failed lookups are not cached at all. */
+struct mirror_config {
+  double timeout;
+  double entry_timeout;
+  double negative_timeout;
+};
+
+static struct mirror_config config = {
+  .timeout = -1,
+};
+
+#define MIRROR_OPT(t, p, v) { t, offsetof(struct mirror_config, p), v }
+
+static struct fuse_opt mirror_opts[] = {
+  MIRROR_OPT("timeout=%lf", timeout, 0),
+  FUSE_OPT_END
+};
+
+#define INITIAL_BUCKETS 1024
+
+/* One node id that the kernel knows about. */
+struct mirror_inode {
+  struct mirror_inode* id_next;   /* chain in the table keyed by node id */
+  struct mirror_inode* key_next;  /* chain in the table keyed by dev/ino */
+  fuse_ino_t           nodeid;
+  int                  fd;        /* O_PATH descriptor of the backing file */
+  dev_t                dev;
+  ino_t                ino;
+  uint64_t             nlookup;   /* outstanding kernel references */
+};
+
+/* Two hash tables over the same nodes: one to resolve the node ids in
+   incoming requests, and one to find an existing node when a lookup reaches a
+   backing file that the kernel already knows under another name. */
+struct inode_table {
+  struct mirror_inode** by_id;
+  struct mirror_inode** by_key;
+  size_t                nbuckets;
+  size_t                count;
+  fuse_ino_t            next_id;
+  pthread_mutex_t       lock;
+};
+
+static struct inode_table inodes = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t id_bucket (fuse_ino_t nodeid, size_t nbuckets) {
+  return (size_t) ((nodeid * 0x9E3779B97F4A7C15ULL) >> 32) & (nbuckets - 1);
+}
+
+static size_t key_bucket (dev_t dev, ino_t ino, size_t nbuckets) {
+  uint64_t h = (uint64_t) ino ^ ((uint64_t) dev << 32 | (uint64_t) dev >> 32);
+  return (size_t) ((h * 0x9E3779B97F4A7C15ULL) >> 32) & (nbuckets - 1);
+}
+
+/* Double the bucket arrays once the tables average more than one node per
+   bucket.  Called with the table lock held. */
+static void inode_table_grow (void) {
+  size_t                nbuckets = inodes.nbuckets * 2;
+  struct mirror_inode** by_id    = calloc(nbuckets, sizeof(*by_id));
+  struct mirror_inode** by_key   = calloc(nbuckets, sizeof(*by_key));
+
+  if (by_id == NULL || by_key == NULL) {
+    // Longer chains are still correct, so just stay at the current size.
+    free(by_id);
+    free(by_key);
+    return;
+  }
+
+  for (size_t i = 0; i < inodes.nbuckets; i += 1) {
+    struct mirror_inode* node = inodes.by_id[i];
+    while (node != NULL) {
+      struct mirror_inode* next = node->id_next;
+      size_t b = id_bucket(node->nodeid, nbuckets);
+      node->id_next = by_id[b];
+      by_id[b] = node;
+      node = next;
+    }
+    node = inodes.by_key[i];
+    while (node != NULL) {
+      struct mirror_inode* next = node->key_next;
+      size_t b = key_bucket(node->dev, node->ino, nbuckets);
+      node->key_next = by_key[b];
+      by_key[b] = node;
+      node = next;
+    }
+  }
+
+  free(inodes.by_id);
+  free(inodes.by_key);
+  inodes.by_id    = by_id;
+  inodes.by_key   = by_key;
+  inodes.nbuckets = nbuckets;
+}
+
+/* Add a node to both tables.  Called with the table lock held. */
+static void inode_table_insert (struct mirror_inode* node) {
+  if (inodes.count >= inodes.nbuckets) {
+    inode_table_grow();
+  }
+
+  size_t b = id_bucket(node->nodeid, inodes.nbuckets);
+  node->id_next = inodes.by_id[b];
+  inodes.by_id[b] = node;
+
+  b = key_bucket(node->dev, node->ino, inodes.nbuckets);
+  node->key_next = inodes.by_key[b];
+  inodes.by_key[b] = node;
+
+  inodes.count += 1;
+}
+
+/* Unlink a node from both tables.  Called with the table lock held. */
+static void inode_table_remove (struct mirror_inode* node) {
+  struct mirror_inode** link = &inodes.by_id[id_bucket(node->nodeid,
+                                                       inodes.nbuckets)];
+  while (*link != node) {
+    link = &(*link)->id_next;
+  }
+  *link = node->id_next;
+
+  link = &inodes.by_key[key_bucket(node->dev, node->ino, inodes.nbuckets)];
+  while (*link != node) {
+    link = &(*link)->key_next;
+  }
+  *link = node->key_next;
+
+  inodes.count -= 1;
+}
+
+static struct mirror_inode* lookup_node (fuse_ino_t nodeid) {
+  struct mirror_inode* node;
+
+  pthread_mutex_lock(&inodes.lock);
+  node = inodes.by_id[id_bucket(nodeid, inodes.nbuckets)];
+  while (node != NULL && node->nodeid != nodeid) {
+    node = node->id_next;
+  }
+  pthread_mutex_unlock(&inodes.lock);
+
+  return node;
+}
+
+/* The kernel never sends a request for a node id that it has forgotten, so
+   every id that reaches us is in the table. */
+static int node_fd (fuse_ino_t nodeid) {
+  return lookup_node(nodeid)->fd;
+}
+
+/* O_PATH descriptors cannot be read, written or chmod-ed directly, but the
+   magic link under /proc reopens the file they refer to. */
+static char* proc_path (char* buf, int fd) {
+  snprintf(buf, PATH_MAX, "/proc/self/fd/%d", fd);
+  return buf;
+}
+
+/* Every node the kernel remembers holds a descriptor open, so a big tree can
+   run into the limit on open files, which main() raises as far as it may.
+   Running out is reported as ENFILE, with a word to the user the first time,
+   rather than as lookups failing one by one for no clear reason. */
+static int fd_error (int err) {
+  static int warned = 0;
+
+  if (err != EMFILE) {
+    return err;
+  }
+  if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+    fprintf(stderr, "ERROR: Out of file descriptors; raise the open file "
+            "limit (ulimit -n) and mount again\n");
+  }
+  return ENFILE;
+}
+
+static void unref_node (struct mirror_inode* node, uint64_t n) {
+  int drop;
+
+  pthread_mutex_lock(&inodes.lock);
+  node->nlookup -= n;
+  drop = node->nlookup == 0 && node->nodeid != FUSE_ROOT_ID;
+  if (drop) {
+    inode_table_remove(node);
+  }
+  pthread_mutex_unlock(&inodes.lock);
+
+  if (drop) {
+    close(node->fd);
+    free(node);
+  }
+}
+
+/* Resolve name within parent, reusing the existing node if the kernel already
+   knows the backing file, and fill in the entry for the reply.  Returns 0 or
+   an errno value. */
+static int do_lookup (fuse_ino_t parent, const char *name,
+		      struct fuse_entry_param *e)
+{
+	struct mirror_inode *node;
+	int fd;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = config.entry_timeout;
+	e->entry_timeout = config.entry_timeout;
+
+	fd = openat(node_fd(parent), name, O_PATH | O_NOFOLLOW);
+	if (fd == -1)
+		return fd_error(errno);
+
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		int err = errno;
+		close(fd);
+		return err;
+	}
+
+	pthread_mutex_lock(&inodes.lock);
+	node = inodes.by_key[key_bucket(e->attr.st_dev, e->attr.st_ino,
+					inodes.nbuckets)];
+	while (node != NULL &&
+	       (node->dev != e->attr.st_dev || node->ino != e->attr.st_ino))
+		node = node->key_next;
+
+	if (node != NULL) {
+		node->nlookup += 1;
+	} else {
+		node = calloc(1, sizeof(*node));
+		if (node == NULL) {
+			pthread_mutex_unlock(&inodes.lock);
+			close(fd);
+			return ENOMEM;
+		}
+		node->nodeid = inodes.next_id++;
+		node->fd = fd;
+		node->dev = e->attr.st_dev;
+		node->ino = e->attr.st_ino;
+		node->nlookup = 1;
+		inode_table_insert(node);
+		fd = -1;
+	}
+	e->ino = node->nodeid;
+	pthread_mutex_unlock(&inodes.lock);
+
+	if (fd != -1)
+		close(fd);
+
+	return 0;
+}
+
+static void mirror_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int err;
+
+	err = do_lookup(parent, name, &e);
+	if (err == ENOENT && config.negative_timeout > 0) {
+		// Node id 0 has the kernel remember that the name is not there.
+		e.ino = 0;
+		e.entry_timeout = config.negative_timeout;
+		fuse_reply_entry(req, &e);
+	} else if (err) {
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void mirror_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	unref_node(lookup_node(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void mirror_getattr(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	struct stat st;
+	int res;
+
+	(void) fi;
+
+	res = fstatat(node_fd(ino), "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fuse_reply_attr(req, &st, config.entry_timeout);
+}
+
+static void mirror_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			   int valid, struct fuse_file_info *fi)
+{
+	char procname[PATH_MAX];
+	int ifd = node_fd(ino);
+	int res;
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		if (fi)
+			res = fchmod(fi->fh, attr->st_mode);
+		else
+			res = chmod(proc_path(procname, ifd), attr->st_mode);
+		if (res == -1)
+			goto out_err;
+	}
+	if (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+		res = fchownat(ifd, "", uid, gid,
+			       AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			goto out_err;
+	}
+	if (valid & FUSE_SET_ATTR_SIZE) {
+		if (fi)
+			res = ftruncate(fi->fh, attr->st_size);
+		else
+			res = truncate(proc_path(procname, ifd), attr->st_size);
+		if (res == -1)
+			goto out_err;
+	}
+	if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+
+		tv[0].tv_sec = 0;
+		tv[1].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1].tv_nsec = UTIME_OMIT;
+
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		if (fi)
+			res = futimens(fi->fh, tv);
+		else
+			res = utimensat(AT_FDCWD, proc_path(procname, ifd), tv, 0);
+		if (res == -1)
+			goto out_err;
+	}
+
+	return mirror_getattr(req, ino, fi);
+
+out_err:
+	fuse_reply_err(req, errno);
+}
+
+static void mirror_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char buf[PATH_MAX + 1];
+	int res;
+
+	res = readlinkat(node_fd(ino), "", buf, sizeof(buf));
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	if (res == sizeof(buf)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+/* Common tail of mknod/mkdir/symlink/link: reply with the new entry. */
+static void reply_new_entry(fuse_req_t req, int res, fuse_ino_t parent,
+			    const char *name)
+{
+	struct fuse_entry_param e;
+	int err;
+
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	err = do_lookup(parent, name, &e);
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void mirror_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, dev_t rdev)
+{
+	int res;
+
+	if (S_ISFIFO(mode))
+		res = mkfifoat(node_fd(parent), name, mode);
+	else
+		res = mknodat(node_fd(parent), name, mode, rdev);
+
+	reply_new_entry(req, res, parent, name);
+}
+
+static void mirror_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode)
+{
+	reply_new_entry(req, mkdirat(node_fd(parent), name, mode), parent, name);
+}
+
+static void mirror_symlink(fuse_req_t req, const char *link,
+			   fuse_ino_t parent, const char *name)
+{
+	reply_new_entry(req, symlinkat(link, node_fd(parent), name), parent, name);
+}
+
+static void mirror_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
+			const char *name)
+{
+	char procname[PATH_MAX];
+	int res;
+
+	res = linkat(AT_FDCWD, proc_path(procname, node_fd(ino)),
+		     node_fd(parent), name, AT_SYMLINK_FOLLOW);
+
+	reply_new_entry(req, res, parent, name);
+}
+
+static void mirror_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res;
+
+	res = unlinkat(node_fd(parent), name, 0);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void mirror_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res;
+
+	res = unlinkat(node_fd(parent), name, AT_REMOVEDIR);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void mirror_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  fuse_ino_t newparent, const char *newname)
+{
+	int res;
+
+	res = renameat(node_fd(parent), name, node_fd(newparent), newname);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+/* An open directory stream, remembered in fi->fh between readdir calls. */
+struct mirror_dirp {
+  DIR*           dp;
+  struct dirent* entry;
+  off_t          offset;
+};
+
+static void mirror_opendir(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	struct mirror_dirp *d;
+	int fd;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = openat(node_fd(ino), ".", O_RDONLY | O_DIRECTORY);
+	if (fd != -1) {
+		d->dp = fdopendir(fd);
+		if (d->dp == NULL)
+			close(fd);
+	}
+	if (d->dp == NULL) {
+		int err = fd_error(errno);
+		free(d);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+static void mirror_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	struct mirror_dirp *d = (struct mirror_dirp *) (uintptr_t) fi->fh;
+	char *buf;
+	char *p;
+	size_t rem;
+
+	(void) ino;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	p = buf;
+	rem = size;
+	while (1) {
+		struct stat st;
+		size_t entsize;
+
+		if (d->entry == NULL) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL) {
+				if (errno && rem == size) {
+					free(buf);
+					fuse_reply_err(req, errno);
+					return;
+				}
+				break;
+			}
+		}
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		if (st.st_mode == 0)
+			fstatat(dirfd(d->dp), d->entry->d_name, &st,
+				AT_SYMLINK_NOFOLLOW);
+		entsize = fuse_add_direntry(req, p, rem, d->entry->d_name, &st,
+					    telldir(d->dp));
+		if (entsize > rem)
+			break;
+
+		p += entsize;
+		rem -= entsize;
+		d->offset = telldir(d->dp);
+		d->entry = NULL;
+	}
+
+	fuse_reply_buf(req, buf, size - rem);
+	free(buf);
+}
+
+static void mirror_releasedir(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
+{
+	struct mirror_dirp *d = (struct mirror_dirp *) (uintptr_t) fi->fh;
+
+	(void) ino;
+
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void mirror_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	int fd;
+	int err;
+
+	fd = openat(node_fd(parent), name,
+		    (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd == -1) {
+		fuse_reply_err(req, fd_error(errno));
+		return;
+	}
+
+	err = do_lookup(parent, name, &e);
+	if (err) {
+		close(fd);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	fi->fh = fd;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void mirror_open(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	char procname[PATH_MAX];
+	int fd;
+
+	fd = open(proc_path(procname, node_fd(ino)), fi->flags & ~O_NOFOLLOW);
+	if (fd == -1) {
+		fuse_reply_err(req, fd_error(errno));
+		return;
+	}
+
+	fi->fh = fd;
+	fuse_reply_open(req, fi);
+}
+
+static void mirror_release(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void mirror_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			 struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) ino;
+
+	if (datasync)
+		res = fdatasync(fi->fh);
+	else
+		res = fsync(fi->fh);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void mirror_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+	(void) ino;
+
+	// As in mirrorfs, hand libfuse the fd so that it can splice.
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fi->fh;
+	buf.buf[0].pos = offset;
+
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void mirror_write_buf(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_bufvec *in_buf, off_t offset,
+			     struct fuse_file_info *fi)
+{
+	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+	ssize_t res;
+
+	(void) ino;
+
+	out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out_buf.buf[0].fd = fi->fh;
+	out_buf.buf[0].pos = offset;
+
+	res = fuse_buf_copy(&out_buf, in_buf, 0);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, (size_t) res);
+}
+
+static void mirror_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+	int res;
+
+	res = fstatvfs(node_fd(ino), &stbuf);
+	if (res == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &stbuf);
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static void mirror_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			     off_t offset, off_t length,
+			     struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	if (mode) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	fuse_reply_err(req, posix_fallocate(fi->fh, offset, length));
+}
+#endif
+
+static struct fuse_lowlevel_ops mirror_oper = {
+	.lookup		= mirror_lookup,
+	.forget		= mirror_forget,
+	.getattr	= mirror_getattr,
+	.setattr	= mirror_setattr,
+	.readlink	= mirror_readlink,
+	.mknod		= mirror_mknod,
+	.mkdir		= mirror_mkdir,
+	.symlink	= mirror_symlink,
+	.link		= mirror_link,
+	.unlink		= mirror_unlink,
+	.rmdir		= mirror_rmdir,
+	.rename		= mirror_rename,
+	.opendir	= mirror_opendir,
+	.readdir	= mirror_readdir,
+	.releasedir	= mirror_releasedir,
+	.create		= mirror_create,
+	.open		= mirror_open,
+	.release	= mirror_release,
+	.fsync		= mirror_fsync,
+	.read		= mirror_read,
+	.write_buf	= mirror_write_buf,
+	.statfs		= mirror_statfs,
+#ifdef HAVE_POSIX_FALLOCATE
+	.fallocate	= mirror_fallocate,
+#endif
+};
+
+/* Raise the soft limit on open files to the hard one, since every node the
+   kernel remembers keeps a descriptor open. */
+static void raise_fd_limit (void) {
+  struct rlimit lim;
+
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) == -1) {
+      perror("setrlimit");
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+	umask(0);
+	if (argc < 3) {
+	  fprintf(stderr, "USAGE: %s <storage directory> <mount point> [ -d | -f | -s ] [ -o timeout=<seconds> ]\n", argv[0]);
+	  return 1;
+	}
+	char* storage_dir = argv[1];
+	if (storage_dir[0] != '/' || argv[2][0] != '/') {
+	  fprintf(stderr, "ERROR: Directories must be absolute paths\n");
+	  return 1;
+	}
+
+	// The root of the mount is the one node the kernel never looks up.
+	struct mirror_inode* root = calloc(1, sizeof(*root));
+	inodes.nbuckets = INITIAL_BUCKETS;
+	inodes.by_id    = calloc(inodes.nbuckets, sizeof(*inodes.by_id));
+	inodes.by_key   = calloc(inodes.nbuckets, sizeof(*inodes.by_key));
+	if (root == NULL || inodes.by_id == NULL || inodes.by_key == NULL) {
+	  fprintf(stderr, "ERROR: Out of memory\n");
+	  return 1;
+	}
+	struct stat st;
+	root->fd = open(storage_dir, O_PATH);
+	if (root->fd == -1 || fstat(root->fd, &st) == -1) {
+	  perror(storage_dir);
+	  return 1;
+	}
+	root->nodeid  = FUSE_ROOT_ID;
+	root->dev     = st.st_dev;
+	root->ino     = st.st_ino;
+	root->nlookup = 1;
+	inode_table_insert(root);
+	inodes.next_id = FUSE_ROOT_ID + 1;
+
+	fprintf(stderr, "DEBUG: Mounting %s at %s\n", storage_dir, argv[2]);
+	int short_argc = argc - 1;
+	char* short_argv[short_argc];
+	short_argv[0] = argv[0];
+	for (int i = 2; i < argc; i += 1) {
+	  short_argv[i - 1] = argv[i];
+	}
+
+	struct fuse_args args = FUSE_ARGS_INIT(short_argc, short_argv);
+	if (fuse_opt_parse(&args, &config, mirror_opts, NULL) == -1) {
+	  return 1;
+	}
+	config.entry_timeout    = config.timeout >= 0 ? config.timeout : 1.0;
+	config.negative_timeout = config.timeout >= 0 ? config.timeout : 0.0;
+	raise_fd_limit();
+
+	struct fuse_chan* ch;
+	char* mountpoint;
+	int multithreaded;
+	int foreground;
+	int err = -1;
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
+	  struct fuse_session* se;
+
+	  se = fuse_lowlevel_new(&args, &mirror_oper, sizeof(mirror_oper), NULL);
+	  if (se != NULL) {
+	    if (fuse_set_signal_handlers(se) != -1) {
+	      fuse_session_add_chan(se, ch);
+	      fuse_daemonize(foreground);
+	      if (multithreaded) {
+		err = fuse_session_loop_mt(se);
+	      } else {
+		err = fuse_session_loop(se);
+	      }
+	      fuse_remove_signal_handlers(se);
+	      fuse_session_remove_chan(ch);
+	    }
+	    fuse_session_destroy(se);
+	  }
+	  fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,1345 @@
+/**
+ * \file vers-store.c
+ *
+ * Reading versions back out of the store that versfs keeps in its storage
+ * directory, whatever format and codec they were stored with.  See
+ * vers-store.h for the layout.
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ */
+
+#ifdef linux
+/* For pread()/pwrite(), copy_file_range() and O_TMPFILE */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef linux
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "vers-store.h"
+
+int storage_fd = -1;
+
+/* The paths that FUSE hands us are absolute within the mount point.  Strip the
+   leading slash so that they can be resolved relative to storage_fd, which
+   saves the kernel from walking the storage directory's own path again. */
+const char* relative_path (const char* path) {
+  while (*path == '/') {
+    path += 1;
+  }
+  return *path == '\0' ? "." : path;
+}
+
+// The name of the file at path, without its directory.
+const char* base_name (const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash == NULL ? path : slash + 1;
+}
+
+// Open the history folder of the file at path, creating it (and the folders
+// above it within .vers) if create is set.  Returns a directory fd or a
+// negative errno.
+int open_hist_dir (const char* path, int create) {
+  char hist_path[PATH_MAX];
+
+  if (snprintf(hist_path, PATH_MAX, "%s%s%s", VERS_FOLDER, path, HIST_TAIL)
+      >= PATH_MAX) {
+    return -ENAMETOOLONG;
+  }
+
+  int fd = openat(storage_fd, relative_path(hist_path), O_RDONLY | O_DIRECTORY);
+  if (fd != -1 || errno != ENOENT || !create) {
+    return fd == -1 ? -errno : fd;
+  }
+
+  // Make each missing folder along the way, .vers itself included.
+  for (char* slash = strchr(hist_path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdirat(storage_fd, relative_path(hist_path), S_IRWXU | S_IRGRP | S_IROTH) == -1 &&
+        errno != EEXIST) {
+      return -errno;
+    }
+    *slash = '/';
+  }
+  if (mkdirat(storage_fd, relative_path(hist_path), S_IRWXU | S_IRGRP | S_IROTH) == -1 &&
+      errno != EEXIST) {
+    return -errno;
+  }
+
+  fd = openat(storage_fd, relative_path(hist_path), O_RDONLY | O_DIRECTORY);
+  return fd == -1 ? -errno : fd;
+}
+
+/* Copies between files stay in the kernel where they can.  On a file system
+   with reflinks (btrfs, XFS) the copy just shares the original's blocks, so
+   storing a version whole costs next to nothing however big the file is;
+   elsewhere copy_file_range() still saves the trip through user space.
+   Several threads clone at once, so the flag is read and cleared atomically. */
+int reflinks_work = 1;
+
+// Make length bytes at dst_offset in dst share the blocks of those at
+// src_offset in src.
+int clone_range (int dst, off_t dst_offset, int src, off_t src_offset, off_t length) {
+#ifdef FICLONERANGE
+  struct file_clone_range range = {
+    .src_fd      = src,
+    .src_offset  = src_offset,
+    .src_length  = length,
+    .dest_offset = dst_offset,
+  };
+
+  if (!__atomic_load_n(&reflinks_work, __ATOMIC_RELAXED)) {
+    return -EOPNOTSUPP;
+  }
+  if (ioctl(dst, FICLONERANGE, &range) == 0) {
+    return 0;
+  }
+  // EINVAL only says that this range is not aligned to whole blocks.
+  if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) {
+    __atomic_store_n(&reflinks_work, 0, __ATOMIC_RELAXED);
+  }
+  return -errno;
+#else
+  (void) dst;
+  (void) dst_offset;
+  (void) src;
+  (void) src_offset;
+  (void) length;
+  return -EOPNOTSUPP;
+#endif
+}
+
+// Copy length bytes at src_offset in src to dst_offset in dst.
+int copy_range (int dst, off_t dst_offset, int src, off_t src_offset, off_t length) {
+  char buf[COPY_CHUNK];
+
+  if (length == 0 || clone_range(dst, dst_offset, src, src_offset, length) == 0) {
+    return 0;
+  }
+  while (length > 0) {
+    ssize_t n = copy_file_range(src, &src_offset, dst, &dst_offset, length, 0);
+    if (n > 0) {
+      length -= n;
+    } else if (n == 0) {
+      return -EIO;
+    } else if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+      break;
+    } else if (errno != EINTR) {
+      return -errno;
+    }
+  }
+
+  // What the kernel would not copy goes through buf.
+  while (length > 0) {
+    ssize_t n = pread(src, buf, length < COPY_CHUNK ? length : COPY_CHUNK, src_offset);
+    if (n == -1) {
+      return -errno;
+    }
+    if (n == 0) {
+      return -EIO;
+    }
+    if (pwrite(dst, buf, n, dst_offset) != n) {
+      return -EIO;
+    }
+    src_offset += n;
+    dst_offset += n;
+    length     -= n;
+  }
+  return 0;
+}
+
+const char* codec_ext[] = { "", ".lz4", ".zst" };
+
+int write_all (int fd, const void* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      return -errno;
+    }
+    buf  = (const char*) buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Versions that are rebuilt from history (see materialize()) have to be read
+   back whatever codec they were compressed with, not just the one versfs is
+   compressing with now. */
+#ifdef HAVE_LZ4
+static int lz4_decompress (int in, int out) {
+  LZ4F_decompressionContext_t ctx;
+  char*                       src = malloc(COPY_CHUNK);
+  char*                       dst = malloc(COPY_CHUNK);
+  ssize_t                     n;
+  int                         res = 0;
+
+  if (src == NULL || dst == NULL ||
+      LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+    free(src);
+    free(dst);
+    return -ENOMEM;
+  }
+
+  while (res == 0 && (n = read(in, src, COPY_CHUNK)) > 0) {
+    size_t pos = 0;
+    for (;;) {
+      size_t dst_len = COPY_CHUNK;
+      size_t src_len = n - pos;
+      if (LZ4F_isError(LZ4F_decompress(ctx, dst, &dst_len, src + pos, &src_len, NULL))) {
+        res = -EIO;
+        break;
+      }
+      res  = write_all(out, dst, dst_len);
+      pos += src_len;
+      // A full buffer may mean there is more to come out before more goes in.
+      if (res != 0 || (pos == (size_t) n && dst_len < COPY_CHUNK)) {
+        break;
+      }
+    }
+  }
+  if (res == 0 && n == -1) {
+    res = -errno;
+  }
+
+  LZ4F_freeDecompressionContext(ctx);
+  free(src);
+  free(dst);
+  return res;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zstd_decompress (int in, int out) {
+  ZSTD_DCtx* ctx     = ZSTD_createDCtx();
+  size_t     in_cap  = ZSTD_DStreamInSize();
+  size_t     out_cap = ZSTD_DStreamOutSize();
+  char*      src     = malloc(in_cap);
+  char*      dst     = malloc(out_cap);
+  ssize_t    n;
+  int        res = 0;
+
+  if (ctx == NULL || src == NULL || dst == NULL) {
+    ZSTD_freeDCtx(ctx);
+    free(src);
+    free(dst);
+    return -ENOMEM;
+  }
+
+  while (res == 0 && (n = read(in, src, in_cap)) > 0) {
+    ZSTD_inBuffer input = { src, n, 0 };
+    while (res == 0 && input.pos < input.size) {
+      ZSTD_outBuffer output = { dst, out_cap, 0 };
+      if (ZSTD_isError(ZSTD_decompressStream(ctx, &output, &input))) {
+        res = -EIO;
+        break;
+      }
+      res = write_all(out, dst, output.pos);
+    }
+  }
+  if (res == 0 && n == -1) {
+    res = -errno;
+  }
+
+  ZSTD_freeDCtx(ctx);
+  free(src);
+  free(dst);
+  return res;
+}
+#endif
+
+int decompress_stream (int codec, int in, int out) {
+  (void) in;
+  (void) out;
+
+  switch (codec) {
+#ifdef HAVE_LZ4
+  case CODEC_LZ4:
+    return lz4_decompress(in, out);
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    return zstd_decompress(in, out);
+#endif
+  default:
+    return -ENOTSUP;
+  }
+}
+
+/* Finding out how big a compressed version is, or reading the header of a
+   compressed delta, does not need all of it inflated: versfs records the
+   content size in each frame it compresses, and a header is the first few
+   bytes out. */
+#ifdef HAVE_LZ4
+static ssize_t lz4_head (int in, char* buf, size_t len, off_t* size) {
+  LZ4F_decompressionContext_t ctx;
+  LZ4F_frameInfo_t            info;
+  char*                       src = malloc(COPY_CHUNK);
+  size_t                      got = 0;
+  ssize_t                     n   = 0;
+  int                         res = 0;
+
+  if (src == NULL || LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+    free(src);
+    return -ENOMEM;
+  }
+  while (res == 0 && (size != NULL || got < len) && (n = read(in, src, COPY_CHUNK)) > 0) {
+    size_t pos = 0;
+    if (size != NULL) {
+      // The frame header says how big the contents are, if anything does.
+      size_t src_len = n;
+      if (LZ4F_isError(LZ4F_getFrameInfo(ctx, &info, src, &src_len))) {
+        res = -EIO;
+      } else {
+        *size = info.contentSize;
+        res   = info.contentSize == 0 ? -ENODATA : 0;
+      }
+      break;
+    }
+    while (pos < (size_t) n && got < len) {
+      size_t dst_len = len - got;
+      size_t src_len = n - pos;
+      if (LZ4F_isError(LZ4F_decompress(ctx, buf + got, &dst_len, src + pos, &src_len, NULL))) {
+        res = -EIO;
+        break;
+      }
+      got += dst_len;
+      pos += src_len;
+      if (dst_len == 0 && src_len == 0) {
+        break;
+      }
+    }
+  }
+  if (res == 0 && n == -1) {
+    res = -errno;
+  }
+
+  LZ4F_freeDecompressionContext(ctx);
+  free(src);
+  return res < 0 ? res : (ssize_t) got;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t zstd_head (int in, char* buf, size_t len, off_t* size) {
+  ZSTD_DCtx* ctx    = ZSTD_createDCtx();
+  size_t     in_cap = ZSTD_DStreamInSize();
+  char*      src    = malloc(in_cap);
+  size_t     got    = 0;
+  ssize_t    n      = 0;
+  int        res    = 0;
+
+  if (ctx == NULL || src == NULL) {
+    ZSTD_freeDCtx(ctx);
+    free(src);
+    return -ENOMEM;
+  }
+  while (res == 0 && (size != NULL || got < len) && (n = read(in, src, in_cap)) > 0) {
+    ZSTD_inBuffer input = { src, n, 0 };
+    if (size != NULL) {
+      unsigned long long content = ZSTD_getFrameContentSize(src, n);
+      res   = content == ZSTD_CONTENTSIZE_ERROR ? -EIO
+            : content == ZSTD_CONTENTSIZE_UNKNOWN ? -ENODATA : 0;
+      *size = content;
+      break;
+    }
+    while (input.pos < input.size && got < len) {
+      ZSTD_outBuffer output = { buf + got, len - got, 0 };
+      if (ZSTD_isError(ZSTD_decompressStream(ctx, &output, &input))) {
+        res = -EIO;
+        break;
+      }
+      got += output.pos;
+    }
+  }
+  if (res == 0 && n == -1) {
+    res = -errno;
+  }
+
+  ZSTD_freeDCtx(ctx);
+  free(src);
+  return res < 0 ? res : (ssize_t) got;
+}
+#endif
+
+// Open the stored file name in dir_fd as it is, in whichever form it is in,
+// setting *codec to the one it was compressed with.
+static int open_packed (int dir_fd, const char* name, int* codec) {
+  char packed[PATH_MAX];
+
+  for (int c = CODEC_NONE; c <= CODEC_ZSTD; c += 1) {
+    snprintf(packed, PATH_MAX, "%s%s", name, codec_ext[c]);
+    int fd = openat(dir_fd, packed, O_RDONLY);
+    if (fd != -1 || errno != ENOENT) {
+      *codec = c;
+      return fd == -1 ? -errno : fd;
+    }
+  }
+  return -ENOENT;
+}
+
+// Read the first len bytes, or fewer if it is shorter, out of the stored file
+// name in dir_fd.  If size is set, it gets how big the file is instead, and
+// nothing is read.  Returns how many bytes were read, or -ENODATA if the size
+// is not recorded anywhere.
+static ssize_t read_packed_head (int dir_fd, const char* name, char* buf, size_t len,
+                                 off_t* size) {
+  struct stat st;
+  int         codec;
+  ssize_t     res;
+  int         fd = open_packed(dir_fd, name, &codec);
+
+  if (fd < 0) {
+    return fd;
+  }
+  switch (codec) {
+  case CODEC_NONE:
+    if (size != NULL) {
+      res   = fstat(fd, &st) == -1 ? -errno : 0;
+      *size = st.st_size;
+    } else {
+      res = pread(fd, buf, len, 0);
+      res = res == -1 ? -errno : res;
+    }
+    break;
+#ifdef HAVE_LZ4
+  case CODEC_LZ4:
+    res = lz4_head(fd, buf, len, size);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    res = zstd_head(fd, buf, len, size);
+    break;
+#endif
+  default:
+    res = -ENOTSUP;
+  }
+  close(fd);
+  return res;
+}
+
+// Read the i-th entry of the index idx_fd.
+int read_log_entry (int idx_fd, uint64_t i, struct log_entry* entry) {
+  ssize_t n = pread(idx_fd, entry, sizeof(*entry), i * sizeof(*entry));
+
+  if (n == -1) {
+    return -errno;
+  }
+  return n == sizeof(*entry) ? 0 : -EIO;
+}
+
+// How many whole entries the index idx_fd has.
+int64_t count_log_entries (int idx_fd) {
+  struct stat st;
+
+  if (fstat(idx_fd, &st) == -1) {
+    return -errno;
+  }
+  return st.st_size / sizeof(struct log_entry);
+}
+
+// Find the entry of version v in the index idx_fd, returning its position.
+int64_t find_log_entry (int idx_fd, uint64_t v, struct log_entry* entry) {
+  int64_t lo = 0;
+  int64_t hi = count_log_entries(idx_fd);
+
+  if (hi < 0) {
+    return hi;
+  }
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    int     res = read_log_entry(idx_fd, mid, entry);
+    if (res < 0) {
+      return res;
+    }
+    if (entry->version == v) {
+      return mid;
+    }
+    if (entry->version < v) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -ENOENT;
+}
+
+static uint64_t rotl64 (uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// MurmurHash3's finalizer, which spreads every bit of k over all the others.
+uint64_t fmix64 (uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// MurmurHash3's 128-bit x64 variant, which names chunks.  It is fast but not
+// cryptographic, and collisions can be made on purpose, so versfs checks the
+// bytes of a chunk that it finds before sharing it.
+void hash_chunk (const uint8_t* data, size_t len, uint8_t out[HASH_BYTES]) {
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t       h1 = 0;
+  uint64_t       h2 = 0;
+  size_t         i  = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    uint64_t k1;
+    uint64_t k2;
+    memcpy(&k1, data + i, 8);
+    memcpy(&k2, data + i + 8, 8);
+    h1 ^= rotl64(k1 * c1, 31) * c2;
+    h1  = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+    h2 ^= rotl64(k2 * c2, 33) * c1;
+    h2  = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+  }
+
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  for (size_t j = len - i; j > 8; j -= 1) {
+    k2 ^= (uint64_t) data[i + j - 1] << (8 * (j - 9));
+  }
+  for (size_t j = len - i < 8 ? len - i : 8; j > 0; j -= 1) {
+    k1 ^= (uint64_t) data[i + j - 1] << (8 * (j - 1));
+  }
+  if (len - i > 8) {
+    h2 ^= rotl64(k2 * c2, 33) * c1;
+  }
+  if (len - i > 0) {
+    h1 ^= rotl64(k1 * c1, 31) * c2;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1  = fmix64(h1);
+  h2  = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  memcpy(out, &h1, 8);
+  memcpy(out + 8, &h2, 8);
+}
+
+// Step hash on to the next one along, for a chunk whose own hash is taken by
+// other contents.
+void next_hash (uint8_t hash[HASH_BYTES]) {
+  for (int i = HASH_BYTES - 1; i >= 0; i -= 1) {
+    hash[i] += 1;
+    if (hash[i] != 0) {
+      break;
+    }
+  }
+}
+
+void hash_to_hex (const uint8_t hash[HASH_BYTES], char hex[2 * HASH_BYTES + 1]) {
+  for (int i = 0; i < HASH_BYTES; i += 1) {
+    sprintf(hex + 2 * i, "%02x", hash[i]);
+  }
+}
+
+int hex_to_hash (const char* hex, uint8_t hash[HASH_BYTES]) {
+  for (int i = 0; i < HASH_BYTES; i += 1) {
+    unsigned byte;
+    if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+      return -1;
+    }
+    hash[i] = (uint8_t) byte;
+  }
+  return 0;
+}
+
+void chunk_path (const uint8_t hash[HASH_BYTES], char path[PATH_MAX]) {
+  char hex[2 * HASH_BYTES + 1];
+
+  hash_to_hex(hash, hex);
+  snprintf(path, PATH_MAX, "%s/%.2s/%s", CHUNKS_FOLDER, hex, hex);
+}
+
+/* Versions are rebuilt from the history by materialize(), into an unnamed
+   scratch file: from the nearest version stored whole, forward through the
+   deltas after it.  versfs keeps them on the storage file system, where
+   they can share blocks with the store; vers-tool, which may only be able
+   to read the store, points scratch_fd at $TMPDIR. */
+int scratch_fd = -1;
+
+// An empty file to rebuild a version in, which goes away when it is closed.
+int open_scratch (void) {
+  static unsigned long scratch_count = 0;
+  char                 scratch_path[PATH_MAX];
+  int                  dir_fd = scratch_fd != -1 ? scratch_fd : storage_fd;
+  const char*          dir    = scratch_fd != -1 ? "." : relative_path(VERS_FOLDER);
+  int                  fd;
+
+  fd = openat(dir_fd, dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+    return fd == -1 ? -errno : fd;
+  }
+
+  // Without O_TMPFILE, make a file and unlink it straight away.
+  snprintf(scratch_path, PATH_MAX, "%s/scratch.%ld.%lu", dir,
+           (long) getpid(), __sync_fetch_and_add(&scratch_count, 1));
+  fd = openat(dir_fd, scratch_path, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return -errno;
+  }
+  unlinkat(dir_fd, scratch_path, 0);
+  return fd;
+}
+
+// Open a stored file for reading whichever form it is in, decompressing it
+// into a scratch file if the compressor got to it.
+int open_stored (int dir_fd, const char* name) {
+  char packed[PATH_MAX];
+  int  fd = openat(dir_fd, name, O_RDONLY);
+
+  if (fd != -1 || errno != ENOENT) {
+    return fd == -1 ? -errno : fd;
+  }
+  for (int c = CODEC_LZ4; c <= CODEC_ZSTD; c += 1) {
+    snprintf(packed, PATH_MAX, "%s%s", name, codec_ext[c]);
+    int in = openat(dir_fd, packed, O_RDONLY);
+    if (in == -1) {
+      continue;
+    }
+    fd = open_scratch();
+    if (fd < 0) {
+      close(in);
+      return fd;
+    }
+    int res = decompress_stream(c, in, fd);
+    close(in);
+    if (res == 0 && lseek(fd, 0, SEEK_SET) == -1) {
+      res = -errno;
+    }
+    if (res < 0) {
+      close(fd);
+      return res;
+    }
+    return fd;
+  }
+  return -ENOENT;
+}
+
+// Turn the version in out into the next one, by laying the delta that starts
+// at start in delta_fd over it.
+int apply_delta (int out, int delta_fd, off_t start) {
+  int            dup_fd = dup(delta_fd);
+  FILE*          delta  = dup_fd == -1 ? NULL : fdopen(dup_fd, "r");
+  struct extent* extents = NULL;
+  char           line[128];
+  long long      keep;
+  long long      size;
+  int            count;
+  off_t          pos;
+  int            res = 0;
+
+  if (delta == NULL) {
+    if (dup_fd != -1) {
+      close(dup_fd);
+    }
+    return -ENOMEM;
+  }
+  if (fseeko(delta, start, SEEK_SET) == -1) {
+    fclose(delta);
+    return -EIO;
+  }
+  // The header is read a line at a time so that the data after it is not
+  // mistaken for more of it.
+  if (fgets(line, sizeof(line), delta) == NULL ||
+      sscanf(line, "VDELTA %lld %lld %d", &keep, &size, &count) != 3 || count < 0) {
+    res = -EIO;
+  } else if (count > 0 && (extents = malloc(count * sizeof(*extents))) == NULL) {
+    res = -ENOMEM;
+  }
+  for (int i = 0; res == 0 && i < count; i += 1) {
+    long long offset;
+    long long length;
+    if (fgets(line, sizeof(line), delta) == NULL ||
+        sscanf(line, "%lld %lld", &offset, &length) != 2) {
+      res = -EIO;
+    } else {
+      extents[i].offset = offset;
+      extents[i].length = length;
+    }
+  }
+  pos = ftello(delta);
+  fclose(delta);
+
+  if (res == 0 && (ftruncate(out, keep) == -1 || ftruncate(out, size) == -1)) {
+    res = -errno;
+  }
+  for (int i = 0; res == 0 && i < count; i += 1) {
+    res  = copy_range(out, extents[i].offset, delta_fd, pos, extents[i].length);
+    pos += extents[i].length;
+  }
+  free(extents);
+  return res;
+}
+
+// Write out the version listed in the chunk list manifest_fd.
+static int read_chunks (int out, int manifest_fd) {
+  int   dup_fd   = dup(manifest_fd);
+  FILE* manifest = dup_fd == -1 ? NULL : fdopen(dup_fd, "r");
+  char  line[128];
+  off_t pos = 0;
+  int   res = 0;
+
+  if (manifest == NULL) {
+    if (dup_fd != -1) {
+      close(dup_fd);
+    }
+    return -ENOMEM;
+  }
+  while (res == 0 && fgets(line, sizeof(line), manifest) != NULL) {
+    uint8_t   hash[HASH_BYTES];
+    char      path[PATH_MAX];
+    long long length;
+
+    if (strncmp(line, "VCHUNKS", 7) == 0) {
+      continue;
+    }
+    if (hex_to_hash(line, hash) == -1 ||
+        sscanf(line + 2 * HASH_BYTES, "%lld", &length) != 1) {
+      res = -EIO;
+      break;
+    }
+    chunk_path(hash, path);
+    int fd = open_stored(storage_fd, path);
+    if (fd < 0) {
+      res = fd;
+      break;
+    }
+    res  = copy_range(out, pos, fd, 0, length);
+    pos += length;
+    close(fd);
+  }
+  fclose(manifest);
+  return res;
+}
+
+// Read which version the delta of version v that starts at start in fd is
+// laid over: the one its header names, or else v - 1.
+int delta_base (int fd, off_t start, uint64_t v, uint64_t* base) {
+  char               header[128];
+  char*              newline;
+  long long          keep;
+  long long          size;
+  int                count;
+  unsigned long long named;
+  ssize_t            got = pread(fd, header, sizeof(header) - 1, start);
+
+  if (got == -1) {
+    return -errno;
+  }
+  header[got] = '\0';
+  // Only the first line is the header; the extents come after it.
+  newline = strchr(header, '\n');
+  if (newline == NULL) {
+    return -EIO;
+  }
+  *newline = '\0';
+  switch (sscanf(header, "VDELTA %lld %lld %d %llu", &keep, &size, &count, &named)) {
+  case 4:
+    *base = named;
+    return named < v ? 0 : -EIO;
+  case 3:
+    *base = v - 1;
+    return v > 0 ? 0 : -EIO;
+  default:
+    return -EIO;
+  }
+}
+
+// Rebuild version v of the file called name, whose history folder is hist_fd,
+// from the files the versions are stored in on their own.
+static int materialize_files (int hist_fd, const char* name, uint64_t v, int out) {
+  char     snap_name[NAME_MAX + 1];
+  uint64_t base = v;
+  int*     deltas = NULL;
+  size_t   count  = 0;
+  size_t   room   = 0;
+  int      fd;
+  int      res;
+
+  // Walk back to the nearest version that does not depend on another,
+  // keeping the deltas on the way open.
+  for (;;) {
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64, name, base);
+    fd = open_stored(hist_fd, snap_name);
+    if (fd >= 0) {
+      struct stat st;
+      res = fstat(fd, &st) == -1 ? -errno : copy_range(out, 0, fd, 0, st.st_size);
+      close(fd);
+      break;
+    }
+    if (fd != -ENOENT) {
+      res = fd;
+      break;
+    }
+    strncat(snap_name, ".chunks", sizeof(snap_name) - strlen(snap_name) - 1);
+    fd = openat(hist_fd, snap_name, O_RDONLY);
+    if (fd != -1) {
+      res = read_chunks(out, fd);
+      close(fd);
+      break;
+    }
+    if (errno != ENOENT) {
+      res = -errno;
+      break;
+    }
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 ".delta", name, base);
+    fd = open_stored(hist_fd, snap_name);
+    if (fd < 0) {
+      res = fd;
+      break;
+    }
+    if (count == room) {
+      int* grown = realloc(deltas, (room ? 2 * room : 16) * sizeof(*grown));
+      if (grown == NULL) {
+        close(fd);
+        res = -ENOMEM;
+        break;
+      }
+      deltas = grown;
+      room   = room ? 2 * room : 16;
+    }
+    deltas[count] = fd;
+    count += 1;
+    res = delta_base(fd, 0, base, &base);
+    if (res < 0) {
+      break;
+    }
+  }
+
+  for (size_t i = count; i > 0; i -= 1) {
+    if (res == 0) {
+      res = apply_delta(out, deltas[i - 1], 0);
+    }
+    close(deltas[i - 1]);
+  }
+  free(deltas);
+  return res;
+}
+
+// Rebuild version v from the log of the file called name, given its index.
+static int materialize_log (int hist_fd, const char* name, int idx_fd,
+                            uint64_t v, int out) {
+  char             log_name[NAME_MAX + 1];
+  struct log_entry entry;
+  int64_t          last = find_log_entry(idx_fd, v, &entry);
+  int64_t          base = last;
+  int              log_fd;
+  int              res = 0;
+
+  if (last < 0) {
+    return last;
+  }
+  // Walk back to the nearest keyframe.
+  while (res == 0 && entry.kind != VERSION_KEYFRAME && base > 0) {
+    base -= 1;
+    res = read_log_entry(idx_fd, base, &entry);
+  }
+  if (res < 0) {
+    return res;
+  }
+
+  snprintf(log_name, sizeof(log_name), "%s%s", name, LOG_TAIL);
+  log_fd = openat(hist_fd, log_name, O_RDONLY);
+  if (log_fd == -1) {
+    return -errno;
+  }
+  if (entry.kind == VERSION_KEYFRAME) {
+    res = copy_range(out, 0, log_fd, entry.offset, entry.length);
+  } else {
+    // A log begun before the first record was made a keyframe can start
+    // with a delta over a version stored on its own.
+    uint64_t from;
+    res = delta_base(log_fd, entry.offset, entry.version, &from);
+    if (res == 0) {
+      res = materialize_files(hist_fd, name, from, out);
+    }
+    if (res == 0) {
+      res = apply_delta(out, log_fd, entry.offset);
+    }
+  }
+  for (int64_t i = base + 1; res == 0 && i <= last; i += 1) {
+    res = read_log_entry(idx_fd, i, &entry);
+    if (res == 0) {
+      res = apply_delta(out, log_fd, entry.offset);
+    }
+  }
+  close(log_fd);
+  return res;
+}
+
+// Rebuild version v of the file called name, whose history folder is hist_fd,
+// into the empty file out.  A store switched to a log keeps the versions from
+// before on their own, so those are looked for there.
+int materialize (int hist_fd, const char* name, uint64_t v, int out) {
+  char snap_name[NAME_MAX + 1];
+  int  fd;
+  int  res;
+
+  snprintf(snap_name, sizeof(snap_name), "%s%s", name, IDX_TAIL);
+  fd = openat(hist_fd, snap_name, O_RDONLY);
+  if (fd != -1) {
+    res = materialize_log(hist_fd, name, fd, v, out);
+    close(fd);
+    if (res != -ENOENT) {
+      return res;
+    }
+  }
+  return materialize_files(hist_fd, name, v, out);
+}
+
+// For qsort(), lowest version first.
+static int compare_versions (const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// List the versions of the file called name, whose history folder is hist_fd,
+// in order: *versions is a new array of *count of them.
+int list_versions (int hist_fd, const char* name, uint64_t** versions, size_t* count) {
+  char           index_name[NAME_MAX + 1];
+  size_t         name_len = strlen(name);
+  size_t         capacity = 0;
+  int            res      = 0;
+  int            fd;
+  DIR*           dp;
+  struct dirent* de;
+
+  *versions = NULL;
+  *count    = 0;
+
+  // The log's index lists the versions it holds, in order.  Those stored
+  // before the store was switched to a log are found on their own below.
+  snprintf(index_name, sizeof(index_name), "%s%s", name, IDX_TAIL);
+  fd = openat(hist_fd, index_name, O_RDONLY);
+  if (fd != -1) {
+    struct log_entry entry;
+    int64_t          n = count_log_entries(fd);
+    if (n < 0) {
+      res = n;
+    } else if (n > 0 && (*versions = malloc(n * sizeof(**versions))) == NULL) {
+      res = -ENOMEM;
+    }
+    for (int64_t i = 0; res == 0 && i < n; i += 1) {
+      res = read_log_entry(fd, i, &entry);
+      (*versions)[i] = entry.version;
+    }
+    close(fd);
+    if (res < 0) {
+      free(*versions);
+      *versions = NULL;
+      return res;
+    }
+    *count   = n;
+    capacity = n;
+  }
+
+  fd = openat(hist_fd, ".", O_RDONLY | O_DIRECTORY);
+  dp = fd == -1 ? NULL : fdopendir(fd);
+  if (dp == NULL) {
+    res = -errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    return res;
+  }
+  while (res == 0 && (de = readdir(dp)) != NULL) {
+    // foo.txt,<v> with maybe .delta, .chunks, .lz4 or .zst after it.
+    char* end;
+    if (strncmp(de->d_name, name, name_len) != 0 || de->d_name[name_len] != ',' ||
+        de->d_name[name_len + 1] < '0' || de->d_name[name_len + 1] > '9') {
+      continue;
+    }
+    uint64_t v = strtoull(de->d_name + name_len + 1, &end, 10);
+    if (*end != '\0' && *end != '.') {
+      continue;
+    }
+    if (*count == capacity) {
+      uint64_t* grown = realloc(*versions, (capacity ? 2 * capacity : 16) * sizeof(*grown));
+      if (grown == NULL) {
+        res = -ENOMEM;
+        break;
+      }
+      *versions = grown;
+      capacity  = capacity ? 2 * capacity : 16;
+    }
+    (*versions)[*count] = v;
+    *count += 1;
+  }
+  closedir(dp);
+  if (res < 0) {
+    free(*versions);
+    *versions = NULL;
+    *count    = 0;
+    return res;
+  }
+
+  // A version caught while it was being compressed is there twice.
+  qsort(*versions, *count, sizeof(**versions), compare_versions);
+  size_t kept = 0;
+  for (size_t i = 0; i < *count; i += 1) {
+    if (kept == 0 || (*versions)[kept - 1] != (*versions)[i]) {
+      (*versions)[kept] = (*versions)[i];
+      kept += 1;
+    }
+  }
+  *count = kept;
+  return 0;
+}
+
+// Find the last entry of the index fd, whose entries are stride bytes apart,
+// that was stored at or before t.
+static int search_time (int fd, size_t stride, time_t t, uint64_t* v) {
+  struct when_entry entry;
+  struct stat       st;
+  int64_t           lo = 0;
+  int64_t           hi;
+
+  if (fstat(fd, &st) == -1) {
+    return -errno;
+  }
+  hi = st.st_size / stride;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (pread(fd, &entry, sizeof(entry), mid * stride) != sizeof(entry)) {
+      return -EIO;
+    }
+    if (entry.time <= t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return -ENOENT;
+  }
+  if (pread(fd, &entry, sizeof(entry), (lo - 1) * stride) != sizeof(entry)) {
+    return -EIO;
+  }
+  *v = entry.version;
+  return 0;
+}
+
+// Find the newest version of the file called name, whose history folder is
+// hist_fd, that was stored at or before t.
+int version_at (int hist_fd, const char* name, time_t t, uint64_t* v) {
+  char           index_name[NAME_MAX + 1];
+  size_t         name_len = strlen(name);
+  int            found    = 0;
+  int            fd;
+  DIR*           dp;
+  struct dirent* de;
+
+  snprintf(index_name, sizeof(index_name), "%s%s", name, IDX_TAIL);
+  fd = openat(hist_fd, index_name, O_RDONLY);
+  if (fd != -1) {
+    int res = search_time(fd, sizeof(struct log_entry), t, v);
+    close(fd);
+    // Before the log's first entry, the versions stored on their own.
+    if (res != -ENOENT) {
+      return res;
+    }
+  }
+  snprintf(index_name, sizeof(index_name), "%s%s", name, WHEN_TAIL);
+  fd = openat(hist_fd, index_name, O_RDONLY);
+  if (fd != -1) {
+    int res = search_time(fd, sizeof(struct when_entry), t, v);
+    close(fd);
+    return res;
+  }
+
+  // A history stored before there were .when lists has only its files'
+  // modification times to go on.
+  fd = openat(hist_fd, ".", O_RDONLY | O_DIRECTORY);
+  dp = fd == -1 ? NULL : fdopendir(fd);
+  if (dp == NULL) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return -ENOENT;
+  }
+  while ((de = readdir(dp)) != NULL) {
+    struct stat st;
+    char*       end;
+    if (strncmp(de->d_name, name, name_len) != 0 || de->d_name[name_len] != ',' ||
+        de->d_name[name_len + 1] < '0' || de->d_name[name_len + 1] > '9' ||
+        fstatat(hist_fd, de->d_name, &st, 0) == -1 || st.st_mtime > t) {
+      continue;
+    }
+    uint64_t found_v = strtoull(de->d_name + name_len + 1, &end, 10);
+    if ((*end == '\0' || *end == '.') && (!found || found_v > *v)) {
+      *v    = found_v;
+      found = 1;
+    }
+  }
+  closedir(dp);
+  return found ? 0 : -ENOENT;
+}
+
+// Read the size out of the header of a delta or chunk list.
+static int header_size (const char* header, off_t* size) {
+  long long keep;
+  long long n;
+
+  if (sscanf(header, "VDELTA %lld %lld", &keep, &n) == 2 ||
+      sscanf(header, "VCHUNKS %lld", &n) == 1) {
+    *size = n;
+    return 0;
+  }
+  return -EIO;
+}
+
+// When version v of the file called name was stored, by its .when list.
+static int when_stored (int hist_fd, const char* name, uint64_t v, time_t* t) {
+  char              when_name[NAME_MAX + 1];
+  struct when_entry entry;
+  int64_t           lo = 0;
+  int64_t           hi;
+  struct stat       st;
+  int               res = -ENOENT;
+  int               fd;
+
+  snprintf(when_name, sizeof(when_name), "%s%s", name, WHEN_TAIL);
+  fd = openat(hist_fd, when_name, O_RDONLY);
+  if (fd == -1) {
+    return -errno;
+  }
+  hi = fstat(fd, &st) == -1 ? 0 : st.st_size / (int64_t) sizeof(entry);
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (pread(fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry)) {
+      res = -EIO;
+      break;
+    }
+    if (entry.version == v) {
+      *t  = entry.time;
+      res = 0;
+      break;
+    }
+    if (entry.version < v) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  close(fd);
+  return res;
+}
+
+// Fill in st for version v of the file called name, whose history folder is
+// hist_fd: when it was stored and how big it is.  Neither needs the version
+// rebuilt, or even decompressed.
+int stat_version (int hist_fd, const char* name, uint64_t v, struct stat* st) {
+  static const char* tails[] = { "", ".delta", ".chunks" };
+  char               snap_name[NAME_MAX + 1];
+  char               header[128];
+  struct log_entry   entry;
+  struct stat        stored;
+  int                fd;
+  ssize_t            res = -ENOENT;
+
+  if (fstat(hist_fd, st) == -1) {
+    return -errno;
+  }
+  st->st_mode  = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+  st->st_nlink = 1;
+
+  snprintf(snap_name, sizeof(snap_name), "%s%s", name, IDX_TAIL);
+  fd = openat(hist_fd, snap_name, O_RDONLY);
+  // A version from before the store was switched to a log is on its own.
+  if (fd != -1 && find_log_entry(fd, v, &entry) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd != -1) {
+    close(fd);
+    st->st_atime = st->st_mtime = st->st_ctime = entry.time;
+    if (entry.kind == VERSION_KEYFRAME) {
+      st->st_size = entry.length;
+      return 0;
+    }
+    snprintf(snap_name, sizeof(snap_name), "%s%s", name, LOG_TAIL);
+    fd = openat(hist_fd, snap_name, O_RDONLY);
+    if (fd == -1) {
+      return -errno;
+    }
+    res = pread(fd, header, sizeof(header) - 1, entry.offset);
+    close(fd);
+    if (res < 0) {
+      return -errno;
+    }
+    header[res] = '\0';
+    return header_size(header, &st->st_size);
+  }
+
+  for (int t = 0; t < 3 && res == -ENOENT; t += 1) {
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 "%s", name, v, tails[t]);
+    if (t > 0) {
+      res = read_packed_head(hist_fd, snap_name, header, sizeof(header) - 1, NULL);
+      if (res >= 0) {
+        header[res] = '\0';
+        res = header_size(header, &st->st_size);
+      }
+      continue;
+    }
+    res = read_packed_head(hist_fd, snap_name, NULL, 0, &st->st_size);
+    // A frame compressed before sizes were recorded has to be inflated.
+    if (res == -ENODATA) {
+      fd  = open_stored(hist_fd, snap_name);
+      res = fd < 0 ? fd : fstat(fd, &stored) == -1 ? -errno : 0;
+      if (fd >= 0) {
+        st->st_size = stored.st_size;
+        close(fd);
+      }
+    }
+  }
+  if (res < 0) {
+    return res;
+  }
+
+  // A version's times are when it was stored, which the .when list keeps.
+  // Older histories only have the stored file's own modification time.
+  if (when_stored(hist_fd, name, v, &st->st_mtime) < 0) {
+    int codec;
+    for (int t = 0; t < 3; t += 1) {
+      snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 "%s", name, v, tails[t]);
+      fd = open_packed(hist_fd, snap_name, &codec);
+      if (fd >= 0) {
+        if (fstat(fd, &stored) == 0) {
+          st->st_mtime = stored.st_mtime;
+        }
+        close(fd);
+        break;
+      }
+    }
+  }
+  st->st_atime = st->st_ctime = st->st_mtime;
+  return 0;
+}
+
+// Check that the stored chunk with the given hash is length bytes long and
+// hashes to its name, or to a hash a few before it along (see next_hash()).
+int check_chunk (const uint8_t hash[HASH_BYTES], off_t length) {
+  char        path[PATH_MAX];
+  uint8_t     got[HASH_BYTES];
+  struct stat st;
+  uint8_t*    data = malloc(length > 0 ? length : 1);
+  int         res  = 0;
+  int         fd;
+
+  chunk_path(hash, path);
+  fd = open_stored(storage_fd, path);
+  if (data == NULL || fd < 0) {
+    free(data);
+    return fd < 0 ? fd : -ENOMEM;
+  }
+  if (fstat(fd, &st) == -1) {
+    res = -errno;
+  } else if (st.st_size != length || pread(fd, data, length, 0) != length) {
+    res = -EIO;
+  }
+  close(fd);
+  if (res == 0) {
+    hash_chunk(data, length, got);
+    res = -EIO;
+    for (int probe = 0; probe < CHUNK_PROBES && res < 0; probe += 1) {
+      res = memcmp(got, hash, HASH_BYTES) == 0 ? 0 : -EIO;
+      next_hash(got);
+    }
+  }
+  free(data);
+  return res;
+}
+
+// Check the contents of version v of the file called name, as far as the
+// store can: each chunk of a chunk list is hashed again.  Keyframes and
+// deltas carry no checksums.
+int check_version (int hist_fd, const char* name, uint64_t v) {
+  char  snap_name[NAME_MAX + 1];
+  char  line[128];
+  int   res = 0;
+  int   fd;
+  FILE* manifest;
+
+  snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 ".chunks", name, v);
+  fd = openat(hist_fd, snap_name, O_RDONLY);
+  if (fd == -1) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+  manifest = fdopen(fd, "r");
+  if (manifest == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  while (res == 0 && fgets(line, sizeof(line), manifest) != NULL) {
+    uint8_t   hash[HASH_BYTES];
+    long long length;
+    if (strncmp(line, "VCHUNKS", 7) == 0) {
+      continue;
+    }
+    if (hex_to_hash(line, hash) == -1 || sscanf(line + 2 * HASH_BYTES, "%lld", &length) != 1) {
+      res = -EIO;
+    } else {
+      res = check_chunk(hash, length);
+    }
+  }
+  fclose(manifest);
+  return res;
+}
+
+// Read a time given as seconds since the epoch (optionally after an @, as
+// date +@%s prints them) or as a local date and time.
+time_t parse_time (const char* text) {
+  static const char* formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+                                   "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+  char*              end;
+
+  if (text[0] == '@') {
+    text += 1;
+  }
+  long long seconds = strtoll(text, &end, 10);
+  if (end != text && *end == '\0') {
+    return seconds;
+  }
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i += 1) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(text, formats[i], &tm);
+    if (end != NULL && *end == '\0') {
+      tm.tm_isdst = -1;
+      return mktime(&tm);
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,150 @@
+/**
+ * \file vers-store.h
+ *
+ * The layout of the version store that versfs keeps in its storage
+ * directory, and the functions that read versions back out of it.  They are
+ * shared by versfs itself and by vers-tool.
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ */
+
+#ifndef VERS_STORE_H
+#define VERS_STORE_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The history of each file lives in .vers/<path>_hist/ under the storage
+   directory.  Version v of a file called foo.txt is stored there either whole,
+   as foo.txt,v, or as foo.txt,v.delta, a record of how it differs from version
+   v - 1.  Every config.keyframe versions is stored whole, so that rebuilding
+   any version never has to replay more than that many deltas.
+
+   A delta is a text header followed by the new bytes:
+
+     VDELTA <keep> <size> <count>
+     <offset> <length>          (count lines of these)
+     <the count extents' data, one after the other>
+
+   To rebuild version v, take version v - 1, cut it down to keep bytes, pad it
+   with zeros out to size bytes, and lay each extent's data over it.  A delta
+   written when the versions in between were pruned away names the version
+   it is laid over instead, as a fifth word of its header. */
+#define VERS_FOLDER "/.vers"
+#define HIST_TAIL   "_hist"
+#define NEXT_VERS   "next_vers.txt"
+#define COPY_CHUNK  (64 * 1024)
+
+/* A range of the live file that has changed since the previous version. */
+struct extent {
+  off_t offset;
+  off_t length;
+};
+
+/* How version files are compressed; see compress_one(). */
+enum codec {
+  CODEC_NONE,
+  CODEC_LZ4,
+  CODEC_ZSTD,
+};
+
+extern const char* codec_ext[];
+
+/* With -o format=log, the versions of a file are not kept one file each but
+   appended as records to a single log, foo.txt.log, in the history folder.
+   Each record is a keyframe or a delta, laid out just as the files of the
+   delta format are.  Next to the log, foo.txt.idx has one log_entry per
+   record, in version order, so that a version is found by binary search and
+   a file with thousands of versions costs three inodes, not thousands.  The
+   index is written after the record, so a record is only there once it is
+   indexed, and a torn record at the end of the log is written over. */
+#define LOG_TAIL ".log"
+#define IDX_TAIL ".idx"
+
+enum version_kind {
+  VERSION_KEYFRAME,
+  VERSION_DELTA,
+};
+
+struct log_entry {
+  uint64_t version;
+  int64_t  time;      // when the version was stored
+  uint64_t offset;    // where the record starts in the log
+  uint64_t length;
+  uint64_t kind;      // a version_kind
+};
+
+/* The other formats keep a list of when each version was stored next to the
+   versions, foo.txt.when.  Its entries start just as a log_entry does, so the
+   two are searched by time alike; see version_at(). */
+#define WHEN_TAIL ".when"
+
+struct when_entry {
+  uint64_t version;
+  int64_t  time;
+};
+
+/* The store keeps its own folders in .vers-store/, beside .vers rather than
+   in it, so that no folder of the mount can share their names. */
+#define STORE_FOLDER ".vers-store"
+
+/* With -o format=chunk, each version is a list of chunks, and the chunk
+   with a given hash lives in .vers-store/chunks/<first two hex digits>/<hash>;
+   see store_chunks() in versfs.c. */
+#define CHUNKS_FOLDER STORE_FOLDER "/chunks"
+#define HASH_BYTES    16
+#define CHUNK_PROBES  8   // hashes tried for one chunk's contents
+
+/* The histories of removed files wait in .vers-store/trash/ to be deleted,
+   and pruned histories are put together in .vers-store/compact/. */
+#define TRASH_FOLDER   STORE_FOLDER "/trash"
+#define COMPACT_FOLDER STORE_FOLDER "/compact"
+
+/* The storage directory, which every path in the store is relative to. */
+extern int storage_fd;
+
+const char* relative_path (const char* path);
+const char* base_name (const char* path);
+int         open_hist_dir (const char* path, int create);
+
+/* Cleared once the storage file system turns out not to have reflinks. */
+extern int reflinks_work;
+
+int clone_range (int dst, off_t dst_offset, int src, off_t src_offset, off_t length);
+int copy_range (int dst, off_t dst_offset, int src, off_t src_offset, off_t length);
+int write_all (int fd, const void* buf, size_t len);
+int decompress_stream (int codec, int in, int out);
+
+int     read_log_entry (int idx_fd, uint64_t i, struct log_entry* entry);
+int64_t count_log_entries (int idx_fd);
+int64_t find_log_entry (int idx_fd, uint64_t v, struct log_entry* entry);
+
+uint64_t fmix64 (uint64_t k);
+void     hash_chunk (const uint8_t* data, size_t len, uint8_t out[HASH_BYTES]);
+void     next_hash (uint8_t hash[HASH_BYTES]);
+int      check_chunk (const uint8_t hash[HASH_BYTES], off_t length);
+
+void hash_to_hex (const uint8_t hash[HASH_BYTES], char hex[2 * HASH_BYTES + 1]);
+int  hex_to_hash (const char* hex, uint8_t hash[HASH_BYTES]);
+void chunk_path (const uint8_t hash[HASH_BYTES], char path[PATH_MAX]);
+
+/* Where scratch files are made: a directory opened by the program, or -1 for
+   the store's own .vers, which has to be writable then. */
+extern int scratch_fd;
+
+int open_scratch (void);
+int open_stored (int dir_fd, const char* name);
+int apply_delta (int out, int delta_fd, off_t start);
+int delta_base (int fd, off_t start, uint64_t v, uint64_t* base);
+int materialize (int hist_fd, const char* name, uint64_t v, int out);
+int list_versions (int hist_fd, const char* name, uint64_t** versions, size_t* count);
+int version_at (int hist_fd, const char* name, time_t t, uint64_t* v);
+int stat_version (int hist_fd, const char* name, uint64_t v, struct stat* st);
+int check_version (int hist_fd, const char* name, uint64_t v);
+
+time_t parse_time (const char* text);
+
+#endif
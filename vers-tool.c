@@ -0,0 +1,596 @@
+/**
+ * \file vers-tool.c
+ *
+ * Reads the versions that versfs stored out of its storage directory, without
+ * mounting it:
+ *
+ *   vers-tool export  <storage> <dest> [-v <from>-<to>] [-j <n>] [<path>...]
+ *   vers-tool restore <storage> <dest> [-v <version> | -t <time>] [-j <n>] [<path>...]
+ *   vers-tool verify  <storage> [-v <from>-<to>] [-j <n>] [<path>...]
+ *
+ * export writes every version of each file as <dest>/<path>,<version>;
+ * restore writes one version of each file as <dest>/<path>, the newest unless
+ * -v or -t says otherwise; verify rebuilds every version, checks that it
+ * comes out the size it was stored at, and hashes each of its chunks again.
+ * The paths are files or folders within the mount; with none, the whole
+ * store is read.  With a dest of -, the files go to standard
+ * output as a tar archive instead.
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ */
+
+#ifdef linux
+/* For copy_file_range(), and O_TMPFILE in vers-store.c */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vers-store.h"
+
+enum command {
+  EXPORT,
+  RESTORE,
+  VERIFY,
+};
+
+/* Everything to be read out is listed first, one item per version, and then
+   shared out among the threads, each of which takes the next item that no
+   other has taken yet.  A version is rebuilt straight into its file under
+   dest, so a version stored whole in a store with reflinks is cloned rather
+   than copied; in a tar archive, it is rebuilt in a scratch file first and
+   then written out whole, one file at a time. */
+struct item {
+  char*    path;     // within the mount, starting with a slash
+  uint64_t version;
+};
+
+static enum command  command;
+static struct item*  items      = NULL;
+static size_t        item_count = 0;
+static size_t        item_room  = 0;
+static size_t        next_item  = 0;
+static int           failures   = 0;
+static int           dest_fd    = -1;    // or -1 when writing a tar archive
+static pthread_mutex_t tar_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Which versions to read: from first to last, or the newest stored at or
+// before as_of.
+static uint64_t first_version = 0;
+static uint64_t last_version  = UINT64_MAX;
+static time_t   as_of         = 0;
+
+static const char* command_names[] = { "export", "restore", "verify" };
+
+static void usage (void) {
+  fprintf(stderr,
+          "USAGE: vers-tool export  <storage> <dest|-> [-v <from>-<to>] [-j <n>] [<path>...]\n"
+          "       vers-tool restore <storage> <dest|-> [-v <version> | -t <time>] [-j <n>] [<path>...]\n"
+          "       vers-tool verify  <storage> [-v <from>-<to>] [-j <n>] [<path>...]\n");
+  exit(2);
+}
+
+static void complain (const char* path, uint64_t v, int res) {
+  if (command == RESTORE) {
+    fprintf(stderr, "vers-tool: %s: %s\n", relative_path(path), strerror(-res));
+  } else {
+    fprintf(stderr, "vers-tool: %s,%" PRIu64 ": %s\n", relative_path(path), v, strerror(-res));
+  }
+  __sync_fetch_and_add(&failures, 1);
+}
+
+static int add_item (const char* path, uint64_t v) {
+  if (item_count == item_room) {
+    size_t       room  = item_room ? 2 * item_room : 64;
+    struct item* grown = realloc(items, room * sizeof(*grown));
+    if (grown == NULL) {
+      return -ENOMEM;
+    }
+    items     = grown;
+    item_room = room;
+  }
+  items[item_count].path = strdup(path);
+  if (items[item_count].path == NULL) {
+    return -ENOMEM;
+  }
+  items[item_count].version = v;
+  item_count += 1;
+  return 0;
+}
+
+// List the versions of the file at path that the command wants.
+static int add_file (const char* path) {
+  uint64_t* versions;
+  size_t    count;
+  int       hist_fd = open_hist_dir(path, 0);
+  int       res;
+
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  res = list_versions(hist_fd, base_name(path), &versions, &count);
+  if (res == 0 && command == RESTORE) {
+    uint64_t v = 0;
+    size_t   i = count;
+    if (as_of != 0) {
+      // A file that had no version yet at as_of is left out.
+      if (version_at(hist_fd, base_name(path), as_of, &v) == 0) {
+        res = add_item(path, v);
+      }
+    } else {
+      // The newest version at or below last_version.
+      while (i > 0 && versions[i - 1] > last_version) {
+        i -= 1;
+      }
+      if (i > 0) {
+        v   = versions[i - 1];
+        res = add_item(path, v);
+      }
+    }
+  } else {
+    for (size_t i = 0; res == 0 && i < count; i += 1) {
+      if (versions[i] >= first_version && versions[i] <= last_version) {
+        res = add_item(path, versions[i]);
+      }
+    }
+  }
+  free(versions);
+  close(hist_fd);
+  return res;
+}
+
+// List every file with a history in the folder at path within the mount, and
+// in the folders below it.
+static int add_folder (const char* path) {
+  char           dir_path[PATH_MAX];
+  char           sub_path[PATH_MAX];
+  size_t         tail_len = strlen(HIST_TAIL);
+  int            res      = 0;
+  int            fd;
+  DIR*           dp;
+  struct dirent* de;
+
+  snprintf(dir_path, PATH_MAX, "%s%s", VERS_FOLDER, path);
+  fd = openat(storage_fd, relative_path(dir_path), O_RDONLY | O_DIRECTORY);
+  dp = fd == -1 ? NULL : fdopendir(fd);
+  if (dp == NULL) {
+    res = -errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    return res;
+  }
+  while (res == 0 && (de = readdir(dp)) != NULL) {
+    size_t      len = strlen(de->d_name);
+    struct stat st;
+
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    if (de->d_type != DT_DIR &&
+        (de->d_type != DT_UNKNOWN || fstatat(fd, de->d_name, &st, 0) == -1 ||
+         !S_ISDIR(st.st_mode))) {
+      continue;
+    }
+    if (len > tail_len && strcmp(de->d_name + len - tail_len, HIST_TAIL) == 0) {
+      snprintf(sub_path, PATH_MAX, "%s/%.*s", path, (int) (len - tail_len), de->d_name);
+      res = add_file(sub_path);
+    } else {
+      snprintf(sub_path, PATH_MAX, "%s/%s", path, de->d_name);
+      res = add_folder(sub_path);
+    }
+  }
+  closedir(dp);
+  return res;
+}
+
+// Make the folders above path within dest.
+static int make_parents (const char* path) {
+  char parent[PATH_MAX];
+
+  snprintf(parent, PATH_MAX, "%s", relative_path(path));
+  for (char* slash = strchr(parent, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdirat(dest_fd, parent, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 &&
+        errno != EEXIST) {
+      return -errno;
+    }
+    *slash = '/';
+  }
+  return 0;
+}
+
+// The name that version v of the file at path is written out under.
+static void output_name (const char* path, uint64_t v, char name[PATH_MAX]) {
+  if (command == RESTORE) {
+    snprintf(name, PATH_MAX, "%s", relative_path(path));
+  } else {
+    snprintf(name, PATH_MAX, "%s,%" PRIu64, relative_path(path), v);
+  }
+}
+
+/* A tar archive is a series of 512-byte blocks: a ustar header for each file,
+   then the file's data padded out to a whole block, and two empty blocks at
+   the end. */
+#define TAR_BLOCK 512
+
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char link_name[100];
+  char magic[6];
+  char version[2];
+  char user_name[32];
+  char group_name[32];
+  char dev_major[8];
+  char dev_minor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+// Write n into a numeric field of len bytes, in octal if it fits and in the
+// base-256 form that GNU tar reads if it does not.
+static void tar_number (char* field, size_t len, uint64_t n) {
+  if (n < (1ULL << (3 * (len - 1)))) {
+    snprintf(field, len, "%0*" PRIo64, (int) len - 1, n);
+    return;
+  }
+  memset(field, 0, len);
+  field[0] = (char) 0x80;
+  if (len < 12) {
+    return;
+  }
+  for (size_t i = len - 1; i > 0 && n != 0; i -= 1) {
+    field[i] = (char) (n & 0xff);
+    n >>= 8;
+  }
+}
+
+static int tar_write_header (const char* name, off_t size, time_t mtime) {
+  struct tar_header header;
+  size_t            len = strlen(name);
+  unsigned          sum = 0;
+
+  memset(&header, 0, sizeof(header));
+  // A long name is split at a slash between prefix and name.
+  if (len > sizeof(header.name)) {
+    const char* slash = name + len;
+    while (slash > name && (*slash != '/' || (size_t) (slash - name) > sizeof(header.prefix) ||
+                            len - (slash - name) - 1 > sizeof(header.name))) {
+      slash -= 1;
+    }
+    if (slash == name) {
+      return -ENAMETOOLONG;
+    }
+    memcpy(header.prefix, name, slash - name);
+    name = slash + 1;
+    len  = strlen(name);
+  }
+  memcpy(header.name, name, len);
+  tar_number(header.mode, sizeof(header.mode), 0644);
+  tar_number(header.uid, sizeof(header.uid), getuid());
+  tar_number(header.gid, sizeof(header.gid), getgid());
+  tar_number(header.size, sizeof(header.size), size);
+  tar_number(header.mtime, sizeof(header.mtime), mtime);
+  header.type = '0';
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+
+  // The checksum is taken with its own field full of spaces.
+  memset(header.checksum, ' ', sizeof(header.checksum));
+  for (size_t i = 0; i < sizeof(header); i += 1) {
+    sum += ((unsigned char*) &header)[i];
+  }
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", sum);
+  return write_all(STDOUT_FILENO, &header, sizeof(header));
+}
+
+// Write the size bytes of fd to the archive.
+static int tar_write_data (int fd, off_t size) {
+  static const char zeros[TAR_BLOCK];
+  char              buf[COPY_CHUNK];
+  off_t             offset = 0;
+  int               res    = 0;
+
+  while (offset < size) {
+    ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, size - offset);
+    if (n > 0) {
+      continue;
+    }
+    if (n == 0) {
+      return -EIO;
+    }
+    if (errno == EINVAL || errno == ENOSYS) {
+      break;
+    }
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+  // What sendfile() would not take goes through buf.
+  while (res == 0 && offset < size) {
+    ssize_t n = pread(fd, buf, size - offset < COPY_CHUNK ? size - offset : COPY_CHUNK, offset);
+    if (n <= 0) {
+      return n == 0 ? -EIO : -errno;
+    }
+    res     = write_all(STDOUT_FILENO, buf, n);
+    offset += n;
+  }
+  if (res == 0 && size % TAR_BLOCK != 0) {
+    res = write_all(STDOUT_FILENO, zeros, TAR_BLOCK - size % TAR_BLOCK);
+  }
+  return res;
+}
+
+// Read version v of the file at path out as the command says.
+static int do_item (const char* path, uint64_t v) {
+  const char* name = base_name(path);
+  char        out_name[PATH_MAX];
+  struct stat want;
+  struct stat got;
+  int         hist_fd = open_hist_dir(path, 0);
+  int         out     = -1;
+  int         res;
+
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  res = stat_version(hist_fd, name, v, &want);
+  if (res < 0) {
+    close(hist_fd);
+    return res;
+  }
+
+  output_name(path, v, out_name);
+  if (command != VERIFY && dest_fd != -1) {
+    res = make_parents(path);
+    out = res < 0 ? res : openat(dest_fd, out_name, O_CREAT | O_WRONLY | O_TRUNC,
+                                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (out == -1) {
+      res = -errno;
+    }
+  } else {
+    out = open_scratch();
+    res = out < 0 ? out : 0;
+  }
+  if (res == 0) {
+    res = materialize(hist_fd, name, v, out);
+  }
+
+  if (res == 0 && fstat(out, &got) == -1) {
+    res = -errno;
+  }
+  if (res == 0 && got.st_size != want.st_size) {
+    res = -EIO;
+  }
+  if (res == 0 && command == VERIFY) {
+    res = check_version(hist_fd, name, v);
+  }
+  close(hist_fd);
+
+  if (res == 0 && command != VERIFY && dest_fd != -1) {
+    struct timespec times[2] = {
+      { .tv_sec = want.st_mtime },
+      { .tv_sec = want.st_mtime },
+    };
+    futimens(out, times);
+  } else if (res == 0 && command != VERIFY) {
+    pthread_mutex_lock(&tar_lock);
+    res = tar_write_header(out_name, got.st_size, want.st_mtime);
+    if (res == 0) {
+      res = tar_write_data(out, got.st_size);
+    }
+    pthread_mutex_unlock(&tar_lock);
+  }
+  if (out >= 0) {
+    close(out);
+  }
+  return res;
+}
+
+static void* worker (void* arg) {
+  (void) arg;
+
+  for (;;) {
+    size_t i = __sync_fetch_and_add(&next_item, 1);
+    if (i >= item_count) {
+      return NULL;
+    }
+    int res = do_item(items[i].path, items[i].version);
+    if (res < 0) {
+      complain(items[i].path, items[i].version, res);
+    }
+  }
+}
+
+// Parse a -v argument: <v>, <from>-<to>, <from>- or -<to>.
+static int parse_range (const char* text) {
+  char* end;
+
+  if (*text != '-') {
+    first_version = strtoull(text, &end, 10);
+    if (end == text) {
+      return -1;
+    }
+    text = end;
+  }
+  if (*text == '\0') {
+    last_version = first_version;
+    return 0;
+  }
+  if (*text != '-') {
+    return -1;
+  }
+  text += 1;
+  if (*text != '\0') {
+    last_version = strtoull(text, &end, 10);
+    if (end == text || *end != '\0') {
+      return -1;
+    }
+  }
+  return first_version <= last_version ? 0 : -1;
+}
+
+int main (int argc, char* argv[]) {
+  long       threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int        paths   = 0;
+  int        arg;
+  int        res     = 0;
+  pthread_t* pool;
+
+  if (argc < 3) {
+    usage();
+  }
+  for (command = EXPORT; command <= VERIFY; command += 1) {
+    if (strcmp(argv[1], command_names[command]) == 0) {
+      break;
+    }
+  }
+  if (command > VERIFY || (command != VERIFY && argc < 4)) {
+    usage();
+  }
+
+  storage_fd = open(argv[2], O_RDONLY | O_DIRECTORY);
+  if (storage_fd == -1) {
+    perror(argv[2]);
+    return 1;
+  }
+  // Versions are rebuilt outside the store, which may be read-only.
+  const char* tmp_dir = getenv("TMPDIR");
+  if (tmp_dir == NULL || tmp_dir[0] == '\0') {
+    tmp_dir = "/tmp";
+  }
+  scratch_fd = open(tmp_dir, O_RDONLY | O_DIRECTORY);
+  if (scratch_fd == -1) {
+    perror(tmp_dir);
+    return 1;
+  }
+  arg = 3;
+  if (command != VERIFY) {
+    const char* dest = argv[arg++];
+    if (strcmp(dest, "-") != 0) {
+      mkdir(dest, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+      dest_fd = open(dest, O_RDONLY | O_DIRECTORY);
+      if (dest_fd == -1) {
+        perror(dest);
+        return 1;
+      }
+    } else if (isatty(STDOUT_FILENO)) {
+      fprintf(stderr, "vers-tool: not writing a tar archive to a terminal\n");
+      return 1;
+    }
+  }
+
+  // The options come first, then the paths.
+  for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg += 2) {
+    if (arg + 1 == argc) {
+      usage();
+    }
+    if (strcmp(argv[arg], "-v") == 0) {
+      if (parse_range(argv[arg + 1]) == -1) {
+        usage();
+      }
+    } else if (strcmp(argv[arg], "-t") == 0 && command == RESTORE) {
+      as_of = parse_time(argv[arg + 1]);
+      if (as_of == -1) {
+        fprintf(stderr, "vers-tool: bad time: %s\n", argv[arg + 1]);
+        return 2;
+      }
+    } else if (strcmp(argv[arg], "-j") == 0) {
+      threads = strtol(argv[arg + 1], NULL, 10);
+    } else {
+      usage();
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  for (; res == 0 && arg < argc; arg += 1) {
+    // Paths are within the mount, with or without a slash in front.
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "/%s", relative_path(argv[arg]));
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+      path[--len] = '\0';
+    }
+    paths += 1;
+    if (strcmp(path, "/.") == 0) {
+      res = add_folder("");
+      continue;
+    }
+    int hist_fd = open_hist_dir(path, 0);
+    if (hist_fd >= 0) {
+      close(hist_fd);
+      res = add_file(path);
+    } else {
+      res = add_folder(path);
+    }
+    if (res < 0) {
+      fprintf(stderr, "vers-tool: %s: %s\n", argv[arg], strerror(-res));
+    }
+  }
+  if (paths == 0) {
+    res = add_folder("");
+    if (res < 0) {
+      fprintf(stderr, "vers-tool: %s: %s\n", argv[2], strerror(-res));
+    }
+  }
+  if (res < 0) {
+    return 1;
+  }
+
+  if ((size_t) threads > item_count) {
+    threads = item_count > 0 ? item_count : 1;
+  }
+  pool = malloc(threads * sizeof(*pool));
+  if (pool == NULL) {
+    perror("vers-tool");
+    return 1;
+  }
+  for (long i = 0; i < threads; i += 1) {
+    if (pthread_create(&pool[i], NULL, worker, NULL) != 0) {
+      threads = i;
+      break;
+    }
+  }
+  if (threads == 0) {
+    worker(NULL);
+  }
+  for (long i = 0; i < threads; i += 1) {
+    pthread_join(pool[i], NULL);
+  }
+  free(pool);
+
+  if (command != VERIFY && dest_fd == -1) {
+    static const char end[2 * TAR_BLOCK];
+    if (write_all(STDOUT_FILENO, end, sizeof(end)) < 0) {
+      perror("vers-tool");
+      return 1;
+    }
+  }
+  if (command == VERIFY || failures > 0) {
+    fprintf(stderr, "vers-tool: %s %zu version%s, %d failed\n", command_names[command],
+            item_count, item_count == 1 ? "" : "s", failures);
+  }
+  return failures > 0 ? 1 : 0;
+}
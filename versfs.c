@@ -20,8 +20,8 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite()/utimensat() */
-#define _XOPEN_SOURCE 700
+/* For pread()/pwrite()/utimensat() and O_TMPFILE */
+#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
@@ -32,28 +32,3391 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
+#ifdef linux
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
+#include "vers-store.h"
+
 static char* storage_dir = NULL;
-static char  storage_path[256];
+
+/* The list of files with changes pending is shared by every FUSE thread, so
+   operations that touch it take turns under vers_lock.  The version store
+   itself (the counters, the chunk references and the files under .vers) has a
+   lock of its own, store_lock, because versions are written by a thread of
+   their own.  Whoever needs both takes vers_lock first.  Each file's writes
+   and the counter table have locks of their own too, taken after these. */
+static pthread_mutex_t vers_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
-char* prepend_storage_dir (char* pre_path, const char* path) {
-  strcpy(pre_path, storage_dir);
-  strcat(pre_path, path);
+#ifdef HAVE_SETXATTR
+/* There are no *at() variants of the xattr calls, so those still need a full
+   path into the storage directory. */
+static char* prepend_storage_dir (char* pre_path, const char* path) {
+  snprintf(pre_path, PATH_MAX, "%s%s", storage_dir, path);
   return pre_path;
 }
+#endif
+
+/* Mount options understood by versfs itself (the rest go to libfuse). */
+struct vers_config {
+  char*         format;
+  int           chunked;
+  int           logged;
+  char*         compress;
+  int           codec;
+  int           compress_level;
+  unsigned      keyframe;
+  unsigned      snap_interval;
+  unsigned long snap_bytes;
+  unsigned long snap_queue;
+  char*         as_of_time;
+  time_t        as_of;
+  unsigned      keep;
+  unsigned      keep_hourly;
+  unsigned      keep_daily;
+  unsigned      keep_weekly;
+  unsigned long keep_bytes;
+  unsigned      prune_interval;
+};
+
+static struct vers_config config = {
+#ifdef HAVE_LZ4
+  .codec      = CODEC_LZ4,
+#endif
+  .keyframe   = 16,
+  .snap_queue = 64 * 1024 * 1024,
+  .prune_interval = 60,
+};
+
+#define VERS_OPT(t, p, v) { t, offsetof(struct vers_config, p), v }
+
+static struct fuse_opt vers_opts[] = {
+  VERS_OPT("format=%s",        format,        0),
+  VERS_OPT("compress=%s",      compress,      0),
+  VERS_OPT("compress_level=%d", compress_level, 0),
+  VERS_OPT("keyframe=%u",      keyframe,      0),
+  VERS_OPT("snap_interval=%u", snap_interval, 0),
+  VERS_OPT("snap_bytes=%lu",   snap_bytes,    0),
+  VERS_OPT("snap_queue=%lu",   snap_queue,    0),
+  VERS_OPT("as_of=%s",         as_of_time,    0),
+  VERS_OPT("keep=%u",          keep,          0),
+  VERS_OPT("keep_hourly=%u",   keep_hourly,   0),
+  VERS_OPT("keep_daily=%u",    keep_daily,    0),
+  VERS_OPT("keep_weekly=%u",   keep_weekly,   0),
+  VERS_OPT("keep_bytes=%lu",   keep_bytes,    0),
+  VERS_OPT("prune_interval=%u", prune_interval, 0),
+  FUSE_OPT_END
+};
+
+// Read the next version number from a history folder made before the journal.
+// A folder without one has no versions yet.
+static int load_next_version (int hist_fd, unsigned long* next) {
+  char    text[32];
+  int     fd = openat(hist_fd, NEXT_VERS, O_RDONLY);
+  ssize_t res;
+
+  *next = 0;
+  if (fd == -1) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+  res = pread(fd, text, sizeof(text) - 1, 0);
+  close(fd);
+  if (res == -1) {
+    return -errno;
+  }
+  text[res] = '\0';
+  *next = strtoul(text, NULL, 10);
+  return 0;
+}
+
+/* How many versions each file has is kept in memory, in a hash table keyed
+   by path, and made durable by appending a record to .vers-store/journal
+   whenever it changes:
+
+     <next version> <time of the last version> <path>\0
+
+   Later records for a path supersede earlier ones, and a next version of 0
+   means the history was removed.  The table is filled from the journal the
+   first time it is needed, and the journal is rewritten with one record per
+   file when superseded records have piled up.  A history folder from before
+   the journal still has its next_vers.txt, which is read the first time the
+   file gets a new version.  Whether a file was created by this mount is only
+   kept in memory; see forget_fresh_history().
+
+   The journal used to be .vers/journal, where it kept a mount-root folder
+   named journal from having a history; one left there is moved by
+   move_legacy_journal() when the file system starts. */
+#define JOURNAL        STORE_FOLDER "/journal"
+#define JOURNAL_TMP    STORE_FOLDER "/journal.tmp"
+#define LEGACY_JOURNAL ".vers/journal"
+
+struct vers_counter {
+  struct vers_counter* next;
+  uint64_t             next_version;
+  time_t               last_snap;
+  int                  fresh;   // created by this mount with no history before
+  char                 path[];
+};
+
+static struct vers_counter** counters        = NULL;
+static size_t                counter_buckets = 0;
+static size_t                counter_count   = 0;
+static int                   journal_fd      = -1;
+static int                   journal_torn    = 0;   // a torn record could not be cut off
+
+/* The table and the journal have a lock of their own, held only for a moment
+   and never while taking another, so that looking a file up does not wait for
+   a version being stored under store_lock.  A counter changes with both
+   locks held, so either one is enough to read it. */
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_path (const char* path) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*path != '\0') {
+    hash = (hash ^ (uint8_t) *path++) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Find the counter for path, adding a zeroed one if create is set.
+static struct vers_counter* find_counter (const char* path, int create) {
+  if (counter_buckets > 0) {
+    struct vers_counter* c = counters[hash_path(path) % counter_buckets];
+    for (; c != NULL; c = c->next) {
+      if (strcmp(c->path, path) == 0) {
+        return c;
+      }
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  // Keep the table no more than one entry per bucket on average.
+  if (counter_count >= counter_buckets) {
+    size_t                buckets = counter_buckets == 0 ? 1024 : 2 * counter_buckets;
+    struct vers_counter** table   = calloc(buckets, sizeof(*table));
+    if (table == NULL) {
+      return NULL;
+    }
+    for (size_t i = 0; i < counter_buckets; i += 1) {
+      while (counters[i] != NULL) {
+        struct vers_counter* c = counters[i];
+        counters[i] = c->next;
+        c->next = table[hash_path(c->path) % buckets];
+        table[hash_path(c->path) % buckets] = c;
+      }
+    }
+    free(counters);
+    counters        = table;
+    counter_buckets = buckets;
+  }
+
+  struct vers_counter* c = calloc(1, sizeof(*c) + strlen(path) + 1);
+  if (c == NULL) {
+    return NULL;
+  }
+  strcpy(c->path, path);
+  c->next = counters[hash_path(path) % counter_buckets];
+  counters[hash_path(path) % counter_buckets] = c;
+  counter_count += 1;
+  return c;
+}
+
+static int append_record (int fd, uint64_t next, time_t when, const char* path) {
+  char record[PATH_MAX + 64];
+  int  len = snprintf(record, sizeof(record), "%llu %lld %s",
+                      (unsigned long long) next, (long long) when, path);
+
+  // The terminating NUL is part of the record.
+  return write(fd, record, len + 1) == len + 1 ? 0 : -EIO;
+}
+
+// Write a journal with one record per file with a history, and swap it in.
+static int compact_journal (void) {
+  int fd  = openat(storage_fd, JOURNAL_TMP, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  int res = 0;
+
+  if (fd == -1) {
+    return -errno;
+  }
+  for (size_t i = 0; res == 0 && i < counter_buckets; i += 1) {
+    for (struct vers_counter* c = counters[i]; res == 0 && c != NULL; c = c->next) {
+      if (c->next_version > 0) {
+        res = append_record(fd, c->next_version, c->last_snap, c->path);
+      }
+    }
+  }
+  if (res == 0 && fsync(fd) == -1) {
+    res = -errno;
+  }
+  close(fd);
+  if (res == 0 && renameat(storage_fd, JOURNAL_TMP, storage_fd, JOURNAL) == -1) {
+    res = -errno;
+  }
+  return res;
+}
+
+// Fill the table from the journal, once, and leave the journal open for
+// appending.
+static int load_counters (void) {
+  struct stat st;
+  char*       text;
+  off_t       len;
+  size_t      records = 0;
+  int         fd;
+
+  if (journal_fd != -1) {
+    return 0;
+  }
+  mkdirat(storage_fd, STORE_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  fd = openat(storage_fd, JOURNAL, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    int res = -errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    return res;
+  }
+
+  text = malloc(st.st_size + 1);
+  if (text == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  if (pread(fd, text, st.st_size, 0) != st.st_size) {
+    free(text);
+    close(fd);
+    return -EIO;
+  }
+  // A record cut short by a crash is cut off, so that the next one is not
+  // appended onto it.
+  len = st.st_size;
+  while (len > 0 && text[len - 1] != '\0') {
+    len -= 1;
+  }
+  if (len < st.st_size && ftruncate(fd, len) == -1) {
+    int res = -errno;
+    free(text);
+    close(fd);
+    return res;
+  }
+
+  for (char* record = text; record < text + len; record += strlen(record) + 1) {
+    unsigned long long next;
+    long long          when;
+    int                skip;
+    if (sscanf(record, "%llu %lld %n", &next, &when, &skip) == 2) {
+      struct vers_counter* c = find_counter(record + skip, 1);
+      if (c == NULL) {
+        free(text);
+        close(fd);
+        return -ENOMEM;
+      }
+      c->next_version = next;
+      c->last_snap    = when;
+      records += 1;
+    }
+  }
+  free(text);
+
+  if (records > 2 * counter_count + 64 && compact_journal() == 0) {
+    close(fd);
+    fd = openat(storage_fd, JOURNAL, O_WRONLY | O_APPEND);
+    if (fd == -1) {
+      return -errno;
+    }
+  }
+  journal_fd = fd;
+  return 0;
+}
+
+// Move a journal from .vers/ into the store's own folder, unless the store
+// already has one.  Anything at .vers/journal other than a file is the
+// history of a folder named journal and stays where it is.
+static void move_legacy_journal (void) {
+  struct stat st;
+
+  if (fstatat(storage_fd, LEGACY_JOURNAL, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+      !S_ISREG(st.st_mode)) {
+    return;
+  }
+  mkdirat(storage_fd, STORE_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  if (fstatat(storage_fd, JOURNAL, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+    return;
+  }
+  if (renameat(storage_fd, LEGACY_JOURNAL, storage_fd, JOURNAL) == -1) {
+    fprintf(stderr, "ERROR: Could not move %s to %s: %s\n",
+            LEGACY_JOURNAL, JOURNAL, strerror(errno));
+  }
+}
+
+// The counter for the file at path, whose history folder is hist_fd (or -1 if
+// it has none).
+static struct vers_counter* get_counter (const char* path, int hist_fd) {
+  struct vers_counter* c;
+
+  pthread_mutex_lock(&counter_lock);
+  if (load_counters() < 0) {
+    pthread_mutex_unlock(&counter_lock);
+    return NULL;
+  }
+  c = find_counter(path, 0);
+  if (c == NULL) {
+    unsigned long legacy = 0;
+    if (hist_fd != -1) {
+      load_next_version(hist_fd, &legacy);
+    }
+    c = find_counter(path, 1);
+    if (c != NULL) {
+      c->next_version = legacy;
+    }
+  }
+  pthread_mutex_unlock(&counter_lock);
+  return c;
+}
+
+// Make a change to the counter for path durable.  A record that gets only
+// part of the way is cut back off, as journal_refs() does for the chunk
+// references; should that fail too, the journal takes no more records until
+// the next mount, which cuts it off instead.
+static int journal_counter (const char* path, uint64_t next, time_t when) {
+  off_t end;
+  int   res;
+
+  if (journal_torn) {
+    return -EIO;
+  }
+  end = lseek(journal_fd, 0, SEEK_END);
+  if (end == -1) {
+    return -errno;
+  }
+  res = append_record(journal_fd, next, when, path);
+  if (res < 0 && ftruncate(journal_fd, end) == -1) {
+    fprintf(stderr, "ERROR: could not repair the version journal: %s\n",
+            strerror(errno));
+    journal_torn = 1;
+  }
+  return res;
+}
+
+/* Version files and chunks are compressed after they are stored, by a thread
+   of their own, so that writers never wait for the codec.  foo.txt,3 becomes
+   foo.txt,3.lz4 (or .zst with -o compress=zstd), and is left as it is if it
+   does not get any smaller.  Chunk lists are small and read whenever a
+   history is removed, so they are never compressed. */
+struct compress_job {
+  struct compress_job* next;
+  char                 path[];   // relative to storage_fd
+};
+
+static pthread_mutex_t      compress_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       compress_ready   = PTHREAD_COND_INITIALIZER;
+static struct compress_job* compress_head    = NULL;
+static struct compress_job* compress_tail    = NULL;
+static int                  compress_running = 0;
+static int                  compress_stop    = 0;
+static pthread_t            compress_thread;
+
+#ifdef HAVE_LZ4
+static int lz4_compress (int in, int out) {
+  LZ4F_preferences_t    prefs;
+  LZ4F_compressionContext_t ctx;
+  size_t                cap = 0;
+  char*                 src = malloc(COPY_CHUNK);
+  char*                 dst = NULL;
+  ssize_t               n;
+  size_t                len;
+  struct stat           st;
+  int                   res = 0;
+
+  // The frame says how big its contents are, so that stat_version() need not
+  // inflate it to find out.
+  memset(&prefs, 0, sizeof(prefs));
+  prefs.compressionLevel = config.compress_level;
+  if (fstat(in, &st) == 0) {
+    prefs.frameInfo.contentSize = st.st_size;
+  }
+  cap = LZ4F_compressBound(COPY_CHUNK, &prefs);
+  dst = malloc(cap);
+  if (src == NULL || dst == NULL ||
+      LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION))) {
+    free(src);
+    free(dst);
+    return -ENOMEM;
+  }
+
+  len = LZ4F_compressBegin(ctx, dst, cap, &prefs);
+  res = LZ4F_isError(len) ? -EIO : write_all(out, dst, len);
+  while (res == 0 && (n = read(in, src, COPY_CHUNK)) > 0) {
+    len = LZ4F_compressUpdate(ctx, dst, cap, src, n, NULL);
+    res = LZ4F_isError(len) ? -EIO : write_all(out, dst, len);
+  }
+  if (res == 0 && n == -1) {
+    res = -errno;
+  }
+  if (res == 0) {
+    len = LZ4F_compressEnd(ctx, dst, cap, NULL);
+    res = LZ4F_isError(len) ? -EIO : write_all(out, dst, len);
+  }
+
+  LZ4F_freeCompressionContext(ctx);
+  free(src);
+  free(dst);
+  return res;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zstd_compress (int in, int out) {
+  ZSTD_CCtx*  ctx     = ZSTD_createCCtx();
+  size_t      in_cap  = ZSTD_CStreamInSize();
+  size_t      out_cap = ZSTD_CStreamOutSize();
+  char*       src     = malloc(in_cap);
+  char*       dst     = malloc(out_cap);
+  struct stat st;
+  int         res     = 0;
+
+  if (ctx == NULL || src == NULL || dst == NULL) {
+    res = -ENOMEM;
+  } else if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel,
+                                                 config.compress_level))) {
+    res = -EINVAL;
+  } else if (fstat(in, &st) == 0) {
+    // As with lz4, the frame records its contents' size.
+    ZSTD_CCtx_setPledgedSrcSize(ctx, st.st_size);
+  }
+
+  while (res == 0) {
+    ssize_t n = read(in, src, in_cap);
+    if (n == -1) {
+      res = -errno;
+      break;
+    }
+
+    // A read of nothing is the end of the file, and ends the frame.
+    ZSTD_EndDirective mode  = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_inBuffer     input = { src, n, 0 };
+    int               done  = 0;
+    while (res == 0 && !done) {
+      ZSTD_outBuffer output = { dst, out_cap, 0 };
+      size_t         left   = ZSTD_compressStream2(ctx, &output, &input, mode);
+      if (ZSTD_isError(left)) {
+        res = -EIO;
+        break;
+      }
+      res  = write_all(out, dst, output.pos);
+      done = mode == ZSTD_e_end ? left == 0 : input.pos == input.size;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+
+  ZSTD_freeCCtx(ctx);
+  free(src);
+  free(dst);
+  return res;
+}
+#endif
+
+static int compress_stream (int in, int out) {
+  (void) in;
+  (void) out;
+
+  switch (config.codec) {
+#ifdef HAVE_LZ4
+  case CODEC_LZ4:
+    return lz4_compress(in, out);
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    return zstd_compress(in, out);
+#endif
+  default:
+    return -ENOTSUP;
+  }
+}
+
+// Compress the file at path, and swap the result in for it if the file is
+// still the one that was compressed and the result is smaller.
+static void compress_one (const char* path) {
+  char        tmp_path[PATH_MAX];
+  char        done_path[PATH_MAX];
+  struct stat in_st;
+  struct stat out_st;
+  struct stat now_st;
+  int         in;
+  int         out;
+  int         res;
+
+  snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+  snprintf(done_path, PATH_MAX, "%s%s", path, codec_ext[config.codec]);
+
+  in = openat(storage_fd, path, O_RDONLY);
+  if (in == -1) {
+    return;
+  }
+  out = openat(storage_fd, tmp_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (out == -1) {
+    close(in);
+    return;
+  }
+  res = compress_stream(in, out);
+  if (res == 0 && (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1)) {
+    res = -errno;
+  }
+  // The compressed file keeps the time the version was stored at.
+  if (res == 0) {
+    struct timespec times[2] = { in_st.st_atim, in_st.st_mtim };
+    futimens(out, times);
+  }
+  close(in);
+  close(out);
+
+  // Under store_lock, so that a history being removed or replaced meanwhile
+  // is noticed and not brought back.
+  pthread_mutex_lock(&store_lock);
+  if (res == 0 && out_st.st_size < in_st.st_size &&
+      fstatat(storage_fd, path, &now_st, 0) == 0 &&
+      now_st.st_ino == in_st.st_ino && now_st.st_dev == in_st.st_dev &&
+      renameat(storage_fd, tmp_path, storage_fd, done_path) == 0) {
+    unlinkat(storage_fd, path, 0);
+  } else {
+    unlinkat(storage_fd, tmp_path, 0);
+  }
+  pthread_mutex_unlock(&store_lock);
+}
+
+static void* compress_worker (void* arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&compress_lock);
+  while (!compress_stop) {
+    if (compress_head == NULL) {
+      pthread_cond_wait(&compress_ready, &compress_lock);
+      continue;
+    }
+    struct compress_job* job = compress_head;
+    compress_head = job->next;
+    if (compress_head == NULL) {
+      compress_tail = NULL;
+    }
+    pthread_mutex_unlock(&compress_lock);
+
+    compress_one(job->path);
+    free(job);
+
+    pthread_mutex_lock(&compress_lock);
+  }
+  pthread_mutex_unlock(&compress_lock);
+  return NULL;
+}
+
+// Hand the file at path (relative to storage_fd) to the compressor.
+static void queue_compress (const char* path) {
+  struct compress_job* job;
+
+  // A log is always being appended to, so it is left as it is.
+  if (config.codec == CODEC_NONE || !compress_running || config.logged) {
+    return;
+  }
+  job = malloc(sizeof(*job) + strlen(path) + 1);
+  if (job == NULL) {
+    return;
+  }
+  job->next = NULL;
+  strcpy(job->path, path);
+
+  pthread_mutex_lock(&compress_lock);
+  if (compress_tail == NULL) {
+    compress_head = job;
+  } else {
+    compress_tail->next = job;
+  }
+  compress_tail = job;
+  pthread_cond_signal(&compress_ready);
+  pthread_mutex_unlock(&compress_lock);
+}
+
+// Unlink a stored file whichever form it is in.  Returns 0 if there was one.
+static int unlink_stored (int dir_fd, const char* name) {
+  char packed[PATH_MAX];
+
+  if (unlinkat(dir_fd, name, 0) == 0) {
+    return 0;
+  }
+  for (int c = CODEC_LZ4; c <= CODEC_ZSTD; c += 1) {
+    snprintf(packed, PATH_MAX, "%s%s", name, codec_ext[c]);
+    if (unlinkat(dir_fd, packed, 0) == 0) {
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+/* Where a version being stored is written: a file of its own, or the end of
+   the log.  The writer appends at fd's file position and leaves it at the end
+   of what it wrote. */
+struct version_out {
+  int              fd;
+  int              idx_fd;    // the log's index, or -1
+  struct log_entry entry;
+};
+
+// Whether a log is to start with the next version stored: versions stored on
+// their own before the store was switched to a log are not in it, so the log
+// has to begin with a keyframe rather than a delta over one of them.
+static int log_empty (int hist_fd, const char* name) {
+  char    idx_name[NAME_MAX + 1];
+  int64_t n;
+  int     fd;
+
+  if (!config.logged) {
+    return 0;
+  }
+  snprintf(idx_name, sizeof(idx_name), "%s%s", name, IDX_TAIL);
+  fd = openat(hist_fd, idx_name, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+  n = count_log_entries(fd);
+  close(fd);
+  return n <= 0;
+}
+
+static int open_version (int hist_fd, const char* name, uint64_t v, int kind,
+                         struct version_out* out) {
+  char    snap_name[NAME_MAX + 1];
+  int64_t n;
+
+  out->idx_fd = -1;
+  if (!config.logged) {
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 "%s",
+             name, v, kind == VERSION_DELTA ? ".delta" : "");
+    out->fd = openat(hist_fd, snap_name, O_CREAT | O_WRONLY | O_TRUNC, S_IRWXU);
+    return out->fd == -1 ? -errno : 0;
+  }
+
+  snprintf(snap_name, sizeof(snap_name), "%s%s", name, IDX_TAIL);
+  out->idx_fd = openat(hist_fd, snap_name, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+  if (out->idx_fd == -1) {
+    return -errno;
+  }
+  snprintf(snap_name, sizeof(snap_name), "%s%s", name, LOG_TAIL);
+  out->fd = openat(hist_fd, snap_name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if (out->fd == -1) {
+    int res = -errno;
+    close(out->idx_fd);
+    return res;
+  }
+
+  // The record goes right after the last one indexed.
+  memset(&out->entry, 0, sizeof(out->entry));
+  n = count_log_entries(out->idx_fd);
+  if (n > 0 && read_log_entry(out->idx_fd, n - 1, &out->entry) == 0) {
+    out->entry.offset += out->entry.length;
+  }
+  out->entry.version = v;
+  out->entry.kind    = kind;
+  if (n < 0 || ftruncate(out->idx_fd, n * sizeof(struct log_entry)) == -1 ||
+      ftruncate(out->fd, out->entry.offset) == -1 ||
+      lseek(out->fd, out->entry.offset, SEEK_SET) == -1) {
+    int res = n < 0 ? n : -errno;
+    close(out->fd);
+    close(out->idx_fd);
+    return res;
+  }
+  return 0;
+}
+
+// Finish the version written to out, which went well if res is 0.
+static int close_version (struct version_out* out, int res) {
+  if (out->idx_fd != -1) {
+    off_t end = lseek(out->fd, 0, SEEK_CUR);
+    if (res == 0 && end == -1) {
+      res = -errno;
+    }
+    if (res == 0) {
+      out->entry.length = end - out->entry.offset;
+      out->entry.time   = time(NULL);
+      res = write_all(out->idx_fd, &out->entry, sizeof(out->entry));
+    }
+    close(out->idx_fd);
+  }
+  close(out->fd);
+  return res;
+}
+
+// Note that version v of name was stored at t.
+static int record_time (int hist_fd, const char* name, uint64_t v, time_t t) {
+  struct when_entry entry = { v, t };
+  char              when_name[NAME_MAX + 1];
+  int               fd;
+  int               res;
+
+  if (config.logged) {
+    return 0;
+  }
+  snprintf(when_name, sizeof(when_name), "%s%s", name, WHEN_TAIL);
+  fd = openat(hist_fd, when_name, O_CREAT | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return -errno;
+  }
+  res = write_all(fd, &entry, sizeof(entry));
+  close(fd);
+  return res;
+}
+
+// Write version v of name into the history folder as a delta over version
+// base, which is v - 1 unless versions in between were pruned.  The changed
+// extents' new contents are read from live_fd.
+static int store_delta (int hist_fd, const char* name, uint64_t v, uint64_t base,
+                        off_t keep, off_t size, const struct extent* extents,
+                        int count, int live_fd) {
+  struct version_out out;
+  off_t              pos;
+  int                res = open_version(hist_fd, name, v, VERSION_DELTA, &out);
+
+  if (res < 0) {
+    return res;
+  }
+  if (base + 1 == v
+      ? dprintf(out.fd, "VDELTA %lld %lld %d\n", (long long) keep, (long long) size, count) < 0
+      : dprintf(out.fd, "VDELTA %lld %lld %d %" PRIu64 "\n",
+                (long long) keep, (long long) size, count, base) < 0) {
+    res = -EIO;
+  }
+  for (int i = 0; res == 0 && i < count; i += 1) {
+    if (dprintf(out.fd, "%lld %lld\n",
+                (long long) extents[i].offset, (long long) extents[i].length) < 0) {
+      res = -EIO;
+    }
+  }
+  pos = lseek(out.fd, 0, SEEK_CUR);
+  if (res == 0 && pos == -1) {
+    res = -errno;
+  }
+  for (int i = 0; res == 0 && i < count; i += 1) {
+    res  = copy_range(out.fd, pos, live_fd, extents[i].offset, extents[i].length);
+    pos += extents[i].length;
+  }
+  if (res == 0 && lseek(out.fd, pos, SEEK_SET) == -1) {
+    res = -errno;
+  }
+  return close_version(&out, res);
+}
+
+// Write version v of name into the history folder whole.
+static int store_keyframe (int hist_fd, const char* name, uint64_t v,
+                           off_t size, int live_fd) {
+  struct version_out out;
+  off_t              pos;
+  int                res = open_version(hist_fd, name, v, VERSION_KEYFRAME, &out);
+
+  if (res < 0) {
+    return res;
+  }
+  pos = lseek(out.fd, 0, SEEK_CUR);
+  res = pos == -1 ? -errno : copy_range(out.fd, pos, live_fd, 0, size);
+  if (res == 0 && lseek(out.fd, pos + size, SEEK_SET) == -1) {
+    res = -errno;
+  }
+  return close_version(&out, res);
+}
+
+/* With -o format=chunk, versions are not stored as keyframes and deltas but
+   as lists of chunks kept once each, under .vers-store/chunks/, however many
+   versions and files they appear in.  A file is cut into chunks where a
+   rolling hash of its contents hits a given pattern, so an insertion moves the
+   boundaries only near itself and the chunks on either side are found again.
+   Version v of foo.txt is then foo.txt,v.chunks:
+
+     VCHUNKS <size>
+     <hash> <length>            (one line per chunk, in order)
+
+   and the chunk with a given hash lives in .vers-store/chunks/<first two hex
+   digits>/<hash>, or under one of the next few hashes along if other
+   contents with the same hash got there first.  How many references each
+   chunk has is kept in memory and in .vers-store/chunks/refs, a journal of binary
+   records that each add to or take away from one chunk's count; when a count
+   drops to zero the chunk is deleted. */
+#define CHUNK_REFS     CHUNKS_FOLDER "/refs"
+#define CHUNK_REFS_TMP CHUNKS_FOLDER "/refs.tmp"
+#define CHUNK_MIN     (2 * 1024)
+#define CHUNK_MAX     (64 * 1024)
+#define CHUNK_MASK    ((1 << 13) - 1)   // an 8 KiB average chunk
+
+struct chunk_ref {
+  struct chunk_ref* next;
+  uint8_t           hash[HASH_BYTES];
+  uint32_t          refs;
+};
+
+struct ref_record {
+  uint8_t hash[HASH_BYTES];
+  int32_t delta;
+};
+
+static struct chunk_ref** chunk_refs    = NULL;
+static size_t             ref_buckets   = 0;
+static size_t             ref_count     = 0;
+static int                refs_fd       = -1;
+static int                refs_torn     = 0;   // the journal ends part way into a record
+static uint64_t           gear[256];
+
+// Where the next chunk of the n bytes at data ends, by the gear hash of
+// FastCDC: no sooner than CHUNK_MIN bytes in and no later than CHUNK_MAX.
+static size_t find_cut (const uint8_t* data, size_t n) {
+  uint64_t h = 0;
+
+  if (n > CHUNK_MAX) {
+    n = CHUNK_MAX;
+  }
+  for (size_t i = CHUNK_MIN; i < n; i += 1) {
+    h = (h << 1) + gear[data[i]];
+    if ((h & CHUNK_MASK) == 0) {
+      return i + 1;
+    }
+  }
+  return n;
+}
+
+static struct chunk_ref* find_ref (const uint8_t hash[HASH_BYTES], int create) {
+  uint64_t bucket;
+
+  memcpy(&bucket, hash, sizeof(bucket));
+  if (ref_buckets > 0) {
+    for (struct chunk_ref* r = chunk_refs[bucket % ref_buckets]; r != NULL; r = r->next) {
+      if (memcmp(r->hash, hash, HASH_BYTES) == 0) {
+        return r;
+      }
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  if (ref_count >= ref_buckets) {
+    size_t             buckets = ref_buckets == 0 ? 4096 : 2 * ref_buckets;
+    struct chunk_ref** table   = calloc(buckets, sizeof(*table));
+    if (table == NULL) {
+      return NULL;
+    }
+    for (size_t i = 0; i < ref_buckets; i += 1) {
+      while (chunk_refs[i] != NULL) {
+        struct chunk_ref* r = chunk_refs[i];
+        uint64_t          b;
+        chunk_refs[i] = r->next;
+        memcpy(&b, r->hash, sizeof(b));
+        r->next = table[b % buckets];
+        table[b % buckets] = r;
+      }
+    }
+    free(chunk_refs);
+    chunk_refs  = table;
+    ref_buckets = buckets;
+  }
+
+  struct chunk_ref* r = calloc(1, sizeof(*r));
+  if (r == NULL) {
+    return NULL;
+  }
+  memcpy(r->hash, hash, HASH_BYTES);
+  r->next = chunk_refs[bucket % ref_buckets];
+  chunk_refs[bucket % ref_buckets] = r;
+  ref_count += 1;
+  return r;
+}
+
+// Fill the reference counts from the journal, once.  Also sets up the gear
+// table, which must be the same on every mount for chunks to be found again.
+static int load_chunk_refs (void) {
+  struct ref_record record;
+  struct stat       st;
+  uint64_t          seed = 0x9e3779b97f4a7c15ULL;
+  int               fd;
+
+  if (refs_torn) {
+    return -EIO;
+  }
+  if (refs_fd != -1) {
+    return 0;
+  }
+  for (int i = 0; i < 256; i += 1) {
+    seed   += 0x9e3779b97f4a7c15ULL;
+    gear[i] = fmix64(seed);
+  }
+
+  mkdirat(storage_fd, STORE_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  mkdirat(storage_fd, CHUNKS_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  fd = openat(storage_fd, CHUNK_REFS, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return -errno;
+  }
+  // A record torn by a crash is cut off, so that the next ones are appended
+  // in step.
+  if (fstat(fd, &st) == -1 ||
+      (st.st_size % sizeof(record) != 0 &&
+       ftruncate(fd, st.st_size - st.st_size % sizeof(record)) == -1)) {
+    int res = -errno;
+    close(fd);
+    return res;
+  }
+
+  FILE*  in      = fdopen(dup(fd), "r");
+  size_t records = 0;
+  if (in == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  while (fread(&record, sizeof(record), 1, in) == 1) {
+    struct chunk_ref* r = find_ref(record.hash, 1);
+    if (r == NULL) {
+      fclose(in);
+      close(fd);
+      return -ENOMEM;
+    }
+    r->refs += record.delta;
+    records += 1;
+  }
+  fclose(in);
+
+  // Like the version journal, rewrite it with one record per live chunk
+  // once it is mostly history.
+  if (records > 2 * ref_count + 1024) {
+    int tmp = openat(storage_fd, CHUNK_REFS_TMP, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    int ok  = tmp != -1;
+    for (size_t i = 0; ok && i < ref_buckets; i += 1) {
+      for (struct chunk_ref* r = chunk_refs[i]; ok && r != NULL; r = r->next) {
+        if (r->refs > 0) {
+          memcpy(record.hash, r->hash, HASH_BYTES);
+          record.delta = r->refs;
+          ok = write(tmp, &record, sizeof(record)) == sizeof(record);
+        }
+      }
+    }
+    ok = ok && fsync(tmp) == 0;
+    if (tmp != -1) {
+      close(tmp);
+    }
+    if (ok && renameat(storage_fd, CHUNK_REFS_TMP, storage_fd, CHUNK_REFS) == 0) {
+      close(fd);
+      fd = openat(storage_fd, CHUNK_REFS, O_WRONLY | O_APPEND);
+      if (fd == -1) {
+        return -errno;
+      }
+    }
+  }
+
+  refs_fd = fd;
+  return 0;
+}
+
+// Append n records to the journal in one write.  One that gets only part of
+// the way is cut back off, since a torn record would throw every record after
+// it out of step; should that fail too, the journal takes no more records
+// until the next mount, which cuts it off instead.
+static int journal_refs (const struct ref_record* records, size_t n) {
+  ssize_t bytes = n * sizeof(*records);
+  off_t   end;
+  ssize_t done;
+
+  if (n == 0) {
+    return 0;
+  }
+  end = lseek(refs_fd, 0, SEEK_END);
+  if (end == -1) {
+    return -errno;
+  }
+  done = write(refs_fd, records, bytes);
+  if (done == bytes) {
+    return 0;
+  }
+  int res = done == -1 ? -errno : -EIO;
+  if (done > 0 && ftruncate(refs_fd, end) == -1) {
+    fprintf(stderr, "ERROR: could not repair the chunk reference journal: %s\n",
+            strerror(errno));
+    refs_torn = 1;
+  }
+  return res;
+}
+
+// Take back one reference for each of the n records, deleting the chunks
+// that no version uses any more.  The journal is left to the caller.
+static void unref_chunks (const struct ref_record* records, size_t n) {
+  for (size_t i = 0; i < n; i += 1) {
+    struct chunk_ref* r = find_ref(records[i].hash, 0);
+    if (r != NULL && r->refs > 0) {
+      r->refs -= 1;
+      if (r->refs == 0) {
+        char path[PATH_MAX];
+        chunk_path(r->hash, path);
+        unlink_stored(storage_fd, path);
+      }
+    }
+  }
+}
+
+// Whether the stored chunk at path holds exactly the len bytes at data.
+// Returns 1 if it does, 0 if not, or a negative errno.
+static int chunk_matches (const char* path, const uint8_t* data, size_t len) {
+  uint8_t buf[COPY_CHUNK];
+  size_t  done = 0;
+  int     fd   = open_stored(storage_fd, path);
+  int     res  = 1;
+
+  if (fd < 0) {
+    return fd;
+  }
+  while (res == 1) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1) {
+      res = -errno;
+    } else if (n == 0) {
+      break;
+    } else if ((size_t) n > len - done || memcmp(buf, data + done, n) != 0) {
+      res = 0;
+    } else {
+      done += n;
+    }
+  }
+  close(fd);
+  return res == 1 && done != len ? 0 : res;
+}
+
+// Take a reference on the chunk of len bytes at data, storing it if it is new.
+// A chunk with the same hash but other contents is stored under the next hash
+// along instead, so a collision costs a copy rather than a wrong version.
+static int ref_chunk (const uint8_t* data, size_t len, uint8_t hash[HASH_BYTES]) {
+  struct chunk_ref* r = NULL;
+  char              path[PATH_MAX];
+
+  hash_chunk(data, len, hash);
+  for (int probe = 0; r == NULL; probe += 1) {
+    int res;
+
+    if (probe == CHUNK_PROBES) {
+      return -EIO;
+    }
+    if (probe > 0) {
+      next_hash(hash);
+    }
+    r = find_ref(hash, 1);
+    if (r == NULL) {
+      return -ENOMEM;
+    }
+    if (r->refs == 0) {
+      break;
+    }
+    chunk_path(hash, path);
+    res = chunk_matches(path, data, len);
+    if (res < 0) {
+      return res;
+    }
+    if (res == 0) {
+      r = NULL;
+    }
+  }
+  if (r->refs == 0) {
+    int fd;
+
+    chunk_path(hash, path);
+    *strrchr(path, '/') = '\0';
+    mkdirat(storage_fd, path, S_IRWXU | S_IRGRP | S_IROTH);
+    path[strlen(path)] = '/';
+
+    fd = openat(storage_fd, path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      return -errno;
+    }
+    if (write(fd, data, len) != (ssize_t) len) {
+      close(fd);
+      unlinkat(storage_fd, path, 0);
+      return -EIO;
+    }
+    close(fd);
+    queue_compress(path);
+  }
+  r->refs += 1;
+  return 0;
+}
+
+// Write version v of name into the history folder as a list of chunks.  A
+// version that cannot be stored leaves nothing behind: the references it took
+// are given back and its list is deleted, so that a retry starts afresh.
+static int store_chunks (int hist_fd, const char* name, uint64_t v,
+                         off_t size, int live_fd) {
+  char               snap_name[NAME_MAX + 1];
+  struct ref_record* records  = NULL;
+  size_t             nrecords = 0;
+  size_t             capacity = 0;
+  uint8_t*           buf;
+  size_t             have = 0;
+  off_t              pos  = 0;
+  FILE*              manifest;
+  int                fd;
+  int                res;
+
+  res = load_chunk_refs();
+  if (res < 0) {
+    return res;
+  }
+  snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 ".chunks", name, v);
+  fd = openat(hist_fd, snap_name, O_CREAT | O_WRONLY | O_TRUNC, S_IRWXU);
+  if (fd == -1) {
+    return -errno;
+  }
+  manifest = fdopen(fd, "w");
+  buf      = malloc(4 * CHUNK_MAX);
+  if (manifest == NULL || buf == NULL) {
+    if (manifest != NULL) {
+      fclose(manifest);
+    } else {
+      close(fd);
+    }
+    unlinkat(hist_fd, snap_name, 0);
+    free(buf);
+    return -ENOMEM;
+  }
+  fprintf(manifest, "VCHUNKS %lld\n", (long long) size);
+
+  // Keep at least CHUNK_MAX bytes in the buffer until the end of the file,
+  // so that every cut is made with all the bytes it could need in view.
+  size_t start = 0;
+  while (res == 0 && (pos < size || start < have)) {
+    if (have - start < CHUNK_MAX && pos < size) {
+      memmove(buf, buf + start, have - start);
+      have -= start;
+      start = 0;
+      ssize_t n = pread(live_fd, buf + have, 4 * CHUNK_MAX - have, pos);
+      if (n <= 0) {
+        res = n == 0 ? -EIO : -errno;
+        break;
+      }
+      have += n;
+      pos  += n;
+      continue;
+    }
+
+    size_t  len = find_cut(buf + start, have - start);
+    uint8_t hash[HASH_BYTES];
+    char    hex[2 * HASH_BYTES + 1];
+
+    if (nrecords == capacity) {
+      capacity = capacity == 0 ? 64 : 2 * capacity;
+      struct ref_record* grown = realloc(records, capacity * sizeof(*records));
+      if (grown == NULL) {
+        res = -ENOMEM;
+        break;
+      }
+      records = grown;
+    }
+    res = ref_chunk(buf + start, len, hash);
+    if (res == 0) {
+      memcpy(records[nrecords].hash, hash, HASH_BYTES);
+      records[nrecords].delta = 1;
+      nrecords += 1;
+      hash_to_hex(hash, hex);
+      fprintf(manifest, "%s %zu\n", hex, len);
+    }
+    start += len;
+  }
+
+  if (fclose(manifest) != 0 && res == 0) {
+    res = -EIO;
+  }
+  // All of the version's references go to the journal in one write, once
+  // its list is complete.
+  if (res == 0) {
+    res = journal_refs(records, nrecords);
+  }
+  if (res < 0) {
+    unref_chunks(records, nrecords);
+    unlinkat(hist_fd, snap_name, 0);
+  }
+  free(records);
+  free(buf);
+  return res;
+}
+
+// Drop the references held by the chunk list manifest_fd, deleting the chunks
+// that no other version uses.
+static int drop_chunks (int manifest_fd) {
+  FILE*              manifest = fdopen(manifest_fd, "r");
+  struct ref_record* records  = NULL;
+  size_t             nrecords = 0;
+  size_t             capacity = 0;
+  char               line[128];
+  int                res = 0;
+
+  if (manifest == NULL) {
+    close(manifest_fd);
+    return -ENOMEM;
+  }
+  res = load_chunk_refs();
+  while (res == 0 && fgets(line, sizeof(line), manifest) != NULL) {
+    uint8_t           hash[HASH_BYTES];
+    struct chunk_ref* r;
+
+    if (strncmp(line, "VCHUNKS", 7) == 0 || hex_to_hash(line, hash) == -1) {
+      continue;
+    }
+    r = find_ref(hash, 0);
+    if (r == NULL || r->refs == 0) {
+      continue;
+    }
+    if (nrecords == capacity) {
+      capacity = capacity == 0 ? 64 : 2 * capacity;
+      struct ref_record* grown = realloc(records, capacity * sizeof(*records));
+      if (grown == NULL) {
+        res = -ENOMEM;
+        break;
+      }
+      records = grown;
+    }
+    memcpy(records[nrecords].hash, hash, HASH_BYTES);
+    records[nrecords].delta = -1;
+    nrecords += 1;
+
+    r->refs -= 1;
+    if (r->refs == 0) {
+      char path[PATH_MAX];
+      chunk_path(hash, path);
+      unlink_stored(storage_fd, path);
+    }
+  }
+  fclose(manifest);
+
+  int journaled = journal_refs(records, nrecords);
+  if (res == 0) {
+    res = journaled;
+  }
+  free(records);
+  return res;
+}
+
+/* A delta made straight from what was written would be as big as the file
+   whenever the file is saved by rewriting it, which is how most editors save
+   it, however little changed.  So the written extents are compared with the
+   version before in DIFF_BLOCK blocks, and only the blocks that differ go
+   into the delta. */
+#define DIFF_BLOCK 4096
+
+// Add the bytes from offset to offset + length to the extents, extending the
+// last one if it ends where they start.
+static int append_extent (struct extent** extents, int* count, int* room, off_t offset,
+                          off_t length) {
+  struct extent* last = *count > 0 ? &(*extents)[*count - 1] : NULL;
+
+  if (last != NULL && last->offset + last->length == offset) {
+    last->length += length;
+    return 0;
+  }
+  if (*count == *room) {
+    struct extent* grown = realloc(*extents, (*room ? 2 * *room : 64) * sizeof(*grown));
+    if (grown == NULL) {
+      return -ENOMEM;
+    }
+    *extents = grown;
+    *room    = *room ? 2 * *room : 64;
+  }
+  (*extents)[*count].offset = offset;
+  (*extents)[*count].length = length;
+  *count += 1;
+  return 0;
+}
+
+// Add the blocks of the length bytes at offset that differ between old_fd and
+// new_fd to the extents.  a and b are COPY_CHUNK bytes each to compare in.
+static int append_changed (struct extent** extents, int* count, int* room, int old_fd,
+                           int new_fd, off_t offset, off_t length, char* a, char* b) {
+  int res = 0;
+
+  for (off_t pos = offset; res == 0 && pos < offset + length; pos += COPY_CHUNK) {
+    size_t n = offset + length - pos < COPY_CHUNK ? offset + length - pos : COPY_CHUNK;
+    if (pread(old_fd, a, n, pos) != (ssize_t) n || pread(new_fd, b, n, pos) != (ssize_t) n) {
+      res = -EIO;
+    }
+    for (size_t at = 0; res == 0 && at < n; at += DIFF_BLOCK) {
+      size_t block = n - at < DIFF_BLOCK ? n - at : DIFF_BLOCK;
+      if (memcmp(a + at, b + at, block) != 0) {
+        res = append_extent(extents, count, room, pos + at, block);
+      }
+    }
+  }
+  return res;
+}
+
+// Write version v of name, whose size bytes are read from new_fd, as a delta
+// over version v - 1 holding only the blocks that differ from it.  Since
+// v - 1, the file was cut to keep bytes and then had the extents written.
+static int store_changes (int hist_fd, const char* name, uint64_t v, off_t keep,
+                          off_t size, const struct extent* extents, int count,
+                          int new_fd) {
+  struct stat    old_st;
+  struct extent* changed  = NULL;
+  int            nchanged = 0;
+  int            room     = 0;
+  int            old_fd   = open_scratch();
+  char*          a        = malloc(COPY_CHUNK);
+  char*          b        = malloc(COPY_CHUNK);
+  off_t          same;
+  int            res = old_fd < 0 ? old_fd : 0;
+
+  if (res == 0 && (a == NULL || b == NULL)) {
+    res = -ENOMEM;
+  }
+  if (res == 0) {
+    res = materialize(hist_fd, name, v - 1, old_fd);
+  }
+  if (res == 0 && fstat(old_fd, &old_st) == -1) {
+    res = -errno;
+  }
+  if (res < 0) {
+    // Without the version before to compare with, store what was written.
+    free(a);
+    free(b);
+    if (old_fd >= 0) {
+      close(old_fd);
+    }
+    return store_delta(hist_fd, name, v, v - 1, keep, size, extents, count, new_fd);
+  }
+
+  // The bytes before keep that were not written are the old ones, and every
+  // byte from keep on, written or not, may have changed.  Past the old end of
+  // the file there is nothing to compare with.
+  same = old_st.st_size < size ? old_st.st_size : size;
+  for (int i = 0; res == 0 && i < count && extents[i].offset < keep; i += 1) {
+    off_t end = extents[i].offset + extents[i].length;
+    res = append_changed(&changed, &nchanged, &room, old_fd, new_fd, extents[i].offset,
+                         (end < keep ? end : keep) - extents[i].offset, a, b);
+  }
+  if (res == 0 && keep < same) {
+    res = append_changed(&changed, &nchanged, &room, old_fd, new_fd, keep, same - keep, a, b);
+  }
+  for (int i = 0; res == 0 && i < count; i += 1) {
+    off_t start = extents[i].offset > same ? extents[i].offset : same;
+    off_t end   = extents[i].offset + extents[i].length;
+    if (start < end) {
+      res = append_extent(&changed, &nchanged, &room, start, end - start);
+    }
+  }
+  if (res == 0) {
+    res = store_delta(hist_fd, name, v, v - 1, same, size, changed, nchanged, new_fd);
+  }
+  free(changed);
+  free(a);
+  free(b);
+  close(old_fd);
+  return res;
+}
+
+// Make version v of name, now stored, the newest in its counter c.  The
+// counter only moves on once the journal has it, so that a version that could
+// not be recorded is stored again under the same number.
+static int commit_version (struct vers_counter* c, int hist_fd, const char* name,
+                           uint64_t v) {
+  time_t now = time(NULL);
+  int    res = record_time(hist_fd, name, v, now);
+
+  pthread_mutex_lock(&counter_lock);
+  if (res == 0) {
+    res = journal_counter(c->path, v + 1, now);
+  }
+  if (res == 0) {
+    c->next_version = v + 1;
+    c->last_snap    = now;
+  }
+  pthread_mutex_unlock(&counter_lock);
+  return res;
+}
+
+/* Record a new version of the file at path, whose current contents can be
+   read from live_fd.  Since the previous version, the file was cut down to
+   keep bytes at some point and then the given extents were written. */
+static int store_version (const char* path, int live_fd, off_t keep,
+                          const struct extent* extents, int count) {
+  struct stat          st;
+  struct vers_counter* c;
+  char                 snap_path[PATH_MAX];
+  uint64_t             v;
+  int                  hist_fd;
+  int                  res;
+
+  if (fstat(live_fd, &st) == -1) {
+    return -errno;
+  }
+  hist_fd = open_hist_dir(path, 1);
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  c = get_counter(path, hist_fd);
+  if (c == NULL) {
+    close(hist_fd);
+    return -ENOMEM;
+  }
+
+  v = c->next_version;
+  snprintf(snap_path, PATH_MAX, "%s%s%s/%s,%" PRIu64,
+           VERS_FOLDER, path, HIST_TAIL, base_name(path), v);
+  if (config.chunked) {
+    res = store_chunks(hist_fd, base_name(path), v, st.st_size, live_fd);
+  } else if (config.keyframe <= 1 || v % config.keyframe == 0 ||
+             log_empty(hist_fd, base_name(path))) {
+    res = store_keyframe(hist_fd, base_name(path), v, st.st_size, live_fd);
+  } else {
+    res = store_changes(hist_fd, base_name(path), v,
+                        keep < st.st_size ? keep : st.st_size, st.st_size,
+                        extents, count, live_fd);
+    strncat(snap_path, ".delta", PATH_MAX - strlen(snap_path) - 1);
+  }
+  if (res == 0) {
+    res = commit_version(c, hist_fd, base_name(path), v);
+  }
+  // A version that failed may be written again under the same name, so only
+  // a stored one is handed to the compressor.  Chunks are queued as they go.
+  if (res == 0 && !config.chunked) {
+    queue_compress(relative_path(snap_path));
+  }
+
+  close(hist_fd);
+  return res;
+}
+
+/* Removing a history could mean unlinking thousands of versions, which
+   unlink() should not wait for.  Instead the history folder is renamed into
+   .vers-store/trash/, one step however many versions it holds, and a thread of its
+   own, the reaper, deletes what is in the trash a batch of files at a time.
+   It does not care which versions are there, so a history with some missing
+   is removed like any other.  Whatever is left in the trash when versfs
+   stops is reaped on the next mount. */
+#define TRASH_BATCH 64
+
+static pthread_mutex_t reap_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  reap_ready   = PTHREAD_COND_INITIALIZER;
+static int             reap_pending = 1;   // the trash may have something in it
+static int             reap_running = 0;
+static int             reap_stop    = 0;
+static pthread_t       reap_thread;
+
+// Move the folder at path (relative to storage_fd) into the trash, and wake
+// the reaper.  Called with store_lock held.
+static int trash_folder (const char* path) {
+  static unsigned long trash_count = 0;
+  char                 trash_path[PATH_MAX];
+  int                  res;
+
+  mkdirat(storage_fd, STORE_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  mkdirat(storage_fd, TRASH_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  // A name still in use from an earlier mount is passed over.
+  do {
+    snprintf(trash_path, PATH_MAX, "%s/%ld.%lu", TRASH_FOLDER, (long) time(NULL), trash_count);
+    trash_count += 1;
+    res = renameat(storage_fd, path, storage_fd, trash_path) == -1 ? -errno : 0;
+  } while (res == -ENOTEMPTY || res == -EEXIST);
+  if (res < 0) {
+    return res;
+  }
+
+  pthread_mutex_lock(&reap_lock);
+  reap_pending = 1;
+  pthread_cond_signal(&reap_ready);
+  pthread_mutex_unlock(&reap_lock);
+  return 0;
+}
+
+/* Move the whole history of the file at path into the trash.  Called with
+   store_lock held. */
+static int remove_history (const char* path) {
+  char                 hist_path[PATH_MAX];
+  struct vers_counter* c;
+  int                  hist_fd = open_hist_dir(path, 0);
+  int                  res;
+
+  if (hist_fd < 0) {
+    return hist_fd == -ENOENT ? 0 : hist_fd;
+  }
+  c = get_counter(path, hist_fd);
+  close(hist_fd);
+  if (c == NULL) {
+    return -ENOMEM;
+  }
+
+  snprintf(hist_path, PATH_MAX, "%s%s%s", VERS_FOLDER, path, HIST_TAIL);
+  res = trash_folder(relative_path(hist_path));
+  if (res == 0) {
+    pthread_mutex_lock(&counter_lock);
+    c->next_version = 0;
+    c->fresh        = 0;
+    res = journal_counter(c->path, 0, c->last_snap);
+    pthread_mutex_unlock(&counter_lock);
+  }
+  return res;
+}
+
+static int reaper_stopping (void) {
+  pthread_mutex_lock(&reap_lock);
+  int stop = reap_stop;
+  pthread_mutex_unlock(&reap_lock);
+  return stop;
+}
+
+// Delete the history folder called entry in the trash, trash_fd.
+static int reap_history (int trash_fd, const char* entry) {
+  char           names[TRASH_BATCH][NAME_MAX + 1];
+  int            fd = openat(trash_fd, entry, O_RDONLY | O_DIRECTORY);
+  DIR*           dp = fd == -1 ? NULL : fdopendir(fd);
+  struct dirent* de;
+  int            count;
+  int            res = 0;
+
+  if (dp == NULL) {
+    res = -errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    return res;
+  }
+  do {
+    // A batch of names is read before any of them is deleted, since a folder
+    // read while it changes may skip some.
+    count = 0;
+    rewinddir(dp);
+    while (count < TRASH_BATCH && (de = readdir(dp)) != NULL) {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+        snprintf(names[count], NAME_MAX + 1, "%s", de->d_name);
+        count += 1;
+      }
+    }
+    for (int i = 0; res == 0 && i < count; i += 1) {
+      size_t len = strlen(names[i]);
+      if (len <= 7 || strcmp(names[i] + len - 7, ".chunks") != 0) {
+        if (unlinkat(fd, names[i], 0) == -1 && errno != ENOENT) {
+          res = -errno;
+        }
+        continue;
+      }
+      // A list of chunks gives up its references once it is gone, so that
+      // stopping in between leaves chunks behind rather than dropping a
+      // reference twice.  One still linked into a pruned history (see
+      // compact_history()) keeps them.
+      struct stat st;
+      pthread_mutex_lock(&store_lock);
+      int manifest_fd = openat(fd, names[i], O_RDONLY);
+      if (manifest_fd == -1 || fstat(manifest_fd, &st) == -1 ||
+          unlinkat(fd, names[i], 0) == -1) {
+        res = errno == ENOENT ? 0 : -errno;
+        if (manifest_fd != -1) {
+          close(manifest_fd);
+        }
+      } else if (st.st_nlink > 1) {
+        close(manifest_fd);
+      } else {
+        res = drop_chunks(manifest_fd);
+      }
+      pthread_mutex_unlock(&store_lock);
+    }
+  } while (res == 0 && count == TRASH_BATCH && !reaper_stopping());
+  closedir(dp);
+
+  if (res == 0 && unlinkat(trash_fd, entry, AT_REMOVEDIR) == -1) {
+    res = -errno;
+  }
+  return res;
+}
+
+// Delete everything in the trash.  A history that cannot be deleted yet (the
+// compressor may still be writing into it) is left for the next pass.
+static void reap_trash (void) {
+  int            fd = openat(storage_fd, TRASH_FOLDER, O_RDONLY | O_DIRECTORY);
+  DIR*           dp = fd == -1 ? NULL : fdopendir(fd);
+  struct dirent* de;
+
+  if (dp == NULL) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  while (!reaper_stopping() && (de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    int res = reap_history(fd, de->d_name);
+    if (res < 0 && res != -ENOENT && res != -ENOTEMPTY) {
+      fprintf(stderr, "ERROR: could not delete %s/%s: %s\n",
+              TRASH_FOLDER, de->d_name, strerror(-res));
+    }
+  }
+  closedir(dp);
+}
+
+static void* reap_worker (void* arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&reap_lock);
+  while (!reap_stop) {
+    if (!reap_pending) {
+      pthread_cond_wait(&reap_ready, &reap_lock);
+      continue;
+    }
+    reap_pending = 0;
+    pthread_mutex_unlock(&reap_lock);
+
+    reap_trash();
+
+    pthread_mutex_lock(&reap_lock);
+  }
+  pthread_mutex_unlock(&reap_lock);
+  return NULL;
+}
+
+/* With any of the keep options, the versions that no policy wants any more
+   are pruned by a thread of its own, the compactor, every prune_interval
+   seconds:
+
+     keep=<n>         keeps the newest n versions of each file;
+     keep_hourly=<n>  keeps the newest version of each of the last n hours
+                      that have one, and keep_daily and keep_weekly likewise;
+     keep_bytes=<n>   gives up the oldest versions of a file, whatever the
+                      others say, until its history takes no more than n
+                      bytes.
+
+   The newest version is always kept.  A history is pruned by putting a new
+   one together in .vers-store/compact/: a version kept as it is is a hard link to
+   the old one, and a delta whose base is pruned is rewritten over the version
+   kept before it, or whole if that would make a longer chain than its
+   keyframe allows.  The new folder is swapped in for the old one in a single
+   rename and the old one is left to the reaper, so a reader sees one or the
+   other and a crash part way leaves the old history as it was.  Only the
+   swap, after catching up with versions stored meanwhile, is done under
+   store_lock. */
+
+struct version_plan {
+  uint64_t version;
+  time_t   time;    // when it was stored
+  off_t    cost;    // how many bytes of the store it takes up
+  int      keep;
+};
+
+static pthread_mutex_t compact_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  compact_wake    = PTHREAD_COND_INITIALIZER;
+static int             compact_running = 0;
+static int             compact_stop    = 0;
+static int             exchange_works  = 1;
+static pthread_t       compact_thread;
+
+// Stop pruning for good, since histories cannot be swapped in place here.
+// Called with store_lock held.
+static void no_exchange (void) {
+  if (exchange_works) {
+    fprintf(stderr, "WARNING: the storage cannot exchange folders atomically; "
+                    "histories will not be pruned\n");
+  }
+  exchange_works = 0;
+}
+
+static int compactor_stopping (void) {
+  pthread_mutex_lock(&compact_lock);
+  int stop = compact_stop;
+  pthread_mutex_unlock(&compact_lock);
+  return stop;
+}
+
+// Whether any of the keep options is set.
+static int pruning (void) {
+  return config.keep || config.keep_hourly || config.keep_daily || config.keep_weekly ||
+         config.keep_bytes;
+}
+
+// Which period of the given length, in local time, t falls in.  Weeks start
+// on a Monday.
+static long period_of (time_t t, long seconds) {
+  struct tm tm;
+  long      local;
+
+  localtime_r(&t, &tm);
+  local = (long) t + tm.tm_gmtoff;
+  // 1 January 1970 was a Thursday.
+  if (seconds == 7 * 24 * 3600) {
+    local += 3 * 24 * 3600;
+  }
+  return local / seconds;
+}
+
+// Mark the versions in plan, oldest first, that the policies keep.
+static void choose_versions (struct version_plan* plan, size_t count) {
+  static const long periods[] = { 3600, 24 * 3600, 7 * 24 * 3600 };
+  unsigned          keep_periods[] = { config.keep_hourly, config.keep_daily, config.keep_weekly };
+  int               thinning = config.keep || config.keep_hourly || config.keep_daily ||
+                               config.keep_weekly;
+  off_t             total    = 0;
+
+  for (size_t i = 0; i < count; i += 1) {
+    plan[i].keep = !thinning || i + config.keep >= count;
+  }
+  for (int p = 0; p < 3; p += 1) {
+    unsigned seen = 0;
+    long     last = 0;
+    for (size_t i = count; i > 0 && seen < keep_periods[p]; i -= 1) {
+      long period = period_of(plan[i - 1].time, periods[p]);
+      if (seen == 0 || period != last) {
+        plan[i - 1].keep = 1;
+        seen += 1;
+        last  = period;
+      }
+    }
+  }
+  if (count > 0) {
+    plan[count - 1].keep = 1;
+  }
+
+  // The budget gives up the oldest versions first.
+  if (config.keep_bytes > 0) {
+    for (size_t i = 0; i < count; i += 1) {
+      total += plan[i].keep ? plan[i].cost : 0;
+    }
+    for (size_t i = 0; i + 1 < count && total > (off_t) config.keep_bytes; i += 1) {
+      if (plan[i].keep) {
+        plan[i].keep = 0;
+        total       -= plan[i].cost;
+      }
+    }
+  }
+}
+
+// How many bytes the stored file stem takes, in whichever form it is in.
+static off_t stored_size (int hist_fd, const char* stem) {
+  char        name[NAME_MAX + 1];
+  struct stat st;
+
+  for (int c = CODEC_NONE; c <= CODEC_ZSTD; c += 1) {
+    snprintf(name, sizeof(name), "%s%s", stem, codec_ext[c]);
+    if (fstatat(hist_fd, name, &st, 0) == 0) {
+      return st.st_size;
+    }
+  }
+  return 0;
+}
+
+struct chunk_use {
+  uint8_t hash[HASH_BYTES];
+  size_t  index;    // of the version in the plan
+  off_t   length;
+};
+
+// For qsort(): by hash, and then newest version first.
+static int compare_uses (const void* a, const void* b) {
+  const struct chunk_use* x = a;
+  const struct chunk_use* y = b;
+  int                     c = memcmp(x->hash, y->hash, HASH_BYTES);
+
+  if (c != 0) {
+    return c;
+  }
+  return x->index < y->index ? 1 : x->index > y->index ? -1 : 0;
+}
+
+// Charge each chunk used by the chunk lists in plan to the newest version
+// that uses it, since the chunk goes only once that version does.
+static int charge_chunks (int hist_fd, const char* name, struct version_plan* plan, size_t count) {
+  struct chunk_use* uses  = NULL;
+  size_t            nuses = 0;
+  size_t            room  = 0;
+  int               res   = 0;
+
+  for (size_t i = 0; res == 0 && i < count; i += 1) {
+    char  snap_name[NAME_MAX + 1];
+    char  line[128];
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 ".chunks", name, plan[i].version);
+    int   fd       = openat(hist_fd, snap_name, O_RDONLY);
+    FILE* manifest = fd == -1 ? NULL : fdopen(fd, "r");
+    if (manifest == NULL) {
+      if (fd != -1) {
+        close(fd);
+      }
+      continue;
+    }
+    while (res == 0 && fgets(line, sizeof(line), manifest) != NULL) {
+      long long length;
+      if (nuses == room) {
+        struct chunk_use* grown = realloc(uses, (room ? 2 * room : 256) * sizeof(*grown));
+        if (grown == NULL) {
+          res = -ENOMEM;
+          break;
+        }
+        uses = grown;
+        room = room ? 2 * room : 256;
+      }
+      if (strncmp(line, "VCHUNKS", 7) == 0 || hex_to_hash(line, uses[nuses].hash) == -1 ||
+          sscanf(line + 2 * HASH_BYTES, "%lld", &length) != 1) {
+        continue;
+      }
+      uses[nuses].index  = i;
+      uses[nuses].length = length;
+      nuses += 1;
+    }
+    fclose(manifest);
+  }
+
+  if (res == 0) {
+    qsort(uses, nuses, sizeof(*uses), compare_uses);
+    for (size_t i = 0; i < nuses; i += 1) {
+      if (i == 0 || memcmp(uses[i].hash, uses[i - 1].hash, HASH_BYTES) != 0) {
+        plan[uses[i].index].cost += uses[i].length;
+      }
+    }
+  }
+  free(uses);
+  return res;
+}
+
+// For bsearch(): a when_entry by its version.
+static int compare_when (const void* key, const void* entry) {
+  uint64_t v = *(const uint64_t*) key;
+  uint64_t w = ((const struct when_entry*) entry)->version;
+  return v < w ? -1 : v > w;
+}
+
+// List the versions of the file called name, whose history folder is
+// hist_fd, with when each was stored and what it takes up.
+static int plan_history (int hist_fd, const char* name, struct version_plan** plan,
+                         size_t* count) {
+  char               index_name[NAME_MAX + 1];
+  uint64_t*          versions;
+  struct when_entry* when  = NULL;
+  size_t             nwhen = 0;
+  struct stat        st;
+  int                fd;
+  int                res = list_versions(hist_fd, name, &versions, count);
+
+  if (res < 0) {
+    return res;
+  }
+  *plan = calloc(*count > 0 ? *count : 1, sizeof(**plan));
+  if (*plan == NULL) {
+    free(versions);
+    return -ENOMEM;
+  }
+
+  // A log's index has both, in the order list_versions() gives.  A history
+  // the log took over partway through is left as it is: the versions from
+  // before are not in the log to be copied.
+  snprintf(index_name, sizeof(index_name), "%s%s", name, IDX_TAIL);
+  fd = openat(hist_fd, index_name, O_RDONLY);
+  if (fd != -1 && count_log_entries(fd) != (int64_t) *count) {
+    *count = 0;
+  }
+  if (fd != -1) {
+    struct log_entry entry;
+    for (size_t i = 0; res == 0 && i < *count; i += 1) {
+      res = read_log_entry(fd, i, &entry);
+      (*plan)[i].version = entry.version;
+      (*plan)[i].time    = entry.time;
+      (*plan)[i].cost    = entry.length;
+    }
+    close(fd);
+    free(versions);
+    return res;
+  }
+
+  snprintf(index_name, sizeof(index_name), "%s%s", name, WHEN_TAIL);
+  fd = openat(hist_fd, index_name, O_RDONLY);
+  if (fd != -1 && fstat(fd, &st) == 0 && (when = malloc(st.st_size + 1)) != NULL &&
+      pread(fd, when, st.st_size, 0) == st.st_size) {
+    nwhen = st.st_size / sizeof(*when);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  for (size_t i = 0; res == 0 && i < *count; i += 1) {
+    char                     stem[NAME_MAX + 1];
+    uint64_t                 v     = versions[i];
+    const struct when_entry* found = bsearch(&v, when, nwhen, sizeof(*when), compare_when);
+
+    (*plan)[i].version = v;
+    if (found != NULL) {
+      (*plan)[i].time = found->time;
+    } else if (stat_version(hist_fd, name, v, &st) == 0) {
+      (*plan)[i].time = st.st_mtime;
+    }
+    snprintf(stem, sizeof(stem), "%s,%" PRIu64, name, v);
+    (*plan)[i].cost = stored_size(hist_fd, stem);
+    strncat(stem, ".delta", sizeof(stem) - strlen(stem) - 1);
+    (*plan)[i].cost += stored_size(hist_fd, stem);
+    snprintf(stem, sizeof(stem), "%s,%" PRIu64 ".chunks", name, v);
+    (*plan)[i].cost += stored_size(hist_fd, stem);
+  }
+  if (res == 0 && config.keep_bytes > 0) {
+    res = charge_chunks(hist_fd, name, *plan, *count);
+  }
+  free(when);
+  free(versions);
+  return res;
+}
+
+// Hard link the stored file stem, in whichever form it is in, from old_fd
+// into new_fd.
+static int link_stored (int old_fd, int new_fd, const char* stem) {
+  char name[NAME_MAX + 1];
+
+  for (int c = CODEC_NONE; c <= CODEC_ZSTD; c += 1) {
+    snprintf(name, sizeof(name), "%s%s", stem, codec_ext[c]);
+    if (linkat(old_fd, name, new_fd, name, 0) == 0) {
+      return 0;
+    }
+    if (errno != ENOENT) {
+      return -errno;
+    }
+  }
+  return -ENOENT;
+}
+
+// Copy the log record entry, from log_fd, to the end of the log in hist_fd.
+static int copy_record (int hist_fd, const char* name, int log_fd,
+                        const struct log_entry* entry) {
+  struct version_out out;
+  off_t              pos;
+  int                res = open_version(hist_fd, name, entry->version, entry->kind, &out);
+
+  if (res < 0) {
+    return res;
+  }
+  pos = lseek(out.fd, 0, SEEK_CUR);
+  res = pos == -1 ? -errno : copy_range(out.fd, pos, log_fd, entry->offset, entry->length);
+  if (res == 0 && lseek(out.fd, pos + entry->length, SEEK_SET) == -1) {
+    res = -errno;
+  }
+  return close_version(&out, res);
+}
+
+// Give version v, just written into hist_fd, back the time it was first
+// stored at.
+static int restore_time (int hist_fd, const char* name, uint64_t v, time_t t) {
+  static const char* tails[] = { "", ".delta" };
+  char               snap_name[NAME_MAX + 1];
+  struct timespec    times[2] = {
+    { .tv_nsec = UTIME_OMIT },
+    { .tv_sec  = t },
+  };
+
+  if (config.logged) {
+    struct log_entry entry;
+    snprintf(snap_name, sizeof(snap_name), "%s%s", name, IDX_TAIL);
+    int     fd  = openat(hist_fd, snap_name, O_RDWR);
+    int64_t n   = fd == -1 ? -errno : count_log_entries(fd);
+    int     res = n <= 0 ? (n < 0 ? (int) n : -EIO) : read_log_entry(fd, n - 1, &entry);
+    if (res == 0 && entry.version == v) {
+      entry.time = t;
+      if (pwrite(fd, &entry, sizeof(entry), (n - 1) * sizeof(entry)) != sizeof(entry)) {
+        res = -EIO;
+      }
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    return res;
+  }
+  for (int i = 0; i < 2; i += 1) {
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64 "%s", name, v, tails[i]);
+    if (utimensat(hist_fd, snap_name, times, 0) == 0) {
+      return 0;
+    }
+  }
+  return -errno;
+}
+
+// Write version v of name, whose contents are in new_fd, into hist_fd as a
+// delta over version base, whose contents are in old_fd.
+static int store_difference (int hist_fd, const char* name, uint64_t v, uint64_t base,
+                             int old_fd, int new_fd) {
+  struct stat    old_st;
+  struct stat    new_st;
+  struct extent* extents = NULL;
+  int            count   = 0;
+  int            room    = 0;
+  char*          a       = malloc(COPY_CHUNK);
+  char*          b       = malloc(COPY_CHUNK);
+  off_t          keep    = 0;
+  int            res     = 0;
+
+  if (a == NULL || b == NULL) {
+    res = -ENOMEM;
+  } else if (fstat(old_fd, &old_st) == -1 || fstat(new_fd, &new_st) == -1) {
+    res = -errno;
+  } else {
+    keep = old_st.st_size < new_st.st_size ? old_st.st_size : new_st.st_size;
+  }
+
+  // Blocks that differ, and anything past the end of the old version, make
+  // the extents.
+  if (res == 0) {
+    res = append_changed(&extents, &count, &room, old_fd, new_fd, 0, keep, a, b);
+  }
+  if (res == 0 && new_st.st_size > keep) {
+    res = append_extent(&extents, &count, &room, keep, new_st.st_size - keep);
+  }
+  if (res == 0) {
+    res = store_delta(hist_fd, name, v, base, keep, new_st.st_size, extents, count, new_fd);
+  }
+  free(extents);
+  free(a);
+  free(b);
+  return res;
+}
+
+// Write version i of plan, which cannot be kept as it is, into new_fd: as a
+// delta over the version kept before it, prev, if that makes no longer a
+// chain than its keyframe would, or else whole.  depth is how many deltas
+// each version kept so far has to replay.
+static int rewrite_version (int hist_fd, int new_fd, const char* name,
+                            const struct version_plan* plan, int* depth, size_t i, size_t prev) {
+  uint64_t v       = plan[i].version;
+  int      content = open_scratch();
+  int      base    = -1;
+  int      res     = content < 0 ? content : materialize(hist_fd, name, v, content);
+
+  if (res == 0 && prev != SIZE_MAX && !config.chunked && config.keyframe > 1 &&
+      (uint64_t) depth[prev] + 1 <= v % config.keyframe) {
+    base = open_scratch();
+    res  = base < 0 ? base : materialize(hist_fd, name, plan[prev].version, base);
+    if (res == 0) {
+      res      = store_difference(new_fd, name, v, plan[prev].version, base, content);
+      depth[i] = depth[prev] + 1;
+    }
+  } else if (res == 0) {
+    struct stat st;
+    res      = fstat(content, &st) == -1 ? -errno
+                                        : store_keyframe(new_fd, name, v, st.st_size, content);
+    depth[i] = 0;
+  }
+  if (res == 0) {
+    res = restore_time(new_fd, name, v, plan[i].time);
+  }
+  if (base >= 0) {
+    close(base);
+  }
+  if (content >= 0) {
+    close(content);
+  }
+  return res;
+}
+
+// Keep version i of plan, stored in files of its own, as it is by linking it
+// into new_fd, if the version it is laid over is kept too.  Returns 1 if it
+// was, or 0 if it has to be rewritten.
+static int link_version (int hist_fd, int new_fd, const char* name,
+                         const struct version_plan* plan, int* depth, size_t i) {
+  char     stem[NAME_MAX + 1];
+  uint64_t base;
+  int      res;
+
+  snprintf(stem, sizeof(stem), "%s,%" PRIu64, name, plan[i].version);
+  res = link_stored(hist_fd, new_fd, stem);
+  if (res != -ENOENT) {
+    depth[i] = 0;
+    return res < 0 ? res : 1;
+  }
+  // A list of chunks stands on its own.
+  snprintf(stem, sizeof(stem), "%s,%" PRIu64 ".chunks", name, plan[i].version);
+  if (linkat(hist_fd, stem, new_fd, stem, 0) == 0) {
+    depth[i] = 0;
+    return 1;
+  }
+  if (errno != ENOENT) {
+    return -errno;
+  }
+
+  snprintf(stem, sizeof(stem), "%s,%" PRIu64 ".delta", name, plan[i].version);
+  int fd = open_stored(hist_fd, stem);
+  if (fd < 0) {
+    return fd;
+  }
+  res = delta_base(fd, 0, plan[i].version, &base);
+  close(fd);
+  if (res < 0) {
+    return res;
+  }
+  for (size_t b = i; b > 0; b -= 1) {
+    if (plan[b - 1].version == base) {
+      if (!plan[b - 1].keep) {
+        return 0;
+      }
+      res = link_stored(hist_fd, new_fd, stem);
+      depth[i] = depth[b - 1] + 1;
+      return res < 0 ? res : 1;
+    }
+  }
+  return 0;
+}
+
+// Bring the pruned history in new_fd up to date with the versions stored in
+// hist_fd since plan was made, and with its other files.  Called with
+// store_lock held.
+static int catch_up (int hist_fd, int new_fd, const char* name,
+                     const struct version_plan* plan, size_t count, int log_fd) {
+  char               file_name[NAME_MAX + 1];
+  uint64_t           last = plan[count - 1].version;
+  uint64_t*          versions;
+  size_t             nversions;
+  struct when_entry* when = NULL;
+  struct stat        st;
+  int                fd;
+  int                res;
+
+  if (log_fd != -1) {
+    struct log_entry entry;
+    snprintf(file_name, sizeof(file_name), "%s%s", name, IDX_TAIL);
+    fd = openat(hist_fd, file_name, O_RDONLY);
+    if (fd == -1) {
+      return -errno;
+    }
+    int64_t n = count_log_entries(fd);
+    res = n < 0 ? n : 0;
+    for (int64_t i = count; res == 0 && i < n; i += 1) {
+      res = read_log_entry(fd, i, &entry);
+      if (res == 0) {
+        res = copy_record(new_fd, name, log_fd, &entry);
+      }
+      if (res == 0) {
+        res = restore_time(new_fd, name, entry.version, entry.time);
+      }
+    }
+    close(fd);
+    return res;
+  }
+
+  res = list_versions(hist_fd, name, &versions, &nversions);
+  if (res < 0) {
+    return res;
+  }
+  for (size_t i = 0; res == 0 && i < nversions; i += 1) {
+    if (versions[i] <= last) {
+      continue;
+    }
+    static const char* tails[] = { "", ".delta" };
+    res = -ENOENT;
+    for (int t = 0; t < 2 && res == -ENOENT; t += 1) {
+      snprintf(file_name, sizeof(file_name), "%s,%" PRIu64 "%s", name, versions[i], tails[t]);
+      res = link_stored(hist_fd, new_fd, file_name);
+    }
+    if (res == -ENOENT) {
+      snprintf(file_name, sizeof(file_name), "%s,%" PRIu64 ".chunks", name, versions[i]);
+      res = linkat(hist_fd, file_name, new_fd, file_name, 0) == -1 ? -errno : 0;
+    }
+  }
+  free(versions);
+
+  // The .when list keeps the entries of the versions that are left.
+  snprintf(file_name, sizeof(file_name), "%s%s", name, WHEN_TAIL);
+  fd = openat(hist_fd, file_name, O_RDONLY);
+  if (res == 0 && fd != -1 && fstat(fd, &st) == 0 && (when = malloc(st.st_size + 1)) != NULL &&
+      pread(fd, when, st.st_size, 0) == st.st_size) {
+    size_t kept = 0;
+    for (size_t i = 0; i < st.st_size / sizeof(*when); i += 1) {
+      const struct version_plan* p = NULL;
+      for (size_t lo = 0, hi = count; lo < hi && p == NULL; ) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (plan[mid].version == when[i].version) {
+          p = &plan[mid];
+        } else if (plan[mid].version < when[i].version) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (when[i].version > last || (p != NULL && p->keep)) {
+        when[kept] = when[i];
+        kept += 1;
+      }
+    }
+    int out = openat(new_fd, file_name, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    res = out == -1 ? -errno : write_all(out, when, kept * sizeof(*when));
+    if (out != -1) {
+      close(out);
+    }
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  free(when);
+
+  if (res == 0 && linkat(hist_fd, NEXT_VERS, new_fd, NEXT_VERS, 0) == -1 && errno != ENOENT) {
+    res = -errno;
+  }
+  return res;
+}
+
+// Prune the history of the file at path as the keep options say.
+static int compact_history (const char* path) {
+  static unsigned long build_count = 0;
+  const char*          name = base_name(path);
+  char                 hist_path[PATH_MAX];
+  char                 build_path[PATH_MAX];
+  char                 file_name[NAME_MAX + 1];
+  struct version_plan* plan  = NULL;
+  size_t               count = 0;
+  size_t               kept  = 0;
+  size_t               prev  = SIZE_MAX;    // the last version kept so far
+  int*                 depth = NULL;
+  struct stat          hist_st;
+  struct stat          now_st;
+  int                  hist_fd = open_hist_dir(path, 0);
+  int                  log_fd  = -1;
+  int                  idx_fd  = -1;
+  int                  new_fd  = -1;
+  int                  res;
+
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  // A history is only pruned into the format it is in.
+  snprintf(file_name, sizeof(file_name), "%s%s", name, IDX_TAIL);
+  idx_fd = openat(hist_fd, file_name, O_RDONLY);
+  if ((idx_fd != -1) != (config.logged != 0)) {
+    res = 0;
+    goto out;
+  }
+  res = fstat(hist_fd, &hist_st) == -1 ? -errno : plan_history(hist_fd, name, &plan, &count);
+  if (res == 0) {
+    choose_versions(plan, count);
+  }
+  for (size_t i = 0; i < count; i += 1) {
+    kept += plan[i].keep;
+  }
+  if (res < 0 || kept == count) {
+    goto out;
+  }
+
+  snprintf(file_name, sizeof(file_name), "%s%s", name, LOG_TAIL);
+  if (idx_fd != -1 && (log_fd = openat(hist_fd, file_name, O_RDONLY)) == -1) {
+    res = -errno;
+    goto out;
+  }
+  depth = malloc(count * sizeof(*depth));
+  if (depth == NULL) {
+    res = -ENOMEM;
+    goto out;
+  }
+  mkdirat(storage_fd, STORE_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  mkdirat(storage_fd, COMPACT_FOLDER, S_IRWXU | S_IRGRP | S_IROTH);
+  do {
+    snprintf(build_path, PATH_MAX, "%s/%ld.%lu", COMPACT_FOLDER, (long) getpid(), build_count);
+    build_count += 1;
+    res = mkdirat(storage_fd, build_path, S_IRWXU | S_IRGRP | S_IROTH) == -1 ? -errno : 0;
+  } while (res == -EEXIST);
+  if (res < 0) {
+    goto out;
+  }
+  new_fd = openat(storage_fd, build_path, O_RDONLY | O_DIRECTORY);
+  if (new_fd == -1) {
+    res = -errno;
+  }
+
+  for (size_t i = 0; res == 0 && i < count; i += 1) {
+    int as_is = 0;
+
+    depth[i] = -1;
+    if (!plan[i].keep) {
+      continue;
+    }
+    if (compactor_stopping()) {
+      res = -EINTR;
+      break;
+    }
+    if (log_fd != -1) {
+      // A record depends on the one before it in the log.
+      struct log_entry entry;
+      res = read_log_entry(idx_fd, i, &entry);
+      if (res == 0 && (entry.kind == VERSION_KEYFRAME || (i > 0 && prev == i - 1))) {
+        res      = copy_record(new_fd, name, log_fd, &entry);
+        depth[i] = entry.kind == VERSION_KEYFRAME ? 0 : depth[prev] + 1;
+        as_is    = 1;
+      }
+      if (res == 0 && as_is) {
+        res = restore_time(new_fd, name, entry.version, entry.time);
+      }
+    } else {
+      as_is = link_version(hist_fd, new_fd, name, plan, depth, i);
+      res   = as_is < 0 ? as_is : 0;
+    }
+    if (res == 0 && !as_is) {
+      res = rewrite_version(hist_fd, new_fd, name, plan, depth, i, prev);
+    }
+    prev = i;
+  }
+
+  // The swap is made only if the history is still the one that was pruned.
+  pthread_mutex_lock(&store_lock);
+  if (snprintf(hist_path, PATH_MAX, "%s%s%s", VERS_FOLDER, path, HIST_TAIL) >= PATH_MAX &&
+      res == 0) {
+    res = -ENAMETOOLONG;
+  }
+  if (res == 0 && (fstatat(storage_fd, relative_path(hist_path), &now_st, 0) == -1 ||
+                   now_st.st_ino != hist_st.st_ino || now_st.st_dev != hist_st.st_dev)) {
+    res = -ESTALE;
+  }
+  if (res == 0) {
+    res = catch_up(hist_fd, new_fd, name, plan, count, log_fd);
+  }
+  // Only the swap failing says the storage cannot exchange folders; the same
+  // errors from anything before it are about this history alone.
+#ifdef RENAME_EXCHANGE
+  if (res == 0 && renameat2(storage_fd, build_path, storage_fd, relative_path(hist_path),
+                            RENAME_EXCHANGE) == -1) {
+    res = -errno;
+    if (errno == EINVAL || errno == ENOSYS || errno == ENOTSUP) {
+      no_exchange();
+    }
+  }
+#else
+  if (res == 0) {
+    res = -ENOTSUP;
+    no_exchange();
+  }
+#endif
+  // Either way, what is in build_path now goes: the old history or the new.
+  if (new_fd != -1) {
+    trash_folder(build_path);
+  }
+  pthread_mutex_unlock(&store_lock);
+
+out:
+  if (new_fd != -1) {
+    close(new_fd);
+  }
+  if (log_fd != -1) {
+    close(log_fd);
+  }
+  if (idx_fd != -1) {
+    close(idx_fd);
+  }
+  close(hist_fd);
+  free(depth);
+  free(plan);
+  return res == -ESTALE || res == -EINTR ? 0 : res;
+}
+
+// Prune every history in the folder at path within the mount, and in the
+// folders below it.
+static void prune_folder (const char* path) {
+  char           dir_path[PATH_MAX];
+  char           sub_path[PATH_MAX];
+  size_t         tail_len = strlen(HIST_TAIL);
+  int            fd;
+  DIR*           dp;
+  struct dirent* de;
+
+  snprintf(dir_path, PATH_MAX, "%s%s", VERS_FOLDER, path);
+  fd = openat(storage_fd, relative_path(dir_path), O_RDONLY | O_DIRECTORY);
+  dp = fd == -1 ? NULL : fdopendir(fd);
+  if (dp == NULL) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  while (exchange_works && !compactor_stopping() && (de = readdir(dp)) != NULL) {
+    size_t      len = strlen(de->d_name);
+    struct stat st;
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    // Not every file system fills in d_type.
+    if (de->d_type != DT_DIR &&
+        (de->d_type != DT_UNKNOWN || fstatat(fd, de->d_name, &st, 0) == -1 ||
+         !S_ISDIR(st.st_mode))) {
+      continue;
+    }
+    if (len > tail_len && strcmp(de->d_name + len - tail_len, HIST_TAIL) == 0) {
+      snprintf(sub_path, PATH_MAX, "%s/%.*s", path, (int) (len - tail_len), de->d_name);
+      int res = compact_history(sub_path);
+      if (res < 0) {
+        fprintf(stderr, "ERROR: could not prune the history of %s: %s\n",
+                sub_path, strerror(-res));
+      }
+    } else {
+      snprintf(sub_path, PATH_MAX, "%s/%s", path, de->d_name);
+      prune_folder(sub_path);
+    }
+  }
+  closedir(dp);
+}
+
+static void* compact_worker (void* arg) {
+  int            fd;
+  DIR*           dp;
+  struct dirent* de;
+
+  (void) arg;
+#ifdef linux
+  // Pruning can wait for whatever else wants the CPU.
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+  // Whatever a compactor that was stopped part way left behind is thrown out.
+  fd = openat(storage_fd, COMPACT_FOLDER, O_RDONLY | O_DIRECTORY);
+  dp = fd == -1 ? NULL : fdopendir(fd);
+  if (dp == NULL && fd != -1) {
+    close(fd);
+  }
+  while (dp != NULL && (de = readdir(dp)) != NULL) {
+    char build_path[PATH_MAX];
+    if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+      snprintf(build_path, PATH_MAX, "%s/%s", COMPACT_FOLDER, de->d_name);
+      pthread_mutex_lock(&store_lock);
+      trash_folder(build_path);
+      pthread_mutex_unlock(&store_lock);
+    }
+  }
+  if (dp != NULL) {
+    closedir(dp);
+  }
+
+  pthread_mutex_lock(&compact_lock);
+  while (!compact_stop) {
+    struct timespec until;
+
+    pthread_mutex_unlock(&compact_lock);
+    prune_folder("");
+    pthread_mutex_lock(&compact_lock);
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += config.prune_interval > 0 ? config.prune_interval : 1;
+    while (!compact_stop &&
+           pthread_cond_timedwait(&compact_wake, &compact_lock, &until) != ETIMEDOUT)
+      ;
+  }
+  pthread_mutex_unlock(&compact_lock);
+  return NULL;
+}
+
+/* Storing a version (compressing it, cutting it into chunks, rebuilding a
+   keyframe) is left to a thread of its own, so that close() and write() only
+   wait for the changed bytes to be copied out of the live file.  That copy, a
+   snap_job, is made at the moment the version is due, but not under
+   vers_lock, so that one big close() does not hold up every other file; the
+   worker then stores the jobs in the order they were made.  A keyframe or
+   chunk list needs the whole file, which the worker rebuilds from the version
+   before plus the job's extents, without going back to the live file.  Where
+   reflinks work, a job is instead a clone of the whole file, which costs no
+   copying at all and can be stored just as the live file would be.
+
+   The jobs waiting hold at most config.snap_queue bytes between them: a
+   snapshot that would go over waits for room, and one that is bigger than
+   that on its own is stored straight from the live file once the queue ahead
+   of it is empty. */
+struct snap_job {
+  struct snap_job* next;
+  char*            path;
+  off_t            keep;
+  off_t            size;
+  struct extent*   extents;
+  int              count;
+  uint8_t*         data;      // the extents' contents, one after the other
+  size_t           bytes;
+  int              clone_fd;  // or a clone of the whole file, if not -1
+  int              canceled;  // the file was removed before this was stored
+};
+
+static pthread_mutex_t  snap_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   snap_ready   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   snap_room    = PTHREAD_COND_INITIALIZER;
+static struct snap_job* snap_head    = NULL;
+static struct snap_job* snap_tail    = NULL;
+static struct snap_job* snap_current = NULL; // the job being stored
+static size_t           snap_held    = 0;    // held by jobs not yet stored
+static uint64_t         snap_queued  = 0;    // jobs ever queued
+static uint64_t         snap_stored  = 0;    // jobs ever finished
+static int              snap_running = 0;
+static int              snap_stop    = 0;
+static pthread_t        snap_thread;
+
+static void free_job (struct snap_job* job) {
+  free(job->path);
+  free(job->extents);
+  free(job->data);
+  if (job->clone_fd >= 0) {
+    close(job->clone_fd);
+  }
+  free(job);
+}
+
+// Store the job as the next version of its file.  Called with store_lock held.
+static int store_capture (const struct snap_job* job) {
+  struct vers_counter* c;
+  const char*          name = base_name(job->path);
+  char                 snap_path[PATH_MAX];
+  uint64_t             v;
+  int                  delta;
+  int                  scratch;
+  off_t                pos = 0;
+  int                  hist_fd;
+  int                  res;
+
+  if (job->clone_fd >= 0) {
+    return store_version(job->path, job->clone_fd, job->keep, job->extents, job->count);
+  }
+  hist_fd = open_hist_dir(job->path, 1);
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  c = get_counter(job->path, hist_fd);
+  if (c == NULL) {
+    close(hist_fd);
+    return -ENOMEM;
+  }
+
+  v = c->next_version;
+  snprintf(snap_path, PATH_MAX, "%s%s%s/%s,%" PRIu64,
+           VERS_FOLDER, job->path, HIST_TAIL, name, v);
+  delta = !config.chunked && v > 0 && config.keyframe > 1 && v % config.keyframe != 0 &&
+          !log_empty(hist_fd, name);
+
+  // A delta only reads back what may have changed, so the extents are laid
+  // out where they belong with nothing under them; anything else is built on
+  // the version before.
+  scratch = open_scratch();
+  res     = scratch < 0 ? scratch : 0;
+  if (res == 0 && !delta && job->keep > 0 && v > 0) {
+    res = materialize(hist_fd, name, v - 1, scratch);
+  }
+  if (res == 0 && (ftruncate(scratch, job->keep) == -1 ||
+                   ftruncate(scratch, job->size) == -1)) {
+    res = -errno;
+  }
+  for (int i = 0; res == 0 && i < job->count; i += 1) {
+    ssize_t length = job->extents[i].length;
+    if (pwrite(scratch, job->data + pos, length, job->extents[i].offset) != length) {
+      res = -EIO;
+    }
+    pos += length;
+  }
+  if (res == 0 && delta) {
+    res = store_changes(hist_fd, name, v, job->keep, job->size,
+                        job->extents, job->count, scratch);
+    strncat(snap_path, ".delta", PATH_MAX - strlen(snap_path) - 1);
+  } else if (res == 0 && config.chunked) {
+    res = store_chunks(hist_fd, name, v, job->size, scratch);
+  } else if (res == 0) {
+    res = store_keyframe(hist_fd, name, v, job->size, scratch);
+  }
+  if (scratch >= 0) {
+    close(scratch);
+  }
+  if (res == 0) {
+    res = commit_version(c, hist_fd, name, v);
+  }
+  if (res == 0 && !config.chunked) {
+    queue_compress(relative_path(snap_path));
+  }
+
+  close(hist_fd);
+  return res;
+}
+
+static void* snap_worker (void* arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&snap_lock);
+  for (;;) {
+    // Asked to stop, the worker still stores whatever is queued first.
+    if (snap_head == NULL) {
+      if (snap_stop) {
+        break;
+      }
+      pthread_cond_wait(&snap_ready, &snap_lock);
+      continue;
+    }
+    struct snap_job* job = snap_head;
+    snap_head = job->next;
+    if (snap_head == NULL) {
+      snap_tail = NULL;
+    }
+    snap_current = job;
+    pthread_mutex_unlock(&snap_lock);
+
+    pthread_mutex_lock(&store_lock);
+    int res = job->canceled ? 0 : store_capture(job);
+    pthread_mutex_unlock(&store_lock);
+    if (res < 0) {
+      fprintf(stderr, "ERROR: could not store a version of %s: %s\n",
+              job->path, strerror(-res));
+    }
+
+    pthread_mutex_lock(&snap_lock);
+    snap_current = NULL;
+    snap_held   -= job->bytes;
+    snap_stored += 1;
+    pthread_cond_broadcast(&snap_room);
+    free_job(job);
+  }
+  pthread_mutex_unlock(&snap_lock);
+  return NULL;
+}
+
+// Hand a job to the worker, once there is room for it in the queue.
+static void queue_snapshot (struct snap_job* job) {
+  pthread_mutex_lock(&snap_lock);
+  while (snap_held > 0 && snap_held + job->bytes > config.snap_queue) {
+    pthread_cond_wait(&snap_room, &snap_lock);
+  }
+  job->next = NULL;
+  if (snap_tail == NULL) {
+    snap_head = job;
+  } else {
+    snap_tail->next = job;
+  }
+  snap_tail    = job;
+  snap_held   += job->bytes;
+  snap_queued += 1;
+  pthread_cond_signal(&snap_ready);
+  pthread_mutex_unlock(&snap_lock);
+}
+
+// Wait until every job queued so far has been stored.
+static void snapshot_barrier (void) {
+  pthread_mutex_lock(&snap_lock);
+  uint64_t target = snap_queued;
+  while (snap_stored < target) {
+    pthread_cond_wait(&snap_room, &snap_lock);
+  }
+  pthread_mutex_unlock(&snap_lock);
+}
+
+// Have the worker skip the jobs of the file at path, which is being removed.
+// Called with store_lock held, so that the job the worker may be about to
+// store is skipped too.
+static void cancel_snapshots (const char* path) {
+  pthread_mutex_lock(&snap_lock);
+  for (struct snap_job* job = snap_head; job != NULL; job = job->next) {
+    if (strcmp(job->path, path) == 0) {
+      job->canceled = 1;
+    }
+  }
+  if (snap_current != NULL && strcmp(snap_current->path, path) == 0) {
+    snap_current->canceled = 1;
+  }
+  pthread_mutex_unlock(&snap_lock);
+}
+
+// Note that the file at path was just created, unless it goes on with a
+// history left by an earlier file of the same name.  Called with store_lock
+// held.
+static void note_created (const char* path) {
+  int                  hist_fd = open_hist_dir(path, 0);
+  struct vers_counter* c       = get_counter(path, hist_fd < 0 ? -1 : hist_fd);
+
+  pthread_mutex_lock(&counter_lock);
+  if (c != NULL && c->next_version == 0) {
+    c->fresh = 1;
+  }
+  pthread_mutex_unlock(&counter_lock);
+  if (hist_fd >= 0) {
+    close(hist_fd);
+  }
+}
+
+/* Programs that save a file by writing a temporary one and renaming it over
+   the original would otherwise leave a history behind under every temporary
+   name, which no file ever goes on with and which pruning, since it keeps a
+   history's newest version, never frees.  So when a file created by this
+   mount replaces another, its history and the versions of it still queued go
+   to the trash; what it holds is kept as the next version of the file it
+   replaced.  Called with store_lock held. */
+static int forget_fresh_history (const char* path) {
+  struct vers_counter* c;
+  int                  fresh;
+
+  pthread_mutex_lock(&counter_lock);
+  c     = load_counters() == 0 ? find_counter(path, 0) : NULL;
+  fresh = c != NULL && c->fresh;
+  pthread_mutex_unlock(&counter_lock);
+  if (!fresh) {
+    return 0;
+  }
+  cancel_snapshots(path);
+  return remove_history(path);
+}
+
+static struct snap_job* new_job (const char* path, off_t keep, off_t size,
+                                 const struct extent* extents, int count) {
+  struct snap_job* job = calloc(1, sizeof(*job));
+
+  if (job == NULL) {
+    return NULL;
+  }
+  job->clone_fd = -1;
+  job->path     = strdup(path);
+  job->extents  = malloc((count > 0 ? count : 1) * sizeof(*extents));
+  if (job->path == NULL || job->extents == NULL) {
+    free_job(job);
+    return NULL;
+  }
+  job->keep  = keep < size ? keep : size;
+  job->size  = size;
+  job->count = count;
+  memcpy(job->extents, extents, count * sizeof(*extents));
+  return job;
+}
+
+// Make a job of a reflinked clone of the live file fd, if reflinks work.
+static struct snap_job* capture_clone (const char* path, int fd, off_t keep, off_t size,
+                                       const struct extent* extents, int count) {
+  struct snap_job* job;
+  int              clone_fd;
+
+  if (!__atomic_load_n(&reflinks_work, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  clone_fd = open_scratch();
+  if (clone_fd < 0) {
+    return NULL;
+  }
+  if (clone_range(clone_fd, 0, fd, 0, size) < 0 ||
+      (job = new_job(path, keep, size, extents, count)) == NULL) {
+    close(clone_fd);
+    return NULL;
+  }
+  job->clone_fd = clone_fd;
+  return job;
+}
+
+// Copy what changed in the live file fd out into a job.  The extents must lie
+// within size bytes.
+static struct snap_job* capture (const char* path, int fd, off_t keep, off_t size,
+                                 const struct extent* extents, int count) {
+  struct snap_job* job = new_job(path, keep, size, extents, count);
+  size_t           pos = 0;
+
+  if (job == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < count; i += 1) {
+    job->bytes += extents[i].length;
+  }
+  job->data = malloc(job->bytes > 0 ? job->bytes : 1);
+  if (job->data == NULL) {
+    free_job(job);
+    return NULL;
+  }
+
+  for (int i = 0; i < count; i += 1) {
+    off_t length = extents[i].length;
+    off_t offset = extents[i].offset;
+    while (length > 0) {
+      ssize_t n = pread(fd, job->data + pos, length, offset);
+      if (n <= 0) {
+        free_job(job);
+        return NULL;
+      }
+      pos    += n;
+      offset += n;
+      length -= n;
+    }
+  }
+  return job;
+}
+
+/* Rather than one version per write() call, versfs keeps track of what has
+   changed in each file and makes a single version out of all of it when the
+   last handle on the file is released.  A vers_file exists for every file that
+   is open or that has changes not yet stored in a version; all of them are on
+   one list, and all of this state is guarded by vers_lock.  What has been
+   written to the file (dirty, keep and the extents) is also guarded by the
+   file's own lock, which is all that write() takes, so that writes to
+   different files do not wait for each other.  While a version of
+   a file is being made, vers_lock is let go and the file is marked snapping;
+   only one version of a file is made at a time, and a file is not removed or
+   renamed under one being made. */
+struct vers_file {
+  struct vers_file* next;
+  char*             path;
+  pthread_mutex_t   lock;         // guards what is written, taken after vers_lock
+  int               opens;        // handles open on the file
+  int               dirty;        // changed since its last version
+  int               removed;      // unlinked, so no more versions
+  int               whole;        // the extents do not say what changed since the last version
+  off_t             keep;         // how much of the last version is intact
+  off_t             dirty_bytes;  // bytes written since the last version
+  time_t            last_snap;    // when the last version was stored
+  int               snapping;     // a version of it is being made
+  int               snap_again;   // and another is due once that is done
+  struct extent*    extents;      // what was written, sorted and disjoint
+  int               count;
+  int               capacity;
+};
+
+/* What fi->fh points at for an open file. */
+struct vers_handle {
+  int               fd;
+  int               writeonly;  // so versions are read through a descriptor of their own
+  struct vers_file* file;       // NULL for a version under /.history
+  off_t             base;       // where such a version starts in fd
+  off_t             length;     // and how long it is
+};
+
+static struct vers_file* files     = NULL;
+static pthread_cond_t    snap_idle = PTHREAD_COND_INITIALIZER; // a file stopped snapping
+
+static struct vers_file* find_file (const char* path) {
+  for (struct vers_file* file = files; file != NULL; file = file->next) {
+    if (!file->removed && strcmp(file->path, path) == 0) {
+      return file;
+    }
+  }
+  return NULL;
+}
+
+// Find the file at path, adding it to the list if it is not there yet.
+static struct vers_file* get_file (const char* path) {
+  struct vers_file* file = find_file(path);
+
+  if (file == NULL) {
+    file = calloc(1, sizeof(*file));
+    if (file == NULL) {
+      return NULL;
+    }
+    file->path = strdup(path);
+    if (file->path == NULL) {
+      free(file);
+      return NULL;
+    }
+    pthread_mutex_init(&file->lock, NULL);
+    file->next = files;
+    files      = file;
+
+    // A file without versions has its first one made of all of it, and the
+    // interval policy needs to know when the last version was stored.
+    pthread_mutex_lock(&counter_lock);
+    file->whole = 1;
+    if (load_counters() == 0) {
+      struct vers_counter* c = find_counter(path, 0);
+      if (c != NULL) {
+        file->whole     = c->next_version == 0;
+        file->last_snap = c->last_snap;
+      }
+    }
+    pthread_mutex_unlock(&counter_lock);
+  }
+  return file;
+}
+
+// Drop the file from the list once nothing refers to it any more.
+static void put_file (struct vers_file* file) {
+  if (file->opens > 0 || file->dirty || file->snapping) {
+    return;
+  }
+  for (struct vers_file** link = &files; *link != NULL; link = &(*link)->next) {
+    if (*link == file) {
+      *link = file->next;
+      break;
+    }
+  }
+  pthread_mutex_destroy(&file->lock);
+  free(file->extents);
+  free(file->path);
+  free(file);
+}
+
+// Note that the file is about to change, given its size beforehand.
+static void mark_dirty (struct vers_file* file, off_t size) {
+  if (!file->dirty) {
+    file->dirty       = 1;
+    file->keep        = size;
+    file->dirty_bytes = 0;
+    file->count       = 0;
+  }
+}
+
+// Add a written range to the file's extents, merging it with any that it
+// overlaps or touches.
+static int add_extent (struct vers_file* file, off_t offset, off_t length) {
+  off_t end   = offset + length;
+  int   first = 0;
+  int   last;
+
+  while (first < file->count &&
+         file->extents[first].offset + file->extents[first].length < offset) {
+    first += 1;
+  }
+  last = first;
+  while (last < file->count && file->extents[last].offset <= end) {
+    off_t last_end = file->extents[last].offset + file->extents[last].length;
+    if (file->extents[last].offset < offset) {
+      offset = file->extents[last].offset;
+    }
+    if (last_end > end) {
+      end = last_end;
+    }
+    last += 1;
+  }
+
+  if (first == last) {
+    // Nothing to merge with, so make room for a new extent.
+    if (file->count == file->capacity) {
+      int            capacity = file->capacity == 0 ? 8 : 2 * file->capacity;
+      struct extent* extents  = realloc(file->extents, capacity * sizeof(*extents));
+      if (extents == NULL) {
+        return -ENOMEM;
+      }
+      file->extents  = extents;
+      file->capacity = capacity;
+    }
+    memmove(file->extents + first + 1, file->extents + first,
+            (file->count - first) * sizeof(*file->extents));
+    file->count += 1;
+  } else if (last - first > 1) {
+    memmove(file->extents + first + 1, file->extents + last,
+            (file->count - last) * sizeof(*file->extents));
+    file->count -= last - first - 1;
+  }
+  file->extents[first].offset = offset;
+  file->extents[first].length = end - offset;
+  return 0;
+}
+
+// The file was cut down to size bytes: nothing past it survives, whether from
+// the last version or written since.
+static void clip_extents (struct vers_file* file, off_t size) {
+  if (size < file->keep) {
+    file->keep = size;
+  }
+  while (file->count > 0 && file->extents[file->count - 1].offset >= size) {
+    file->count -= 1;
+  }
+  if (file->count > 0) {
+    struct extent* tail = &file->extents[file->count - 1];
+    if (tail->offset + tail->length > size) {
+      tail->length = size - tail->offset;
+    }
+  }
+}
+
+// Store the changes taken from a file as a new version of path, reading them
+// from fd: copied out for the snapshot worker if it is running and they fit,
+// or else stored here and now.  Called without vers_lock.
+static int snapshot_changes (const char* path, int fd, off_t keep,
+                             const struct extent* extents, int count, int whole) {
+  struct extent    all;
+  struct snap_job* job   = NULL;
+  struct stat      st;
+  off_t            bytes = 0;
+  int              res   = 0;
+
+  if (fstat(fd, &st) == -1) {
+    return -errno;
+  }
+  if (whole) {
+    all.offset = 0;
+    all.length = st.st_size;
+    extents    = &all;
+    count      = st.st_size > 0;
+    keep       = 0;
+  }
+  for (int i = 0; i < count; i += 1) {
+    bytes += extents[i].length;
+  }
+
+  if (snap_running && st.st_size > 0) {
+    job = capture_clone(path, fd, keep, st.st_size, extents, count);
+  }
+  if (job == NULL && snap_running && bytes <= (off_t) config.snap_queue) {
+    job = capture(path, fd, keep, st.st_size, extents, count);
+  }
+  if (job != NULL) {
+    queue_snapshot(job);
+  } else {
+    // Stored here and now, after the versions queued before it.
+    snapshot_barrier();
+    pthread_mutex_lock(&store_lock);
+    res = store_version(path, fd, keep, extents, count);
+    pthread_mutex_unlock(&store_lock);
+  }
+  return res;
+}
+
+// Make the file's pending changes a new version, reading them from fd.  Called
+// with vers_lock held, which is let go while the version is made; whatever is
+// written to the file meanwhile is left for the next one.  If a version of
+// the file is being made already, that thread makes this one too.
+static int snapshot_file (struct vers_file* file, int fd) {
+  int res = 0;
+
+  if (file->removed) {
+    return 0;
+  }
+  if (file->snapping) {
+    file->snap_again = 1;
+    return 0;
+  }
+
+  file->snapping = 1;
+  do {
+    char*          path;
+    struct extent* extents;
+    off_t          keep;
+    int            count;
+    int            whole;
+
+    file->snap_again = 0;
+    pthread_mutex_lock(&file->lock);
+    if (!file->dirty) {
+      pthread_mutex_unlock(&file->lock);
+      break;
+    }
+    path    = strdup(file->path);
+    extents = malloc((file->count > 0 ? file->count : 1) * sizeof(*extents));
+    keep    = file->keep;
+    count   = file->count;
+    whole   = file->whole;
+    if (path == NULL || extents == NULL) {
+      pthread_mutex_unlock(&file->lock);
+      free(path);
+      free(extents);
+      res = -ENOMEM;
+      break;
+    }
+    memcpy(extents, file->extents, count * sizeof(*extents));
+    file->dirty = 0;
+    file->whole = 0;
+    file->count = 0;
+    pthread_mutex_unlock(&file->lock);
+
+    pthread_mutex_unlock(&vers_lock);
+    res = snapshot_changes(path, fd, keep, extents, count, whole);
+    pthread_mutex_lock(&vers_lock);
+
+    if (res == 0) {
+      file->last_snap = time(NULL);
+    } else {
+      // The changes taken may have been written over since, so the next
+      // version is compared with the last one as a whole.
+      pthread_mutex_lock(&file->lock);
+      if (!file->dirty) {
+        mark_dirty(file, 0);
+      }
+      file->whole = 1;
+      pthread_mutex_unlock(&file->lock);
+    }
+    free(path);
+    free(extents);
+  } while (res == 0 && file->snap_again && !file->removed);
+  file->snapping = 0;
+  pthread_cond_broadcast(&snap_idle);
+  return res;
+}
+
+// Whether a version of the file at path is being made.
+static int snapping (const char* path) {
+  struct vers_file* file = find_file(path);
+  return file != NULL && file->snapping;
+}
+
+// Wait until no version is being made of the file at path or, unless it is
+// NULL, at other.  Called with vers_lock held.
+static void wait_for_snapshots (const char* path, const char* other) {
+  while (snapping(path) || (other != NULL && snapping(other))) {
+    pthread_cond_wait(&snap_idle, &vers_lock);
+  }
+}
+
+// Whether the interval policy lets the file have a new version yet.
+static int snapshot_due (struct vers_file* file) {
+  return config.snap_interval == 0 ||
+         time(NULL) - file->last_snap >= (time_t) config.snap_interval;
+}
+
+/* Every stored version can be read back through the mount, under
+   /.history: /.history/d/foo.txt is a read-only folder with one file per
+   version of d/foo.txt, named by its number, and /.history/d is a folder of
+   whatever under d has a history.  The tree mirrors .vers, so the history of a
+   file that was renamed away is there too.  A version stored whole is read
+   where it lies; any other is rebuilt when it is opened.  /.history is not
+   listed in the root folder, so that copying the mount does not copy every
+   version with it. */
+#define HISTORY_DIR "/.history"
+
+// The path whose history the path inside /.history shows, or NULL if path is
+// not inside /.history.
+static const char* history_target (const char* path) {
+  size_t n = strlen(HISTORY_DIR);
+
+  if (strncmp(path, HISTORY_DIR, n) != 0 || (path[n] != '\0' && path[n] != '/')) {
+    return NULL;
+  }
+  return path[n] == '\0' ? "/" : path + n;
+}
+
+// Whether the operation on path would change something that cannot be: a
+// version under /.history, or anything in a point-in-time mount.
+static int read_only (const char* path) {
+  return config.as_of != 0 || history_target(path) != NULL;
+}
+
+// If target names a version of a file, "<file>/<version>", split it into the
+// file's path (in file, PATH_MAX bytes) and the version.
+static int parse_version (const char* target, char* file, uint64_t* v) {
+  const char* slash = strrchr(target, '/');
+  char*       end;
+  int         hist_fd;
+
+  if (slash == NULL || slash == target || slash[1] < '0' || slash[1] > '9') {
+    return 0;
+  }
+  *v = strtoull(slash + 1, &end, 10);
+  if (*end != '\0' || (size_t) (slash - target) >= PATH_MAX) {
+    return 0;
+  }
+  memcpy(file, target, slash - target);
+  file[slash - target] = '\0';
+
+  hist_fd = open_hist_dir(file, 0);
+  if (hist_fd < 0) {
+    return 0;
+  }
+  close(hist_fd);
+  return 1;
+}
+
+/* With -o as_of=<time>, the whole mount is read-only and shows each file as
+   it was at that time: the newest version stored at or before it.  Both the
+   log index and the .when list are in time order, so the version is found by
+   binary search on the file's own history, and nothing is read up front. */
+
+// Find the version of the file at path that a point-in-time mount shows.
+static int as_of_version (const char* path, uint64_t* v) {
+  int hist_fd = open_hist_dir(path, 0);
+  int res;
+
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  res = version_at(hist_fd, base_name(path), config.as_of, v);
+  close(hist_fd);
+  return res;
+}
+
+// Open version v of the file at path for reading: *fd is where it starts at
+// *base and runs for *length bytes.
+static int open_history_version (const char* path, uint64_t v, int* fd,
+                                 off_t* base, off_t* length) {
+  const char*      name = base_name(path);
+  char             snap_name[NAME_MAX + 1];
+  struct log_entry entry;
+  struct stat      st;
+  int              hist_fd = open_hist_dir(path, 0);
+  int              res     = 0;
+
+  if (hist_fd < 0) {
+    return hist_fd;
+  }
+  *base = 0;
+  *fd   = -1;
+
+  // A keyframe in a log, or a whole version on its own, is read where it is.
+  snprintf(snap_name, sizeof(snap_name), "%s%s", name, IDX_TAIL);
+  int idx_fd = openat(hist_fd, snap_name, O_RDONLY);
+  // A version from before the store was switched to a log is on its own.
+  if (idx_fd != -1 && find_log_entry(idx_fd, v, &entry) < 0) {
+    close(idx_fd);
+    idx_fd = -1;
+  }
+  if (idx_fd != -1) {
+    if (entry.kind == VERSION_KEYFRAME) {
+      snprintf(snap_name, sizeof(snap_name), "%s%s", name, LOG_TAIL);
+      *fd     = openat(hist_fd, snap_name, O_RDONLY);
+      *base   = entry.offset;
+      *length = entry.length;
+      res     = *fd == -1 ? -errno : 0;
+    }
+    close(idx_fd);
+  } else {
+    snprintf(snap_name, sizeof(snap_name), "%s,%" PRIu64, name, v);
+    *fd = openat(hist_fd, snap_name, O_RDONLY);
+    if (*fd != -1 && fstat(*fd, &st) == 0) {
+      *length = st.st_size;
+    } else if (*fd != -1) {
+      res = -errno;
+    }
+  }
+
+  // Anything else is rebuilt in a scratch file.
+  if (res == 0 && *fd == -1) {
+    *fd = open_scratch();
+    res = *fd < 0 ? *fd : materialize(hist_fd, name, v, *fd);
+    if (res == 0) {
+      res = fstat(*fd, &st) == -1 ? -errno : 0;
+      *length = st.st_size;
+    }
+  }
+  if (res < 0 && *fd >= 0) {
+    close(*fd);
+  }
+  close(hist_fd);
+  return res;
+}
+
+static int history_getattr (const char* target, struct stat* st) {
+  char     file[PATH_MAX];
+  char     dir_path[PATH_MAX];
+  uint64_t v;
+  int      hist_fd;
+  int      res;
+
+  if (!config.as_of && parse_version(target, file, &v)) {
+    hist_fd = open_hist_dir(file, 0);
+    if (hist_fd < 0) {
+      return hist_fd;
+    }
+    res = stat_version(hist_fd, base_name(file), v, st);
+    close(hist_fd);
+    return res;
+  }
+
+  // A file with a history, or a folder that has files with one.  In a
+  // point-in-time mount the file is itself, as it was then.
+  hist_fd = strcmp(target, "/") == 0 ? -ENOENT : open_hist_dir(target, 0);
+  if (hist_fd >= 0 && config.as_of) {
+    res = version_at(hist_fd, base_name(target), config.as_of, &v);
+    if (res == 0) {
+      res = stat_version(hist_fd, base_name(target), v, st);
+    }
+    close(hist_fd);
+    return res;
+  }
+  if (hist_fd >= 0) {
+    res = fstat(hist_fd, st) == -1 ? -errno : 0;
+    close(hist_fd);
+  } else {
+    snprintf(dir_path, PATH_MAX, "%s%s", VERS_FOLDER, strcmp(target, "/") == 0 ? "" : target);
+    res = fstatat(storage_fd, relative_path(dir_path), st, 0) == -1 ? -errno : 0;
+    if (res == -ENOENT && strcmp(target, "/") == 0) {
+      res = fstat(storage_fd, st) == -1 ? -errno : 0;
+    }
+    if (res == 0 && !S_ISDIR(st->st_mode)) {
+      res = -ENOENT;
+    }
+  }
+  if (res == 0) {
+    st->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+  }
+  return res;
+}
+
+static int history_readdir (const char* target, void* buf, fuse_fill_dir_t filler) {
+  char           dir_path[PATH_MAX];
+  char           entry_name[NAME_MAX + 1];
+  const char*    name = base_name(target);
+  size_t         tail_len = strlen(HIST_TAIL);
+  int            is_root  = strcmp(target, "/") == 0;
+  int            versions = 0;
+  int            fd;
+  DIR*           dp;
+  struct dirent* de;
+
+  fd = is_root || config.as_of ? -ENOENT : open_hist_dir(target, 0);
+  if (fd >= 0) {
+    versions = 1;
+  } else {
+    snprintf(dir_path, PATH_MAX, "%s%s", VERS_FOLDER, is_root ? "" : target);
+    fd = openat(storage_fd, relative_path(dir_path), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+      return is_root && errno == ENOENT ? 0 : -errno;
+    }
+  }
+  dp = fdopendir(fd);
+  if (dp == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  if (versions) {
+    uint64_t* list;
+    size_t    count;
+    int       res = list_versions(fd, name, &list, &count);
+    for (size_t i = 0; res == 0 && i < count; i += 1) {
+      snprintf(entry_name, sizeof(entry_name), "%" PRIu64, list[i]);
+      if (filler(buf, entry_name, NULL, 0)) {
+        break;
+      }
+    }
+    free(list);
+    closedir(dp);
+    return res;
+  }
+
+  while ((de = readdir(dp)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 ||
+        strcmp(de->d_name, "..") == 0) {
+      continue;
+    } else if (len > tail_len && strcmp(de->d_name + len - tail_len, HIST_TAIL) == 0) {
+      snprintf(entry_name, sizeof(entry_name), "%.*s", (int) (len - tail_len), de->d_name);
+      // A point-in-time mount leaves out files that had no version yet.
+      if (config.as_of) {
+        uint64_t v;
+        int      hist_fd = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY);
+        int      res     = hist_fd == -1 ? -errno :
+                           version_at(hist_fd, entry_name, config.as_of, &v);
+        if (hist_fd != -1) {
+          close(hist_fd);
+        }
+        if (res < 0) {
+          continue;
+        }
+      }
+    } else {
+      snprintf(entry_name, sizeof(entry_name), "%s", de->d_name);
+    }
+    if (filler(buf, entry_name, NULL, 0)) {
+      break;
+    }
+  }
+  closedir(dp);
+  return 0;
+}
 
 
 static int vers_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
-	
-	path = prepend_storage_dir(storage_path, path);
-	res = lstat(path, stbuf);
+	const char *target = config.as_of ? path : history_target(path);
+
+	if (target != NULL) {
+		pthread_mutex_lock(&store_lock);
+		res = history_getattr(target, stbuf);
+		pthread_mutex_unlock(&store_lock);
+		return res;
+	}
+
+	res = fstatat(storage_fd, relative_path(path), stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -63,9 +3426,20 @@ static int vers_getattr(const char *path, struct stat *stbuf)
 static int vers_access(const char *path, int mask)
 {
 	int res;
+	const char *target = config.as_of ? path : history_target(path);
 
-	path = prepend_storage_dir(storage_path, path);
-	res = access(path, mask);
+	if (target != NULL) {
+		struct stat st;
+
+		pthread_mutex_lock(&store_lock);
+		res = history_getattr(target, &st);
+		pthread_mutex_unlock(&store_lock);
+		if (res == 0 && (mask & W_OK))
+			res = -EROFS;
+		return res;
+	}
+
+	res = faccessat(storage_fd, relative_path(path), mask, 0);
 	if (res == -1)
 		return -errno;
 
@@ -76,8 +3450,7 @@ static int vers_readlink(const char *path, char *buf, size_t size)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = readlink(path, buf, size - 1);
+	res = readlinkat(storage_fd, relative_path(path), buf, size - 1);
 	if (res == -1)
 		return -errno;
 
@@ -91,15 +3464,30 @@ static int vers_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
 	DIR *dp;
 	struct dirent *de;
+	int fd;
+	const char *target = config.as_of ? path : history_target(path);
 
 	(void) offset;
 	(void) fi;
 
-	path = prepend_storage_dir(storage_path, path);
-	dp = opendir(path);
-	if (dp == NULL)
+	if (target != NULL) {
+		pthread_mutex_lock(&store_lock);
+		fd = history_readdir(target, buf, filler);
+		pthread_mutex_unlock(&store_lock);
+		return fd;
+	}
+
+	fd = openat(storage_fd, relative_path(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
 		return -errno;
 
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
 		memset(&st, 0, sizeof(st));
@@ -117,20 +3505,28 @@ static int vers_mknod(const char *path, mode_t mode, dev_t rdev)
 {
 	int res;
 
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	path = prepend_storage_dir(storage_path, path);
+	if (read_only(path))
+		return -EROFS;
+
+	/* On Linux this could just be 'mknodat(fd, path, mode, rdev)' but
+	   this is more portable */
 	if (S_ISREG(mode)) {
-		res = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = openat(storage_fd, relative_path(path),
+			     O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
+		res = mkfifoat(storage_fd, relative_path(path), mode);
 	else
-		res = mknod(path, mode, rdev);
+		res = mknodat(storage_fd, relative_path(path), mode, rdev);
 	if (res == -1)
 		return -errno;
 
+	if (S_ISREG(mode)) {
+		pthread_mutex_lock(&store_lock);
+		note_created(path);
+		pthread_mutex_unlock(&store_lock);
+	}
 	return 0;
 }
 
@@ -138,118 +3534,67 @@ static int vers_mkdir(const char *path, mode_t mode)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = mkdir(path, mode);
+	if (read_only(path))
+		return -EROFS;
+
+	res = mkdirat(storage_fd, relative_path(path), mode);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
-static int vers_unlink(const char *path)
+static int vers_unlink_unlocked(const char *path)
 {
 	int res;
+	struct vers_file *file;
 
-	const char *filename = path; // with the slash in front of it
-	const char *vers_folder_name = "/.vers"; // the hidden versiion control folder
-	const char *tail = "_hist"; // the tail of the history folder of each file
-
-	path = prepend_storage_dir(storage_path, path);
-	res = unlink(path);
+	wait_for_snapshots(path, NULL);
+	res = unlinkat(storage_fd, relative_path(path), 0);
 	if (res == -1)
 		return -errno;
 
-	// ================================
-	// ----------- MY CODE ------------
-	
-	// getting the path to the history folder of the file
-	char hist_folder_path[256];
-
-	strcpy(hist_folder_path, storage_dir);
-	strcat(hist_folder_path, vers_folder_name);
-	strcat(hist_folder_path, filename);
-	strcat(hist_folder_path, tail);
-
-	// and to next_vers.txt
-	// to get the version to iterate two
-        const char *next_vers_name = "/next_vers.txt";
-        char next_vers_path[256]; // the path to next_vers.txt wll be here
-
-	strcpy(next_vers_path, hist_folder_path);
-	strcat(next_vers_path, next_vers_name);
-
-	// getting the version as a string via reading the file
-	int nextv;
-	int resv;
-        
-	nextv = open(next_vers_path, O_CREAT | O_RDWR, S_IRWXU);
-	
-	if (nextv == -1)
-		return -errno;
-
-	// now read the file
-	char next_vers_buf[3]; // the buffer that will store the next version
-	resv = pread(nextv, next_vers_buf, 3, 0);
-
-	if (resv == -1)
-		return -errno;
-	
-	// casting the version into an int
-	// THIS SHOULD BE USE WHLE ITERATING THROUGH FLES IN HIST FOLDER
-	int next_version_num;
-	sscanf(next_vers_buf, "%d", &next_version_num);
-
-	close(nextv);
-
-	// --------------------------------
-	// ITERATNG THROUGH THE FILES IN HIST AND UNLINKING THEM
-	
-	int i;
-
-	for (i = 0; i < next_version_num; i += 1)
-	{
-	  // casting the i into a string
-	  char vers_string_null [3]; // size is three here only due to null character
-
-	  // getting rid of a possible null character at the end
-	  sprintf(vers_string_null, "%d", i);
-
-
-	  char snap_file_path [256];
-	  const char *suffix = ",";
-	  
-	  strcpy(snap_file_path, hist_folder_path);
-	  strcat(snap_file_path, filename);
-	  strcat(snap_file_path, suffix);
-	  strcat(snap_file_path, vers_string_null);
-
-	  // unlink the file
-	  int res_snap;
-
-	  res_snap = unlink(snap_file_path);
+	// Changes not yet stored in a version go with the file.
+	file = find_file(path);
+	if (file != NULL) {
+		pthread_mutex_lock(&file->lock);
+		file->removed = 1;
+		file->dirty = 0;
+		pthread_mutex_unlock(&file->lock);
+		put_file(file);
+	}
 
-	  if (res_snap == -1)
-		  return -errno;
+	// Versions of the file still queued go with the rest of its
+	// history, so none is stored after it is gone.
+	pthread_mutex_lock(&store_lock);
+	cancel_snapshots(path);
+	res = remove_history(path);
+	pthread_mutex_unlock(&store_lock);
+	return res;
+}
 
-	}
+static int vers_unlink(const char *path)
+{
+	int res;
 
-	// DELETING THE next_vers.txt
-	unlink(next_vers_path);
+	if (read_only(path))
+		return -EROFS;
 
-	// DELETING THE foo.txt_hist folder
-	rmdir(hist_folder_path);
-	
-	// ================================
+	pthread_mutex_lock(&vers_lock);
+	res = vers_unlink_unlocked(path);
+	pthread_mutex_unlock(&vers_lock);
 
-	return 0;
+	return res;
 }
 
 static int vers_rmdir(const char *path)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = rmdir(path);
+	if (read_only(path))
+		return -EROFS;
+
+	res = unlinkat(storage_fd, relative_path(path), AT_REMOVEDIR);
 	if (res == -1)
 		return -errno;
 
@@ -259,12 +3604,13 @@ static int vers_rmdir(const char *path)
 static int vers_symlink(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = symlink(storage_from, storage_to);
+	if (read_only(to))
+		return -EROFS;
+
+	/* The link's contents are stored as given, so that relative links
+	   keep pointing inside the mount. */
+	res = symlinkat(from, storage_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -274,27 +3620,95 @@ static int vers_symlink(const char *from, const char *to)
 static int vers_rename(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
-
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = rename(storage_from, storage_to);
-	if (res == -1)
-		return -errno;
+	int fd;
+	int replaced;
+	struct stat st;
+	struct vers_file *file;
+	char *new_path;
+
+	if (read_only(from) || read_only(to))
+		return -EROFS;
+
+	pthread_mutex_lock(&vers_lock);
+	wait_for_snapshots(from, to);
+	replaced = fstatat(storage_fd, relative_path(to), &st,
+			   AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+	res = renameat(storage_fd, relative_path(from),
+		       storage_fd, relative_path(to));
+	if (res == -1) {
+		res = -errno;
+	} else if (strcmp(from, to) != 0) {
+		// Changes to the file that was replaced go with it, as they
+		// would if it had been unlinked.
+		file = find_file(to);
+		if (file != NULL) {
+			pthread_mutex_lock(&file->lock);
+			file->removed = 1;
+			file->dirty = 0;
+			pthread_mutex_unlock(&file->lock);
+			put_file(file);
+		}
+
+		// A file made by this mount to replace this one leaves no
+		// history at its old name.
+		if (replaced) {
+			pthread_mutex_lock(&store_lock);
+			res = forget_fresh_history(from);
+			pthread_mutex_unlock(&store_lock);
+			if (res < 0)
+				fprintf(stderr, "ERROR: History of %s not removed: %s\n",
+					from, strerror(-res));
+			res = 0;
+		}
+
+		// What was written to this file says nothing about how it
+		// differs from the last version under the new name, so its
+		// next version is compared with that one as a whole, pending
+		// changes or not.  Were the file left out of the list, the
+		// next open would build a delta over the file it replaced
+		// from the writes alone.
+		file = find_file(from);
+		new_path = strdup(to);
+		if (file != NULL && new_path != NULL) {
+			free(file->path);
+			file->path = new_path;
+		} else {
+			free(new_path);
+			file = fstatat(storage_fd, relative_path(to), &st,
+				       AT_SYMLINK_NOFOLLOW) == 0 &&
+			       S_ISREG(st.st_mode) ? get_file(to) : NULL;
+		}
+		if (file != NULL) {
+			pthread_mutex_lock(&file->lock);
+			mark_dirty(file, 0);
+			file->whole = 1;
+			pthread_mutex_unlock(&file->lock);
+			if (file->opens == 0 && snapshot_due(file)) {
+				fd = openat(storage_fd, relative_path(to),
+					    O_RDONLY);
+				if (fd == -1 || snapshot_file(file, fd) < 0)
+					fprintf(stderr, "ERROR: No version of %s stored\n",
+						to);
+				if (fd != -1)
+					close(fd);
+			}
+			put_file(file);
+		}
+	}
+	pthread_mutex_unlock(&vers_lock);
 
-	return 0;
+	return res;
 }
 
 static int vers_link(const char *from, const char *to)
 {
 	int res;
-	char storage_from[256];
-	char storage_to[256];
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = link(storage_from, storage_to);
+	if (read_only(from) || read_only(to))
+		return -EROFS;
+
+	res = linkat(storage_fd, relative_path(from),
+		     storage_fd, relative_path(to), 0);
 	if (res == -1)
 		return -errno;
 
@@ -305,8 +3719,10 @@ static int vers_chmod(const char *path, mode_t mode)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = chmod(path, mode);
+	if (read_only(path))
+		return -EROFS;
+
+	res = fchmodat(storage_fd, relative_path(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
@@ -317,8 +3733,11 @@ static int vers_chown(const char *path, uid_t uid, gid_t gid)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = lchown(path, uid, gid);
+	if (read_only(path))
+		return -EROFS;
+
+	res = fchownat(storage_fd, relative_path(path), uid, gid,
+		       AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -327,14 +3746,59 @@ static int vers_chown(const char *path, uid_t uid, gid_t gid)
 
 static int vers_truncate(const char *path, off_t size)
 {
+	int fd;
 	int res;
+	struct stat st;
+	struct vers_file *file;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = truncate(path, size);
+	if (read_only(path))
+		return -EROFS;
+
+	pthread_mutex_lock(&vers_lock);
+	fd = openat(storage_fd, relative_path(path), O_WRONLY);
+	if (fd == -1) {
+		res = -errno;
+		goto out;
+	}
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out_close;
+	}
+
+	file = get_file(path);
+	if (file == NULL) {
+		res = -ENOMEM;
+		goto out_close;
+	}
+	pthread_mutex_lock(&file->lock);
+	if (size != st.st_size)
+		mark_dirty(file, st.st_size);
+	res = ftruncate(fd, size);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	else
+		clip_extents(file, size);
+	pthread_mutex_unlock(&file->lock);
+
+	// A truncate with no handle open is a change of its own.  fd may not
+	// be readable, so the version is read through another descriptor,
+	// and a version that cannot be stored does not undo the truncate.
+	if (res == 0 && file->opens == 0 && snapshot_due(file)) {
+		int snap_fd = openat(storage_fd, relative_path(path), O_RDONLY);
+		int snap_res = snap_fd == -1 ? -errno : snapshot_file(file, snap_fd);
+		if (snap_res < 0)
+			fprintf(stderr, "ERROR: No version of %s stored: %s\n",
+				path, strerror(-snap_res));
+		if (snap_fd != -1)
+			close(snap_fd);
+	}
+	put_file(file);
 
-	return 0;
+out_close:
+	close(fd);
+out:
+	pthread_mutex_unlock(&vers_lock);
+	return res;
 }
 
 #ifdef HAVE_UTIMENSAT
@@ -342,9 +3806,11 @@ static int vers_utimens(const char *path, const struct timespec ts[2])
 {
 	int res;
 
+	if (read_only(path))
+		return -EROFS;
+
 	/* don't use utime/utimes since they follow symlinks */
-	path = prepend_storage_dir(storage_path, path);
-	res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
+	res = utimensat(storage_fd, relative_path(path), ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -352,277 +3818,196 @@ static int vers_utimens(const char *path, const struct timespec ts[2])
 }
 #endif
 
+// Make the pending changes of the file open through handle a new version,
+// reading them from the handle's descriptor if it can be read.  Called with
+// vers_lock held.
+static int snapshot_handle (struct vers_handle* handle) {
+  int fd = handle->fd;
+  int res;
+
+  if (handle->writeonly) {
+    fd = openat(storage_fd, relative_path(handle->file->path), O_RDONLY);
+    if (fd == -1) {
+      return -errno;
+    }
+  }
+  res = snapshot_file(handle->file, fd);
+  if (handle->writeonly) {
+    close(fd);
+  }
+  return res;
+}
+
 static int vers_open(const char *path, struct fuse_file_info *fi)
 {
-	int res;
-
-	path = prepend_storage_dir(storage_path, path);
-	res = open(path, fi->flags);
+	int res = 0;
+	int flags = fi->flags;
+	struct vers_handle *handle;
+	struct stat st;
+
+	handle = malloc(sizeof(*handle));
+	if (handle == NULL)
+		return -ENOMEM;
+	handle->writeonly = 0;
+	handle->base = 0;
+	handle->length = 0;
+
+	if (read_only(path)) {
+		char file[PATH_MAX];
+		uint64_t v;
+
+		handle->file = NULL;
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			res = -EROFS;
+		else if (config.as_of)
+			strcpy(file, path);
+		else if (!parse_version(history_target(path), file, &v))
+			res = -EISDIR;
+		if (res == 0) {
+			pthread_mutex_lock(&store_lock);
+			if (config.as_of)
+				res = as_of_version(file, &v);
+			if (res == 0)
+				res = open_history_version(file, v, &handle->fd,
+							   &handle->base,
+							   &handle->length);
+			pthread_mutex_unlock(&store_lock);
+		}
+		goto out_history;
+	}
 
-	if (res == -1)
-		return -errno;
+	// Truncation is done by hand below, so that the file's size
+	// beforehand is known, and O_APPEND is dropped because the kernel
+	// already hands us the end-of-file offset.  A write-only file may
+	// not be readable at all, so it is opened as asked and versions are
+	// read through a descriptor opened when they are made.
+	handle->writeonly = (flags & O_ACCMODE) == O_WRONLY;
+	flags &= ~(O_TRUNC | O_APPEND);
+
+	pthread_mutex_lock(&vers_lock);
+	handle->fd = openat(storage_fd, relative_path(path), flags);
+	if (handle->fd == -1) {
+		res = -errno;
+		goto out;
+	}
 
-	close(res);
+	handle->file = get_file(path);
+	if (handle->file == NULL) {
+		res = -ENOMEM;
+		close(handle->fd);
+		goto out;
+	}
+	handle->file->opens += 1;
+
+	if (fi->flags & O_TRUNC) {
+		pthread_mutex_lock(&handle->file->lock);
+		if (fstat(handle->fd, &st) == 0 && st.st_size > 0) {
+			if (ftruncate(handle->fd, 0) == -1) {
+				res = -errno;
+			} else {
+				mark_dirty(handle->file, st.st_size);
+				clip_extents(handle->file, 0);
+			}
+		}
+		pthread_mutex_unlock(&handle->file->lock);
+		if (res < 0) {
+			// Nothing changed, so the open is undone as a whole.
+			handle->file->opens -= 1;
+			close(handle->fd);
+			put_file(handle->file);
+			goto out;
+		}
+	}
 
+out:
+	pthread_mutex_unlock(&vers_lock);
+out_history:
+	if (res < 0) {
+		free(handle);
+		return res;
+	}
+	fi->fh = (uint64_t) (uintptr_t) handle;
 	return 0;
 }
 
 static int vers_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi)
 {
-	int fd;
+	struct vers_handle *handle = (struct vers_handle *) (uintptr_t) fi->fh;
 	int res;
-	int i;
-	char temp_buf[size];
-
-	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_RDONLY);
-	if (fd == -1)
-		return -errno;
 
-	res = pread(fd, temp_buf, size, offset);
+	(void) path;
+	if (handle->file == NULL) {
+		// A version, which may be a record in the middle of a log.
+		if (offset >= handle->length)
+			return 0;
+		if ((off_t) size > handle->length - offset)
+			size = handle->length - offset;
+		offset += handle->base;
+	}
+	res = pread(handle->fd, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	// Move data from temporary buffer into provided one.
-	for (i = 0; i < size; i += 1) {
-	  buf[i] = temp_buf[i];
-	}
-
-	close(fd);
 	return res;
 }
 
-static int vers_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static int vers_write_unlocked(const char *path, const char *buf, size_t size,
+			       off_t offset, struct fuse_file_info *fi)
 {
-	int fd;
+	struct vers_handle *handle = (struct vers_handle *) (uintptr_t) fi->fh;
+	struct vers_file *file = handle->file;
 	int res;
-	int i;
-	char temp_buf[size];
-
-	// storing the init path for later
-	const char *filename = path; // with the slash in front of it
-
-	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
-
-	// ================================
-	// ----------- MY CODE ------------
-	
-
-
-	// CHECK IF .vers EXISTS -> if no then create it
-	// get its full path first
-	const char *vers_folder_name = "/.vers";
-	char vers_folder_path[256]; // the full path will be here
-	
-	strcpy(vers_folder_path, storage_dir);
-	strcat(vers_folder_path, vers_folder_name);
-
-	DIR *vf = opendir(vers_folder_path);
-	if (vf == NULL)
-	{
-	  // creating the .vers directory
-	  mkdir(vers_folder_path, S_IRWXU | S_IRGRP | S_IROTH);
-	}
-
-	// CHECK IF .vers/filename.txt_hist exists -> if no then create it
-	// and put next_vers.txt into it
-	// and write a value of 0 into next_vers.txt
-	
-	// get the full path to e.g. foo.txt_hist
-	const char *tail = "_hist";
-	char hist_folder_path[256];
-
-	strcpy(hist_folder_path, storage_dir);
-	strcat(hist_folder_path, vers_folder_name);
-	strcat(hist_folder_path, filename);
-	strcat(hist_folder_path, tail);
-
-	// and to next_vers.txt
-        const char *next_vers_name = "/next_vers.txt";
-        char next_vers_path[256]; // the path to next_vers.txt wll be here
-
-	strcpy(next_vers_path, hist_folder_path);
-	strcat(next_vers_path, next_vers_name);
-
-
-	DIR *ht = opendir(hist_folder_path);
-	if (ht == NULL)
-	{
-	  // create the hist directory
-	  mkdir(hist_folder_path, S_IRWXU | S_IRGRP | S_IROTH);
-
-	  // put next_vers.txt into it
-	  
-	  int nextv;
-	  int res;
-	  // this will create the file and open it up
-	  nextv = open(next_vers_path, O_CREAT | O_RDWR , S_IRWXU);
-
-	  if (nextv == -1)
-		  return -errno;
-
-	  // writing "0" into the file
-	  char vers_buf[1];
-
-	  vers_buf[0] = '0';
-
-	  res = pwrite(nextv, vers_buf, 1, 0);
+	struct stat st;
 
-	  if (res == -1)
-		  return -errno;
-
-	  close(nextv);
-
-	}
-
-	// READING FROM next_vers.txt TO FIND THE VERSION
-	// OF THE FILE TO BE CREATED
-	
-	// first open up the file - next_vers.txt
-	int nextv;
-	int resv;
-        
-	nextv = open(next_vers_path, O_CREAT | O_RDWR, S_IRWXU);
-	
-	if (nextv == -1)
-		return -errno;
-
-	// now read the file
-	char next_vers_buf[3]; // the buffer that will store the next version
-	resv = pread(nextv, next_vers_buf, 3, 0);
-
-	if (resv == -1)
-		return -errno;
-
-	// now store that value in a variable to use LATER as a string
-	char next_version[3];
-	next_version[0] = next_vers_buf[0];
-	next_version[1] = next_vers_buf[1];
-	next_version[2] = next_vers_buf[2];
-
-	// but now update the value of the next version in the next_vers.txt by incrementing it
-	
-	// first convert a char to an int
-	//int version_num = (int) next_vers_buf[0] - (int) '0';
-	int version_num;
-	sscanf(next_vers_buf, "%d", &version_num);
-
-	// store the version before this one for LATER
-	// this is needed if an append operation is done
-	char prev_vers[3];
-
-	if (version_num != 0)
-	{
-	  int prev_vers_num = version_num - 1;
-	  sprintf(prev_vers, "%d", prev_vers_num);
+	(void) path;
+	if (!file->dirty) {
+		if (fstat(handle->fd, &st) == -1)
+			return -errno;
+		mark_dirty(file, st.st_size);
 	}
 
-	// incrementing the version number
-	version_num += 1; 
-
-	// converting it back to char ARRAY
-	char update_vers_buf [3]; // size is three here only due to null character
-
-        
-	sprintf(update_vers_buf, "%d", version_num);
-
-	// write version back into next_vers.txt
-	
-	int resv_wr;
-	resv_wr = pwrite(nextv, update_vers_buf, 2, 0);
-	
-	if (resv_wr == -1)
-		return -errno;
-
-	close(nextv);
-
-	
-	// CREATING A SNAPSHOT FILE with a suffix in .vers/foo.txt_hist/foo.txt,v
-	// getting the path to the file
-	char snap_file_path[256];
-	const char *suffix = ",";
-	strcpy(snap_file_path, hist_folder_path);
-	strcat(snap_file_path, filename);
-	strcat(snap_file_path, suffix);
-	strcat(snap_file_path, next_version);
-
-	int snap;
-	int snap_res;
-	
-	snap = open(snap_file_path, O_CREAT | O_RDWR, S_IRWXU);
-
-	if (snap == -1)
+	res = pwrite(handle->fd, buf, size, offset);
+	if (res == -1)
 		return -errno;
 
-	// IF WE ARE APPENDING TO A FILE THEN MAKE SMTH DIFFERENT WITH A temp_buf
-	// checking is the offset from which to be writen is 0
-	if (offset == 0)
-	{
-	
-	  // updating the temp_buf
-	  for (i = 0; i < size; i += 1) {
-	    temp_buf[i] = buf[i];
-	  }
-
-	  snap_res = pwrite(snap, temp_buf, size, offset);
+	// Only remember what changed; the version is made on release.
+	if (res > 0) {
+		int extent_res = add_extent(file, offset, res);
+		if (extent_res < 0)
+			return extent_res;
+		file->dirty_bytes += res;
 	}
 
-	else
-	{
-	  // read the previous version of file into temp_buf
-	  int prev_snap;
-	  int prev_snap_rd;
-	
-	  // getting the path to the prev snap
-	  char prev_snap_path[256];
-	  strcpy(prev_snap_path, hist_folder_path);
-	  strcat(prev_snap_path, filename);
-	  strcat(prev_snap_path, suffix);
-	  strcat(prev_snap_path, prev_vers);
-
-	  // open the file
-	  prev_snap = open(prev_snap_path, O_CREAT | O_RDWR, S_IRWXU);
-
-	  if (prev_snap == -1)
-		  return -errno;
-
-	  // read the file
-	  prev_snap_rd = pread(prev_snap, temp_buf, offset, 0);
-	  
-	  if (prev_snap_rd == -1)
-		  return -errno;
-
-	  // adding the new chars to the text's buffer
-	  for (i = offset; i < offset + size; i += 1)
-	  {
-	    temp_buf[i] = buf[i - offset];
-	  }
+	return res;
+}
 
-	  snap_res = pwrite(snap, temp_buf, offset + size, 0);
-	  
+static int vers_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	struct vers_handle *handle = (struct vers_handle *) (uintptr_t) fi->fh;
+	struct vers_file *file = handle->file;
+	int res;
+	int due;
+
+	// Only this file's lock, so that writes to other files go ahead.
+	pthread_mutex_lock(&file->lock);
+	res = vers_write_unlocked(path, buf, size, offset, fi);
+	due = res > 0 && config.snap_bytes &&
+	      file->dirty_bytes >= (off_t) config.snap_bytes;
+	pthread_mutex_unlock(&file->lock);
+
+	// Unless so much has been written that a version is due already.
+	if (due) {
+		pthread_mutex_lock(&vers_lock);
+		int snap_res = snapshot_handle(handle);
+		pthread_mutex_unlock(&vers_lock);
+		// The data is written all the same, so the write succeeded.
+		if (snap_res < 0)
+			fprintf(stderr, "ERROR: No version of %s stored: %s\n",
+				path, strerror(-snap_res));
 	}
 
-	if (snap_res == -1)
-		return -errno;
-
-	close(snap);
-	
-
-	//=====================
-
-	if (fd == -1)
-		return -errno;
-
-	res = pwrite(fd, buf, size, offset);
-	if (res == -1)
-		res = -errno;
-
-	close(fd);
 	return res;
 }
 
@@ -630,8 +4015,8 @@ static int vers_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = statvfs(path, stbuf);
+	(void) path;
+	res = fstatvfs(storage_fd, stbuf);
 	if (res == -1)
 		return -errno;
 
@@ -640,23 +4025,138 @@ static int vers_statfs(const char *path, struct statvfs *stbuf)
 
 static int vers_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	struct vers_handle *handle = (struct vers_handle *) (uintptr_t) fi->fh;
+	struct vers_file *file = handle->file;
+	int res = 0;
 
 	(void) path;
-	(void) fi;
+	if (file == NULL) {
+		close(handle->fd);
+		free(handle);
+		return 0;
+	}
+
+	pthread_mutex_lock(&vers_lock);
+	file->opens -= 1;
+	// The last handle closing ends a round of changes, unless the
+	// interval policy says to fold them into a later version.
+	if (file->opens == 0 && snapshot_due(file))
+		res = snapshot_handle(handle);
+	if (res < 0)
+		fprintf(stderr, "ERROR: No version of %s stored: %s\n",
+			file->path, strerror(-res));
+	close(handle->fd);
+	put_file(file);
+	pthread_mutex_unlock(&vers_lock);
+
+	free(handle);
 	return 0;
 }
 
+static void *vers_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	// Started here rather than in main(), since fuse_main() forks when
+	// it puts itself in the background and threads do not survive that.
+	if (config.codec != CODEC_NONE &&
+	    pthread_create(&compress_thread, NULL, compress_worker, NULL) == 0)
+		compress_running = 1;
+	if (pthread_create(&snap_thread, NULL, snap_worker, NULL) == 0)
+		snap_running = 1;
+	// A mount of the past only reads the store, trash included.
+	if (!config.as_of &&
+	    pthread_create(&reap_thread, NULL, reap_worker, NULL) == 0)
+		reap_running = 1;
+	if (pruning() && !config.as_of &&
+	    pthread_create(&compact_thread, NULL, compact_worker, NULL) == 0)
+		compact_running = 1;
+	return NULL;
+}
+
+/* Changes held back by the interval policy are stored when the file system
+   is unmounted.  Version files still waiting to be compressed are left as
+   they are. */
+static void vers_destroy(void *private_data)
+{
+	(void) private_data;
+
+	pthread_mutex_lock(&vers_lock);
+	for (struct vers_file *file = files; file != NULL; file = file->next) {
+		if (!file->dirty || file->removed)
+			continue;
+
+		int fd = openat(storage_fd, relative_path(file->path), O_RDONLY);
+		if (fd == -1 || snapshot_file(file, fd) < 0)
+			fprintf(stderr, "ERROR: No version of %s stored\n",
+				file->path);
+		if (fd != -1)
+			close(fd);
+	}
+	pthread_mutex_unlock(&vers_lock);
+
+	// A history being pruned is left as it was.
+	if (compact_running) {
+		pthread_mutex_lock(&compact_lock);
+		compact_stop = 1;
+		pthread_cond_signal(&compact_wake);
+		pthread_mutex_unlock(&compact_lock);
+		pthread_join(compact_thread, NULL);
+		compact_running = 0;
+	}
+
+	// The snapshot worker stores everything queued before it stops, and
+	// may still hand files to the compressor as it does.
+	if (snap_running) {
+		pthread_mutex_lock(&snap_lock);
+		snap_stop = 1;
+		pthread_cond_signal(&snap_ready);
+		pthread_mutex_unlock(&snap_lock);
+		pthread_join(snap_thread, NULL);
+		snap_running = 0;
+	}
+	if (compress_running) {
+		pthread_mutex_lock(&compress_lock);
+		compress_stop = 1;
+		pthread_cond_signal(&compress_ready);
+		pthread_mutex_unlock(&compress_lock);
+		pthread_join(compress_thread, NULL);
+		compress_running = 0;
+	}
+	// What the reaper has not got to yet stays in the trash until the
+	// next mount.
+	if (reap_running) {
+		pthread_mutex_lock(&reap_lock);
+		reap_stop = 1;
+		pthread_cond_signal(&reap_ready);
+		pthread_mutex_unlock(&reap_lock);
+		pthread_join(reap_thread, NULL);
+		reap_running = 0;
+	}
+}
+
 static int vers_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	struct vers_handle *handle = (struct vers_handle *) (uintptr_t) fi->fh;
+	int res;
 
 	(void) path;
+
+	// Versions made before the fsync() are stored by the time it returns.
+	snapshot_barrier();
+
+#ifndef HAVE_FDATASYNC
 	(void) isdatasync;
-	(void) fi;
+#else
+	if (isdatasync)
+		res = fdatasync(handle->fd);
+	else
+#endif
+		res = fsync(handle->fd);
+	if (res == -1)
+		return -errno;
+
 	return 0;
 }
 
@@ -671,9 +4171,10 @@ static int vers_fallocate(const char *path, int mode,
 
 	if (mode)
 		return -EOPNOTSUPP;
+	if (read_only(path))
+		return -EROFS;
 
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
+	fd = openat(storage_fd, relative_path(path), O_WRONLY);
 	if (fd == -1)
 		return -errno;
 
@@ -689,6 +4190,9 @@ static int vers_fallocate(const char *path, int mode,
 static int vers_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
+	char storage_path[PATH_MAX];
+	if (read_only(path))
+		return -EROFS;
 	path = prepend_storage_dir(storage_path, path);
 	int res = lsetxattr(path, name, value, size, flags);
 	if (res == -1)
@@ -699,6 +4203,7 @@ static int vers_setxattr(const char *path, const char *name, const char *value,
 static int vers_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = lgetxattr(path, name, value, size);
 	if (res == -1)
@@ -708,6 +4213,7 @@ static int vers_getxattr(const char *path, const char *name, char *value,
 
 static int vers_listxattr(const char *path, char *list, size_t size)
 {
+	char storage_path[PATH_MAX];
 	path = prepend_storage_dir(storage_path, path);
 	int res = llistxattr(path, list, size);
 	if (res == -1)
@@ -717,6 +4223,9 @@ static int vers_listxattr(const char *path, char *list, size_t size)
 
 static int vers_removexattr(const char *path, const char *name)
 {
+	char storage_path[PATH_MAX];
+	if (read_only(path))
+		return -EROFS;
 	path = prepend_storage_dir(storage_path, path);
 	int res = lremovexattr(path, name);
 	if (res == -1)
@@ -748,6 +4257,8 @@ static struct fuse_operations vers_oper = {
 	.write		= vers_write,
 	.statfs		= vers_statfs,
 	.release	= vers_release,
+	.init		= vers_init,
+	.destroy	= vers_destroy,
 	.fsync		= vers_fsync,
 #ifdef HAVE_POSIX_FALLOCATE
 	.fallocate	= vers_fallocate,
@@ -764,7 +4275,7 @@ int main(int argc, char *argv[])
 {
 	umask(0);
 	if (argc < 3) {
-	  fprintf(stderr, "USAGE: %s <storage directory> <mount point> [ -d | -f | -s ]\n", argv[0]);
+	  fprintf(stderr, "USAGE: %s <storage directory> <mount point> [ -d | -f | -s ] [ -o format=delta|chunk|log,compress=lz4|zstd|none,as_of=<time>,keep=<n> ]\n", argv[0]);
 	  return 1;
 	}
 	storage_dir = argv[1];
@@ -773,12 +4284,59 @@ int main(int argc, char *argv[])
 	  fprintf(stderr, "ERROR: Directories must be absolute paths\n");
 	  return 1;
 	}
+	storage_fd = open(storage_dir, O_RDONLY | O_DIRECTORY);
+	if (storage_fd == -1) {
+	  perror(storage_dir);
+	  return 1;
+	}
 	fprintf(stderr, "DEBUG: Mounting %s at %s\n", storage_dir, argv[2]);
+	move_legacy_journal();
 	int short_argc = argc - 1;
 	char* short_argv[short_argc];
 	short_argv[0] = argv[0];
 	for (int i = 2; i < argc; i += 1) {
 	  short_argv[i - 1] = argv[i];
 	}
-	return fuse_main(short_argc, short_argv, &vers_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(short_argc, short_argv);
+	if (fuse_opt_parse(&args, &config, vers_opts, NULL) == -1) {
+	  return 1;
+	}
+	if (config.compress != NULL) {
+	  if (strcmp(config.compress, "none") == 0) {
+	    config.codec = CODEC_NONE;
+#ifdef HAVE_LZ4
+	  } else if (strcmp(config.compress, "lz4") == 0) {
+	    config.codec = CODEC_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+	  } else if (strcmp(config.compress, "zstd") == 0) {
+	    config.codec = CODEC_ZSTD;
+#endif
+	  } else {
+	    fprintf(stderr, "ERROR: Compression %s is not available\n", config.compress);
+	    return 1;
+	  }
+	}
+	if (config.as_of_time != NULL) {
+	  config.as_of = parse_time(config.as_of_time);
+	  if (config.as_of <= 0) {
+	    fprintf(stderr, "ERROR: Cannot read time %s\n", config.as_of_time);
+	    return 1;
+	  }
+	  // Nothing in a point-in-time mount can be changed.
+	  fuse_opt_add_arg(&args, "-oro");
+	}
+	if (config.format != NULL) {
+	  if (strcmp(config.format, "chunk") == 0) {
+	    config.chunked = 1;
+	  } else if (strcmp(config.format, "log") == 0) {
+	    config.logged = 1;
+	  } else if (strcmp(config.format, "delta") != 0) {
+	    fprintf(stderr, "ERROR: Unknown history format %s\n", config.format);
+	    return 1;
+	  }
+	}
+	int res = fuse_main(args.argc, args.argv, &vers_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }